@@ -4,18 +4,22 @@ in vec3 normal_eye;
 
 out vec4 frag_color;
 
-uniform samplerCube skybox_texture;
-uniform mat4 view;
+layout(binding = 0) uniform samplerCube skybox_texture;
+layout(std140, binding = 0) uniform FrameBlock {
+  mat4 view;
+  mat4 projection;
+  mat4 sky_view;
+  mat4 view_inverse;
+};
 
 float factor = 1.0/2.4;
 
 void main() {
-  mat4 inv = inverse(view);
   vec3 incident_eye = normalize(position_eye);
   vec3 normal = normalize(normal_eye);
   vec3 reflected = reflect(incident_eye, normal);
   vec3 refracted = refract(incident_eye, normal, factor);
-  reflected = vec3(inv * vec4(reflected, 0.0));
-  refracted = vec3(inv * vec4(refracted, 0.0));
+  reflected = vec3(view_inverse * vec4(reflected, 0.0));
+  refracted = vec3(view_inverse * vec4(refracted, 0.0));
   frag_color = texture(skybox_texture, refracted) * texture(skybox_texture, reflected);
 }
@@ -3,14 +3,19 @@
 layout (vertices = 3) out;
 
 in vec3 normal[];
+in mat4 instance[];
 
 out vec3 norm[];
+patch out mat4 patch_instance;
 
 uniform int tess_level = 0;
 
 void main() {
   gl_out[gl_InvocationID].gl_Position = gl_in[gl_InvocationID].gl_Position;
   norm[gl_InvocationID] = normal[gl_InvocationID];
+  if (gl_InvocationID == 0) {
+    patch_instance = instance[0];
+  }
 
   gl_TessLevelInner[0] = tess_level;
   gl_TessLevelOuter[0] = tess_level + 1;
@@ -1,10 +1,16 @@
 #version 460 core
 layout (location = 0) in vec3 in_position; // position
 layout (location = 1) in vec3 in_normal;   // normal
+layout (location = 3) in vec4 position_offset; // dequantisation, constant per draw
+layout (location = 4) in vec4 position_scale;  // w is 1 for octahedral normals
+layout (location = 5) in mat4 instance_transform; // per instance, locations 5-8
 
 out vec3 normal;
+out mat4 instance;
 
 void main() {
-  normal = normalize(in_position);
-  gl_Position = vec4(in_position, 1.0);
+  vec3 p = in_position * position_scale.xyz + position_offset.xyz;
+  normal = normalize(p);
+  instance = instance_transform;
+  gl_Position = vec4(p, 1.0);
 }
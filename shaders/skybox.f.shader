@@ -1,6 +1,6 @@
 #version 460 core
 in vec3 texture_coords;
-uniform samplerCube skybox_texture;
+layout(binding = 0) uniform samplerCube skybox_texture;
 out vec4 frag_color;
 
 void main() {
@@ -1,12 +1,19 @@
 #version 460 core
 layout (location = 0) in vec3 position;
+layout (location = 3) in vec4 position_offset; // dequantisation, constant per draw
+layout (location = 4) in vec4 position_scale;
 
-uniform mat4 view;
-uniform mat4 projection;
+layout(std140, binding = 0) uniform FrameBlock {
+  mat4 view;
+  mat4 projection;
+  mat4 sky_view;
+  mat4 view_inverse;
+};
 
 out vec3 texture_coords;
 
 void main() {
-  texture_coords = position;
-  gl_Position = projection * view * vec4(position, 1.0);
+  vec3 p = position * position_scale.xyz + position_offset.xyz;
+  texture_coords = p;
+  gl_Position = projection * sky_view * vec4(p, 1.0);
 }
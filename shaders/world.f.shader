@@ -1,14 +1,49 @@
 #version 460 core
+#if defined(MATERIALS) && defined(RENDERER_BINDLESS)
+#extension GL_ARB_bindless_texture : require
+#endif
 in vec3 position_eye;
 in vec3 normal_eye;
 in vec2 st;
 
 out vec4 frag_color;
 
-uniform sampler2D first_texture;
-uniform sampler2D second_texture;
+#ifdef MATERIALS
+// The legacy path multiplies two samples of the same texture, a material
+// is squared to keep that look.
+flat in uint material_index;
+#ifdef RENDERER_BINDLESS
+layout(std140, binding = 2) uniform MaterialBlock {
+  uvec2 material_handles[RENDERER_MAX_MATERIALS];
+};
 
-uniform mat4 view; //TODO
+vec4 surface_color() {
+  vec4 color = texture(sampler2D(material_handles[material_index]), st);
+  return color * color;
+}
+#else
+layout(binding = 0) uniform sampler2DArray material_textures;
+
+vec4 surface_color() {
+  vec4 color = texture(material_textures, vec3(st, float(material_index)));
+  return color * color;
+}
+#endif
+#else
+layout(binding = 0) uniform sampler2D first_texture;
+layout(binding = 1) uniform sampler2D second_texture;
+
+vec4 surface_color() {
+  return texture(first_texture, st) * texture(second_texture, st);
+}
+#endif
+
+layout(std140, binding = 0) uniform FrameBlock {
+  mat4 view;
+  mat4 projection;
+  mat4 sky_view;
+  mat4 view_inverse;
+};
 vec3 light_position = vec3(-10.0, 20.0, -10.0); //TODO
 
 // Light colors
@@ -41,5 +76,5 @@ void main() {
   d = max(dot(reflection_eye, surface_to_viewer), 0.0);
   //vec3 Is = Ls * Ks * pow(d, specular_power);
   vec3 Is = vec3(0.0, 0.0, 0.0);
-  frag_color = vec4(Is + Id + Ia, 1.0) * texture(first_texture, st) * texture(second_texture, st);
+  frag_color = vec4(Is + Id + Ia, 1.0) * surface_color();
 }
@@ -2,43 +2,51 @@
 layout (location = 0) in vec3 position; // position
 layout (location = 1) in vec3 normal;   // normal
 layout (location = 2) in vec2 tex_st;   // texture st
-
-uniform vec4 instance_data[20];
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+layout (location = 3) in vec4 position_offset; // dequantisation, constant per draw
+layout (location = 4) in vec4 position_scale;  // w is 1 for octahedral normals
+layout (location = 5) in mat4 instance_transform; // per instance, locations 5-8
+
+layout(std140, binding = 0) uniform FrameBlock {
+  mat4 view;
+  mat4 projection;
+  mat4 sky_view;
+  mat4 view_inverse;
+};
+layout(std140, binding = 1) uniform DrawBlock {
+  mat4 model;
+  uint material;
+};
 
 out vec3 position_eye;
 out vec3 normal_eye;
 out vec2 st;
-
-mat4 translate(float x, float y, float z) {
-  return mat4(1.0, 0.0, 0.0, 0.0,
-              0.0, 1.0, 0.0, 0.0,
-              0.0, 0.0, 1.0, 0.0,
-              x,   y,   z,   1.0);
-}
-
-mat4 rotate_y(float deg) {
-  const float c = cos(radians(deg));
-  const float s = sin(radians(deg));
-  return mat4(c,   0.0, s,   0.0,
-              0.0, 1.0, 0.0, 0.0,
-              -s,  0.0, c,   0.0,
-              0.0, 0.0, 0.0, 1.0);
+#ifdef MATERIALS
+flat out uint material_index;
+#endif
+
+vec3 decode_normal(vec3 n) {
+  if (position_scale.w < 0.5) {
+    return n;
+  }
+  vec3 o = vec3(n.xy, 1.0 - abs(n.x) - abs(n.y));
+  float t = max(-o.z, 0.0);
+  o.xy += vec2(o.x >= 0.0 ? -t : t, o.y >= 0.0 ? -t : t);
+  return normalize(o);
 }
 
 void main() {
-  mat4 translation = translate(
-    instance_data[gl_InstanceID].x,
-    instance_data[gl_InstanceID].y,
-    instance_data[gl_InstanceID].z);
-
-  mat4 rotation = rotate_y(instance_data[gl_InstanceID].w);
-
   st = tex_st;
 
-  position_eye = vec3(view * translation * rotation * model * vec4(position, 1.0));
-  normal_eye = vec3(view * model * vec4(normal, 0.0));
+  // The instance material offset rides in the unused projective row
+  mat4 instance = instance_transform;
+  instance[0].w = 0.0;
+#ifdef MATERIALS
+  material_index = material + uint(instance_transform[0].w + 0.5);
+#endif
+
+  mat4 world = instance * model;
+  vec3 p = position * position_scale.xyz + position_offset.xyz;
+  position_eye = vec3(view * world * vec4(p, 1.0));
+  normal_eye = vec3(view * world * vec4(decode_normal(normal), 0.0));
   gl_Position = projection * vec4(position_eye, 1.0);
 }
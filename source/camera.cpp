@@ -93,4 +93,8 @@ void Camera::update_view_matrices(CameraMatrixBlock* block, Input* input, f32 de
   block->view = mat4_translate(-position.x, -position.y, -position.z) * block->rotation;
 }
 
+void Camera::frustum(Frustum* frustum, const CameraMatrixBlock& block, const mat4& projection) {
+  frustum_from_matrix(frustum, block.view * projection);
+}
+
 } // namespace Themepark
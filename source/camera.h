@@ -8,6 +8,7 @@
 #include "vec3.h"
 #include "vec2.h"
 #include "mat4.h"
+#include "culling.h"
 
 namespace Themepark {
 
@@ -29,6 +30,9 @@ public:
 
   void update_view_matrices(CameraMatrixBlock* block, Input* input, f32 delta_time);
 
+  // Planes of the view in block seen through projection, world space.
+  static void frustum(Frustum* frustum, const CameraMatrixBlock& block, const mat4& projection);
+
 private:
   vec3 position{};
   vec3 position_old{};
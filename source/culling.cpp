@@ -0,0 +1,140 @@
+// culling.cpp
+// Kostya Leshenko
+// CS447P
+// Themepark
+
+#include "culling.h"
+
+namespace Themepark {
+
+namespace {
+
+vec4 normalized_plane(f32 a, f32 b, f32 c, f32 d) {
+  const f32 length = sqrtf(a * a + b * b + c * c);
+  const f32 inverse = length > 0.0F ? 1.0F / length : 0.0F;
+  return vec4(a * inverse, b * inverse, c * inverse, d * inverse);
+}
+
+} // namespace
+
+// Clip space is p * view_projection, so each plane is the fourth column
+// plus or minus one of the others (Gribb and Hartmann).
+void frustum_from_matrix(Frustum* frustum, const mat4& view_projection) {
+  ASSERT(frustum != nullptr);
+  const f32* m = view_projection.m;
+  for (u32 axis = 0; axis < 3; ++axis) {
+    frustum->planes[axis * 2 + 0] = normalized_plane(m[3] + m[axis], m[7] + m[4 + axis],
+        m[11] + m[8 + axis], m[15] + m[12 + axis]);
+    frustum->planes[axis * 2 + 1] = normalized_plane(m[3] - m[axis], m[7] - m[4 + axis],
+        m[11] - m[8 + axis], m[15] - m[12 + axis]);
+  }
+}
+
+bool frustum_test_sphere(const Frustum& frustum, const vec4& sphere) {
+  for (u32 i = 0; i < FRUSTUM_PLANE_COUNT; ++i) {
+    const vec4& p = frustum.planes[i];
+    if (p.x * sphere.x + p.y * sphere.y + p.z * sphere.z + p.w < -sphere.w) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Only the corner furthest along each plane normal needs testing.
+bool frustum_test_box(const Frustum& frustum, const vec3& bounds_min, const vec3& bounds_max) {
+  for (u32 i = 0; i < FRUSTUM_PLANE_COUNT; ++i) {
+    const vec4& p = frustum.planes[i];
+    const f32 x = p.x >= 0.0F ? bounds_max.x : bounds_min.x;
+    const f32 y = p.y >= 0.0F ? bounds_max.y : bounds_min.y;
+    const f32 z = p.z >= 0.0F ? bounds_max.z : bounds_min.z;
+    if (p.x * x + p.y * y + p.z * z + p.w < 0.0F) {
+      return false;
+    }
+  }
+  return true;
+}
+
+vec4 transform_sphere(const vec4& sphere, const mat4& transform) {
+  const f32* m = transform.m;
+  // Rows carry the scale of S * R, columns the scale of R * S
+  f32 scale = 0.0F;
+  for (u32 i = 0; i < 3; ++i) {
+    const f32 row = m[i * 4] * m[i * 4] + m[i * 4 + 1] * m[i * 4 + 1] + m[i * 4 + 2] * m[i * 4 + 2];
+    const f32 column = m[i] * m[i] + m[4 + i] * m[4 + i] + m[8 + i] * m[8 + i];
+    scale = row > scale ? row : scale;
+    scale = column > scale ? column : scale;
+  }
+  return vec4(sphere.x * m[0] + sphere.y * m[4] + sphere.z * m[8] + m[12],
+      sphere.x * m[1] + sphere.y * m[5] + sphere.z * m[9] + m[13],
+      sphere.x * m[2] + sphere.y * m[6] + sphere.z * m[10] + m[14],
+      sphere.w * sqrtf(scale));
+}
+
+void transform_box(const vec3& bounds_min, const vec3& bounds_max, const mat4& transform,
+    vec3* out_min, vec3* out_max) {
+  ASSERT(out_min != nullptr && out_max != nullptr);
+  const f32* m = transform.m;
+  const vec3 c = (bounds_min + bounds_max) * 0.5F;
+  const vec3 e = (bounds_max - bounds_min) * 0.5F;
+  f32 center[3];
+  f32 extent[3];
+  for (u32 col = 0; col < 3; ++col) {
+    center[col] = c.x * m[col] + c.y * m[4 + col] + c.z * m[8 + col] + m[12 + col];
+    extent[col] = e.x * fabsf(m[col]) + e.y * fabsf(m[4 + col]) + e.z * fabsf(m[8 + col]);
+  }
+  out_min->set(center[0] - extent[0], center[1] - extent[1], center[2] - extent[2]);
+  out_max->set(center[0] + extent[0], center[1] + extent[1], center[2] + extent[2]);
+}
+
+// Four spheres are transposed into x, y, z and radius registers and
+// tested against one plane at a time, a lane survives while its
+// distance stays at or above -radius.
+u32 frustum_cull_spheres(const Frustum& frustum, const vec4* spheres, u32 count, u32* visible) {
+  ASSERT(visible != nullptr || count == 0);
+  __m128 plane_x[FRUSTUM_PLANE_COUNT];
+  __m128 plane_y[FRUSTUM_PLANE_COUNT];
+  __m128 plane_z[FRUSTUM_PLANE_COUNT];
+  __m128 plane_w[FRUSTUM_PLANE_COUNT];
+  for (u32 p = 0; p < FRUSTUM_PLANE_COUNT; ++p) {
+    plane_x[p] = _mm_set1_ps(frustum.planes[p].x);
+    plane_y[p] = _mm_set1_ps(frustum.planes[p].y);
+    plane_z[p] = _mm_set1_ps(frustum.planes[p].z);
+    plane_w[p] = _mm_set1_ps(frustum.planes[p].w);
+  }
+
+  const __m128 sign = _mm_set1_ps(-0.0F);
+  u32 visible_count = 0;
+  u32 i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128 x = _mm_loadu_ps(&spheres[i + 0].x);
+    __m128 y = _mm_loadu_ps(&spheres[i + 1].x);
+    __m128 z = _mm_loadu_ps(&spheres[i + 2].x);
+    __m128 r = _mm_loadu_ps(&spheres[i + 3].x);
+    _MM_TRANSPOSE4_PS(x, y, z, r);
+    const __m128 negative_r = _mm_xor_ps(r, sign);
+
+    __m128 inside = _mm_cmpeq_ps(r, r);
+    for (u32 p = 0; p < FRUSTUM_PLANE_COUNT; ++p) {
+      __m128 d = _mm_add_ps(_mm_mul_ps(plane_x[p], x), plane_w[p]);
+      d = _mm_add_ps(d, _mm_mul_ps(plane_y[p], y));
+      d = _mm_add_ps(d, _mm_mul_ps(plane_z[p], z));
+      inside = _mm_and_ps(inside, _mm_cmpge_ps(d, negative_r));
+    }
+
+    const u32 mask = (u32)_mm_movemask_ps(inside);
+    for (u32 lane = 0; lane < 4; ++lane) {
+      if (mask & (1U << lane)) {
+        visible[visible_count++] = i + lane;
+      }
+    }
+  }
+
+  for (; i < count; ++i) {
+    if (frustum_test_sphere(frustum, spheres[i])) {
+      visible[visible_count++] = i;
+    }
+  }
+  return visible_count;
+}
+
+} // namespace Themepark
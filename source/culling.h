@@ -0,0 +1,43 @@
+// culling.h
+// Kostya Leshenko
+// CS447P
+// Themepark
+
+#pragma once
+
+#include "defines.h"
+#include "vec3.h"
+#include "vec4.h"
+#include "mat4.h"
+
+#define FRUSTUM_PLANE_COUNT 6
+
+namespace Themepark {
+
+// Normalised planes with the normals pointing inwards, a point p is
+// inside a plane when dot(plane.xyz, p) + plane.w >= 0.
+struct Frustum {
+  vec4 planes[FRUSTUM_PLANE_COUNT]; // left, right, bottom, top, near, far
+};
+
+// Planes of a row vector view * projection matrix.
+void frustum_from_matrix(Frustum* frustum, const mat4& view_projection);
+
+// Spheres are xyz centre and w radius.
+bool frustum_test_sphere(const Frustum& frustum, const vec4& sphere);
+bool frustum_test_box(const Frustum& frustum, const vec3& bounds_min, const vec3& bounds_max);
+
+// Bounds after transform. The sphere radius grows by the longest row or
+// column of the 3x3 part, which is the largest scale of a rotation with
+// axis scales on either side. The box is the box around the transformed
+// one. Only the affine part of transform is used, instance materials in
+// m[3] are ignored.
+vec4 transform_sphere(const vec4& sphere, const mat4& transform);
+void transform_box(const vec3& bounds_min, const vec3& bounds_max, const mat4& transform,
+    vec3* out_min, vec3* out_max);
+
+// Tests four spheres per step with SSE. Writes the indices of the
+// visible spheres in order and returns how many there are.
+u32 frustum_cull_spheres(const Frustum& frustum, const vec4* spheres, u32 count, u32* visible);
+
+} // namespace Themepark
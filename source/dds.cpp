@@ -0,0 +1,651 @@
+// dds.cpp
+// Kostya Leshenko
+// CS447P
+// Themepark
+
+#include "dds.h"
+#include "image.h"
+#include "logging.h"
+
+namespace Themepark {
+
+namespace {
+
+// https://learn.microsoft.com/en-us/windows/win32/direct3ddds/dds-header
+struct DDSPixelFormat {
+  u32 size;
+  u32 flags;
+  u32 four_cc;
+  u32 rgb_bit_count;
+  u32 r_mask;
+  u32 g_mask;
+  u32 b_mask;
+  u32 a_mask;
+};
+
+struct DDSHeader {
+  u32 magic;
+  u32 size;
+  u32 flags;
+  u32 height;
+  u32 width;
+  u32 pitch_or_linear_size;
+  u32 depth;
+  u32 mip_map_count;
+  u32 reserved1[11];
+  DDSPixelFormat pixel_format;
+  u32 caps;
+  u32 caps2;
+  u32 caps3;
+  u32 caps4;
+  u32 reserved2;
+};
+
+static_assert(sizeof(DDSHeader) == 128, "Unexpected DDSHeader size!");
+
+constexpr u32 four_cc(char a, char b, char c, char d) {
+  return (u32)(u8)a | ((u32)(u8)b << 8) | ((u32)(u8)c << 16) | ((u32)(u8)d << 24);
+}
+
+constexpr u32 cDDSMagic = four_cc('D', 'D', 'S', ' ');
+constexpr u32 cDDSHeaderSize = 124;
+constexpr u32 cDDSFlags = 0x1 | 0x2 | 0x4 | 0x1000 | 0x20000 | 0x80000; // caps..linear size
+constexpr u32 cDDSPixelFourCC = 0x4;
+constexpr u32 cDDSCapsTexture = 0x1000;
+constexpr u32 cDDSCapsMipmap = 0x400000 | 0x8;
+
+// bc_check images, odd sizes so the edge blocks are partly outside.
+constexpr u32 cCheckWidth = 61;
+constexpr u32 cCheckHeight = 35;
+constexpr f64 cCheckMinPsnr = 35.0; // dB over the gradient image
+constexpr u32 cCheckMaxTwoColorError = 8; // 565 rounding of exact endpoints
+
+u16 pack_565(f32 r, f32 g, f32 b) {
+  const u32 r5 = (u32)(r * (31.0F / 255.0F) + 0.5F);
+  const u32 g6 = (u32)(g * (63.0F / 255.0F) + 0.5F);
+  const u32 b5 = (u32)(b * (31.0F / 255.0F) + 0.5F);
+  return (u16)((r5 << 11) | (g6 << 5) | b5);
+}
+
+void unpack_565(u16 c, i32* rgb) {
+  const i32 r = (c >> 11) & 31;
+  const i32 g = (c >> 5) & 63;
+  const i32 b = c & 31;
+  rgb[0] = (r << 3) | (r >> 2);
+  rgb[1] = (g << 2) | (g >> 4);
+  rgb[2] = (b << 3) | (b >> 2);
+}
+
+// The palette both the encoder and the decoder use, four_color is the
+// BC1 c0 > c1 mode and always the mode for BC3.
+void color_palette(u16 c0, u16 c1, bool four_color, i32 palette[4][4]) {
+  unpack_565(c0, palette[0]);
+  unpack_565(c1, palette[1]);
+  palette[0][3] = 255;
+  palette[1][3] = 255;
+  for (u32 i = 0; i < 3; ++i) {
+    if (four_color) {
+      palette[2][i] = (2 * palette[0][i] + palette[1][i]) / 3;
+      palette[3][i] = (palette[0][i] + 2 * palette[1][i]) / 3;
+    } else {
+      palette[2][i] = (palette[0][i] + palette[1][i]) / 2;
+      palette[3][i] = 0;
+    }
+  }
+  palette[2][3] = 255;
+  palette[3][3] = four_color ? 255 : 0;
+}
+
+void alpha_palette(u8 a0, u8 a1, i32 palette[8]) {
+  palette[0] = a0;
+  palette[1] = a1;
+  if (a0 > a1) {
+    for (i32 i = 1; i < 7; ++i) {
+      palette[i + 1] = ((7 - i) * a0 + i * a1) / 7;
+    }
+  } else {
+    for (i32 i = 1; i < 5; ++i) {
+      palette[i + 1] = ((5 - i) * a0 + i * a1) / 5;
+    }
+    palette[6] = 0;
+    palette[7] = 255;
+  }
+}
+
+// Endpoints at the extremes of the block's principal axis, then every
+// pixel takes the nearest of the four palette entries.
+void encode_color(const u8* rgba, u8* block) {
+  f32 mean[3] = {};
+  for (u32 p = 0; p < 16; ++p) {
+    for (u32 i = 0; i < 3; ++i) {
+      mean[i] += rgba[p * 4 + i];
+    }
+  }
+  for (u32 i = 0; i < 3; ++i) {
+    mean[i] /= 16.0F;
+  }
+
+  f32 cov[6] = {};
+  for (u32 p = 0; p < 16; ++p) {
+    const f32 r = rgba[p * 4 + 0] - mean[0];
+    const f32 g = rgba[p * 4 + 1] - mean[1];
+    const f32 b = rgba[p * 4 + 2] - mean[2];
+    cov[0] += r * r;
+    cov[1] += r * g;
+    cov[2] += r * b;
+    cov[3] += g * g;
+    cov[4] += g * b;
+    cov[5] += b * b;
+  }
+
+  // A few power iterations are plenty for a 3x3 matrix
+  f32 axis[3] = {1.0F, 1.0F, 1.0F};
+  for (u32 k = 0; k < 4; ++k) {
+    const f32 x = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+    const f32 y = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+    const f32 z = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+    const f32 len = sqrtf(x * x + y * y + z * z);
+    if (len < 1.0e-6F) {
+      break;
+    }
+    axis[0] = x / len;
+    axis[1] = y / len;
+    axis[2] = z / len;
+  }
+
+  f32 t_min = 0.0F;
+  f32 t_max = 0.0F;
+  for (u32 p = 0; p < 16; ++p) {
+    const f32 t = (rgba[p * 4 + 0] - mean[0]) * axis[0]
+        + (rgba[p * 4 + 1] - mean[1]) * axis[1]
+        + (rgba[p * 4 + 2] - mean[2]) * axis[2];
+    t_min = t < t_min ? t : t_min;
+    t_max = t > t_max ? t : t_max;
+  }
+
+  f32 e0[3];
+  f32 e1[3];
+  for (u32 i = 0; i < 3; ++i) {
+    e0[i] = fminf(fmaxf(mean[i] + axis[i] * t_max, 0.0F), 255.0F);
+    e1[i] = fminf(fmaxf(mean[i] + axis[i] * t_min, 0.0F), 255.0F);
+  }
+
+  u16 c0 = pack_565(e0[0], e0[1], e0[2]);
+  u16 c1 = pack_565(e1[0], e1[1], e1[2]);
+  if (c0 < c1) {
+    const u16 tmp = c0;
+    c0 = c1;
+    c1 = tmp;
+  }
+
+  u32 indices = 0;
+  if (c0 != c1) {
+    i32 palette[4][4];
+    color_palette(c0, c1, true, palette);
+    for (u32 p = 0; p < 16; ++p) {
+      u32 best = 0;
+      i32 best_error = INT32_MAX;
+      for (u32 c = 0; c < 4; ++c) {
+        const i32 dr = rgba[p * 4 + 0] - palette[c][0];
+        const i32 dg = rgba[p * 4 + 1] - palette[c][1];
+        const i32 db = rgba[p * 4 + 2] - palette[c][2];
+        const i32 error = dr * dr + dg * dg + db * db;
+        if (error < best_error) {
+          best_error = error;
+          best = c;
+        }
+      }
+      indices |= best << (p * 2);
+    }
+  }
+
+  memcpy(&block[0], &c0, sizeof(u16));
+  memcpy(&block[2], &c1, sizeof(u16));
+  memcpy(&block[4], &indices, sizeof(u32));
+}
+
+void encode_alpha(const u8* rgba, u8* block) {
+  u8 a0 = 0;
+  u8 a1 = 255;
+  for (u32 p = 0; p < 16; ++p) {
+    const u8 a = rgba[p * 4 + 3];
+    a0 = a > a0 ? a : a0;
+    a1 = a < a1 ? a : a1;
+  }
+
+  u64 indices = 0;
+  if (a0 != a1) {
+    i32 palette[8];
+    alpha_palette(a0, a1, palette);
+    for (u32 p = 0; p < 16; ++p) {
+      u64 best = 0;
+      i32 best_error = INT32_MAX;
+      for (u32 c = 0; c < 8; ++c) {
+        const i32 d = rgba[p * 4 + 3] - palette[c];
+        if (d * d < best_error) {
+          best_error = d * d;
+          best = c;
+        }
+      }
+      indices |= best << (p * 3);
+    }
+  }
+
+  block[0] = a0;
+  block[1] = a1;
+  for (u32 i = 0; i < 6; ++i) {
+    block[2 + i] = (u8)(indices >> (i * 8));
+  }
+}
+
+void decode_color(const u8* block, bool bc1, u8* rgba) {
+  u16 c0;
+  u16 c1;
+  u32 indices;
+  memcpy(&c0, &block[0], sizeof(u16));
+  memcpy(&c1, &block[2], sizeof(u16));
+  memcpy(&indices, &block[4], sizeof(u32));
+
+  i32 palette[4][4];
+  color_palette(c0, c1, !bc1 || c0 > c1, palette);
+  for (u32 p = 0; p < 16; ++p) {
+    const i32* c = palette[(indices >> (p * 2)) & 3];
+    rgba[p * 4 + 0] = (u8)c[0];
+    rgba[p * 4 + 1] = (u8)c[1];
+    rgba[p * 4 + 2] = (u8)c[2];
+    rgba[p * 4 + 3] = (u8)c[3];
+  }
+}
+
+// 2x2 box filter, odd sizes repeat the last row or column.
+void downsample(const u8* src, u32 width, u32 height, u8* dst) {
+  const u32 dst_width = width > 1 ? width / 2 : 1;
+  const u32 dst_height = height > 1 ? height / 2 : 1;
+  for (u32 y = 0; y < dst_height; ++y) {
+    const u32 y0 = y * 2;
+    const u32 y1 = y0 + 1 < height ? y0 + 1 : y0;
+    for (u32 x = 0; x < dst_width; ++x) {
+      const u32 x0 = x * 2;
+      const u32 x1 = x0 + 1 < width ? x0 + 1 : x0;
+      for (u32 c = 0; c < 4; ++c) {
+        const u32 sum = src[(y0 * width + x0) * 4 + c] + src[(y0 * width + x1) * 4 + c]
+            + src[(y1 * width + x0) * 4 + c] + src[(y1 * width + x1) * 4 + c];
+        dst[(y * dst_width + x) * 4 + c] = (u8)((sum + 2) / 4);
+      }
+    }
+  }
+}
+
+void encode_level(TextureFormat format, const u8* rgba, u32 width, u32 height, u8* out) {
+  const u32 block_size = format == TextureFormat::BC1 ? 8 : 16;
+  u8 pixels[16 * 4];
+  for (u32 by = 0; by < height; by += 4) {
+    for (u32 bx = 0; bx < width; bx += 4) {
+      // Edge blocks of small levels repeat the last pixel
+      for (u32 p = 0; p < 16; ++p) {
+        u32 x = bx + (p & 3);
+        u32 y = by + (p >> 2);
+        x = x < width ? x : width - 1;
+        y = y < height ? y : height - 1;
+        memcpy(&pixels[p * 4], &rgba[(y * width + x) * 4], 4);
+      }
+
+      if (format == TextureFormat::BC1) {
+        bc1_encode_block(pixels, out);
+      } else {
+        bc3_encode_block(pixels, out);
+      }
+      out += block_size;
+    }
+  }
+}
+
+u32 check_random(u32* state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+// Smooth ramps in every channel, what mip chains of real textures look like.
+void check_gradient_image(u8* rgba, u32 width, u32 height) {
+  for (u32 y = 0; y < height; ++y) {
+    for (u32 x = 0; x < width; ++x) {
+      u8* pixel = &rgba[(y * width + x) * 4];
+      pixel[0] = (u8)(x * 255 / (width - 1));
+      pixel[1] = (u8)(y * 255 / (height - 1));
+      pixel[2] = (u8)((x + y) * 255 / (width + height - 2));
+      pixel[3] = (u8)(255 - x * 255 / (width - 1));
+    }
+  }
+}
+
+// Every 4x4 block holds two random colours, which the encoder can hit
+// up to 565 and alpha rounding.
+void check_two_color_image(u8* rgba, u32 width, u32 height) {
+  u32 state = 0x2545F491;
+  for (u32 by = 0; by < height; by += 4) {
+    for (u32 bx = 0; bx < width; bx += 4) {
+      const u32 colors[2] = {check_random(&state), check_random(&state)};
+      const u32 pattern = check_random(&state);
+      for (u32 p = 0; p < 16; ++p) {
+        const u32 x = bx + (p & 3);
+        const u32 y = by + (p >> 2);
+        if (x < width && y < height) {
+          memcpy(&rgba[(y * width + x) * 4], &colors[(pattern >> p) & 1], 4);
+        }
+      }
+    }
+  }
+}
+
+// Round trips rgba through the encoder and the reference decoder. BC1
+// is compared on RGB only, its alpha is either opaque or punched out.
+bool check_level(TextureFormat format, const u8* rgba, u32 width, u32 height, u8* blocks,
+    u8* decoded, const char* name, f64 min_psnr, u32 max_error) {
+  encode_level(format, rgba, width, height, blocks);
+  if (!bc_decode_level(format, blocks, width, height, decoded)) {
+    return false;
+  }
+
+  const u32 channels = format == TextureFormat::BC1 ? 3 : 4;
+  f64 squared_error = 0.0;
+  u32 worst = 0;
+  for (u64 i = 0; i < (u64)width * height; ++i) {
+    for (u32 c = 0; c < channels; ++c) {
+      const i32 d = (i32)decoded[i * 4 + c] - (i32)rgba[i * 4 + c];
+      const u32 error = (u32)(d < 0 ? -d : d);
+      worst = error > worst ? error : worst;
+      squared_error += (f64)d * d;
+    }
+  }
+  const f64 mse = squared_error / ((f64)width * height * channels);
+  const f64 psnr = mse > 0.0 ? 10.0 * log10(255.0 * 255.0 / mse) : 99.0;
+
+  const bool result = psnr >= min_psnr && worst <= max_error;
+  if (result) {
+    LOG_INFO("BC check: %s %s %0.2f dB, max error %u", format == TextureFormat::BC1 ? "BC1" : "BC3",
+        name, psnr, worst);
+  } else {
+    LOG_ERROR("BC check: %s %s %0.2f dB, max error %u is out of bounds",
+        format == TextureFormat::BC1 ? "BC1" : "BC3", name, psnr, worst);
+  }
+  return result;
+}
+
+} // namespace
+
+u64 bc_level_size(TextureFormat format, u32 width, u32 height) {
+  const u64 blocks_x = width > 4 ? (width + 3) / 4 : 1;
+  const u64 blocks_y = height > 4 ? (height + 3) / 4 : 1;
+  return blocks_x * blocks_y * (format == TextureFormat::BC1 ? 8 : 16);
+}
+
+void bc1_encode_block(const u8* rgba, u8* block) {
+  encode_color(rgba, block);
+}
+
+void bc3_encode_block(const u8* rgba, u8* block) {
+  encode_alpha(rgba, block);
+  encode_color(rgba, block + 8);
+}
+
+void bc1_decode_block(const u8* block, u8* rgba) {
+  decode_color(block, true, rgba);
+}
+
+void bc3_decode_block(const u8* block, u8* rgba) {
+  decode_color(block + 8, false, rgba);
+
+  i32 palette[8];
+  alpha_palette(block[0], block[1], palette);
+  u64 indices = 0;
+  for (u32 i = 0; i < 6; ++i) {
+    indices |= (u64)block[2 + i] << (i * 8);
+  }
+  for (u32 p = 0; p < 16; ++p) {
+    rgba[p * 4 + 3] = (u8)palette[(indices >> (p * 3)) & 7];
+  }
+}
+
+bool bc_decode_level(TextureFormat format, const u8* data, u32 width, u32 height, u8* rgba) {
+  const u32 block_size = format == TextureFormat::BC1 ? 8 : 16;
+  u8 pixels[16 * 4];
+  for (u32 by = 0; by < height; by += 4) {
+    for (u32 bx = 0; bx < width; bx += 4) {
+      if (format == TextureFormat::BC1) {
+        bc1_decode_block(data, pixels);
+      } else {
+        bc3_decode_block(data, pixels);
+      }
+      data += block_size;
+
+      for (u32 p = 0; p < 16; ++p) {
+        const u32 x = bx + (p & 3);
+        const u32 y = by + (p >> 2);
+        if (x < width && y < height) {
+          memcpy(&rgba[(y * width + x) * 4], &pixels[p * 4], 4);
+        }
+      }
+    }
+  }
+  return true;
+}
+
+bool load_dds_file(CompressedImage* image, const char* filename) {
+  ASSERT(image != nullptr);
+  memset(image, 0, sizeof(CompressedImage));
+  if (!system_map_file(&image->file, filename)) {
+    return false;
+  }
+
+  const u8* data = image->file.data;
+  const u64 size = image->file.size;
+  DDSHeader header;
+  if (size < sizeof(DDSHeader)) {
+    LOG_ERROR("Truncated DDS file %s!", filename);
+    free_dds_file(image);
+    return false;
+  }
+  memcpy(&header, data, sizeof(DDSHeader));
+  u64 offset = sizeof(DDSHeader);
+
+  if (header.magic != cDDSMagic || header.size != cDDSHeaderSize
+      || !(header.pixel_format.flags & cDDSPixelFourCC)) {
+    LOG_ERROR("Unsupported DDS file %s!", filename);
+    free_dds_file(image);
+    return false;
+  }
+
+  const u32 fourcc = header.pixel_format.four_cc;
+  if (fourcc == four_cc('D', 'X', 'T', '1')) {
+    image->format = TextureFormat::BC1;
+  } else if (fourcc == four_cc('D', 'X', 'T', '5')) {
+    image->format = TextureFormat::BC3;
+  } else if (fourcc == four_cc('D', 'X', '1', '0')) {
+    // BC7 and the other DX10 formats have no CPU decoder to fall back on
+    LOG_ERROR("DX10 DDS files are not supported, %s!", filename);
+    free_dds_file(image);
+    return false;
+  } else {
+    LOG_ERROR("Unsupported DDS format in %s!", filename);
+    free_dds_file(image);
+    return false;
+  }
+
+  image->width = header.width;
+  image->height = header.height;
+  image->level_count = header.mip_map_count > 0 ? header.mip_map_count : 1;
+  if (image->level_count > DDS_MAX_LEVELS) {
+    image->level_count = DDS_MAX_LEVELS;
+  }
+
+  u32 width = image->width;
+  u32 height = image->height;
+  for (u32 level = 0; level < image->level_count; ++level) {
+    const u64 level_size = bc_level_size(image->format, width, height);
+    if (offset + level_size > size) {
+      LOG_ERROR("Truncated DDS file %s!", filename);
+      free_dds_file(image);
+      return false;
+    }
+    image->levels[level] = data + offset;
+    image->level_sizes[level] = level_size;
+    offset += level_size;
+    width = width > 1 ? width / 2 : 1;
+    height = height > 1 ? height / 2 : 1;
+  }
+  return true;
+}
+
+void free_dds_file(CompressedImage* image) {
+  ASSERT(image != nullptr);
+  system_unmap_file(&image->file);
+  memset(image, 0, sizeof(CompressedImage));
+}
+
+bool cook_texture(const char* tga_filename, const char* dds_filename) {
+  DynamicAllocator allocator;
+  if (!allocator.startup(MiB(256))) {
+    return false;
+  }
+
+  Image image;
+  memset(&image, 0, sizeof(Image));
+  if (!load_tga_file(&image, &allocator, tga_filename)) {
+    allocator.shutdown();
+    return false;
+  }
+
+  const u64 pixel_count = (u64)image.width * image.height;
+
+  // Two RGBA levels, the current one and the next one down
+  u8* level = (u8*)allocator.allocate(pixel_count * 4, MemoryTag::Texture);
+  u8* next = (u8*)allocator.allocate(pixel_count * 4, MemoryTag::Texture);
+
+  // Loaded pixels are grey, BGR or BGRA. Only images that actually use
+  // their alpha need BC3.
+  bool alpha = false;
+  if (level != nullptr) {
+    const u32 bpp = image.bytes_per_pixel;
+    for (u64 i = 0; i < pixel_count; ++i) {
+      const u8* pixel = &image.data[i * bpp];
+      level[i * 4 + 0] = bpp == 1 ? pixel[0] : pixel[2];
+      level[i * 4 + 1] = pixel[bpp == 1 ? 0 : 1];
+      level[i * 4 + 2] = pixel[0];
+      level[i * 4 + 3] = bpp == 4 ? pixel[3] : 255;
+      alpha = alpha || level[i * 4 + 3] != 255;
+    }
+  }
+
+  const TextureFormat format = alpha ? TextureFormat::BC3 : TextureFormat::BC1;
+  u8* blocks = (u8*)allocator.allocate(bc_level_size(format, image.width, image.height), MemoryTag::Texture);
+  bool result = level != nullptr && next != nullptr && blocks != nullptr;
+
+  u32 level_count = 1;
+  while (level_count < DDS_MAX_LEVELS
+      && ((image.width >> level_count) > 0 || (image.height >> level_count) > 0)) {
+    level_count++;
+  }
+
+  DDSHeader header;
+  memset(&header, 0, sizeof(DDSHeader));
+  header.magic = cDDSMagic;
+  header.size = cDDSHeaderSize;
+  header.flags = cDDSFlags;
+  header.width = image.width;
+  header.height = image.height;
+  header.pitch_or_linear_size = (u32)bc_level_size(format, image.width, image.height);
+  header.mip_map_count = level_count;
+  header.pixel_format.size = sizeof(DDSPixelFormat);
+  header.pixel_format.flags = cDDSPixelFourCC;
+  header.pixel_format.four_cc = format == TextureFormat::BC1 ? four_cc('D', 'X', 'T', '1') : four_cc('D', 'X', 'T', '5');
+  header.caps = cDDSCapsTexture | (level_count > 1 ? cDDSCapsMipmap : 0);
+
+  FILE* file = result ? fopen(dds_filename, "wb") : nullptr;
+  result = file != nullptr && fwrite(&header, sizeof(DDSHeader), 1, file) == 1;
+
+  u32 width = image.width;
+  u32 height = image.height;
+  for (u32 i = 0; i < level_count && result; ++i) {
+    const u64 level_size = bc_level_size(format, width, height);
+    encode_level(format, level, width, height, blocks);
+    result = fwrite(blocks, 1, level_size, file) == level_size;
+
+    downsample(level, width, height, next);
+    u8* tmp = level;
+    level = next;
+    next = tmp;
+    width = width > 1 ? width / 2 : 1;
+    height = height > 1 ? height / 2 : 1;
+  }
+
+  if (file != nullptr) {
+    result = fclose(file) == 0 && result;
+  }
+
+  if (result) {
+    LOG_INFO("Cooked %s to %s, %s with %u levels", tga_filename, dds_filename,
+        format == TextureFormat::BC1 ? "BC1" : "BC3", level_count);
+  } else {
+    LOG_ERROR("Failed to cook %s to %s!", tga_filename, dds_filename);
+  }
+
+  if (blocks != nullptr) {
+    allocator.free(blocks, bc_level_size(format, image.width, image.height), MemoryTag::Texture);
+  }
+  if (next != nullptr) {
+    allocator.free(next, pixel_count * 4, MemoryTag::Texture);
+  }
+  if (level != nullptr) {
+    allocator.free(level, pixel_count * 4, MemoryTag::Texture);
+  }
+  free_image(&image, &allocator);
+  allocator.shutdown();
+  return result;
+}
+
+bool bc_check() {
+  DynamicAllocator allocator;
+  if (!allocator.startup(MiB(4))) {
+    return false;
+  }
+
+  const u64 pixels_size = (u64)cCheckWidth * cCheckHeight * 4;
+  const u64 blocks_size = bc_level_size(TextureFormat::BC3, cCheckWidth, cCheckHeight);
+  u8* gradient = (u8*)allocator.allocate(pixels_size, MemoryTag::Texture);
+  u8* two_color = (u8*)allocator.allocate(pixels_size, MemoryTag::Texture);
+  u8* decoded = (u8*)allocator.allocate(pixels_size, MemoryTag::Texture);
+  u8* blocks = (u8*)allocator.allocate(blocks_size, MemoryTag::Texture);
+  bool result = gradient != nullptr && two_color != nullptr && decoded != nullptr && blocks != nullptr;
+
+  if (result) {
+    check_gradient_image(gradient, cCheckWidth, cCheckHeight);
+    check_two_color_image(two_color, cCheckWidth, cCheckHeight);
+    const TextureFormat formats[2] = {TextureFormat::BC1, TextureFormat::BC3};
+    for (u32 i = 0; i < 2; ++i) {
+      // Both checks run so a failure reports every bad case
+      result = check_level(formats[i], gradient, cCheckWidth, cCheckHeight, blocks, decoded,
+          "gradient", cCheckMinPsnr, 255) && result;
+      result = check_level(formats[i], two_color, cCheckWidth, cCheckHeight, blocks, decoded,
+          "two colour blocks", 0.0, cCheckMaxTwoColorError) && result;
+    }
+  }
+
+  if (blocks != nullptr) {
+    allocator.free(blocks, blocks_size, MemoryTag::Texture);
+  }
+  if (decoded != nullptr) {
+    allocator.free(decoded, pixels_size, MemoryTag::Texture);
+  }
+  if (two_color != nullptr) {
+    allocator.free(two_color, pixels_size, MemoryTag::Texture);
+  }
+  if (gradient != nullptr) {
+    allocator.free(gradient, pixels_size, MemoryTag::Texture);
+  }
+  allocator.shutdown();
+  return result;
+}
+
+} // namespace Themepark
@@ -0,0 +1,55 @@
+// dds.h
+// Kostya Leshenko
+// CS447P
+// Themepark
+
+#pragma once
+
+#include "defines.h"
+#include "memory.h"
+#include "system.h"
+
+#define DDS_MAX_LEVELS 16
+
+namespace Themepark {
+
+enum class TextureFormat : u32 {
+  BC1 = 0, // RGB, 8 bytes per 4x4 block
+  BC3,     // RGBA, 16 bytes per block
+};
+
+// A DDS file mapped in place, the levels point into the mapping.
+struct CompressedImage {
+  TextureFormat format;
+  u32 width;
+  u32 height;
+  u32 level_count;
+  const u8* levels[DDS_MAX_LEVELS];
+  u64 level_sizes[DDS_MAX_LEVELS];
+  SystemMappedFile file;
+};
+
+bool load_dds_file(CompressedImage* image, const char* filename);
+void free_dds_file(CompressedImage* image);
+
+// Asset cooker, TGA to BC1 (BC3 when the TGA uses alpha) with a box
+// filtered mip chain. Rows are bottom up like load_tga_file's.
+bool cook_texture(const char* tga_filename, const char* dds_filename);
+
+u64 bc_level_size(TextureFormat format, u32 width, u32 height);
+
+// Blocks are 4x4 RGBA8 pixels, row major.
+void bc1_encode_block(const u8* rgba, u8* block);
+void bc3_encode_block(const u8* rgba, u8* block);
+void bc1_decode_block(const u8* block, u8* rgba);
+void bc3_decode_block(const u8* block, u8* rgba);
+
+// CPU reference decoder for BC1 and BC3, writes width * height RGBA8
+// pixels. Used where the GL lacks S3TC and to check the encoder.
+bool bc_decode_level(TextureFormat format, const u8* data, u32 width, u32 height, u8* rgba);
+
+// Encodes and decodes test images in BC1 and BC3 and checks the error
+// stays within bounds.
+bool bc_check();
+
+} // namespace Themepark
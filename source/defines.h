@@ -47,7 +47,9 @@ static_assert(sizeof(f64) == 8, "Unexpected f64 size, must be 8 bytes!");
 
 static_assert(sizeof(bool) == 1, "Unexpected bool size, must be 1 byte!");
 
+constexpr u16 U16_MAX = UINT16_MAX;
 constexpr u32 U32_MAX = UINT32_MAX;
+constexpr u64 U64_MAX = UINT64_MAX;
 
 #define MAX_PATH 1024
 #define MAX_READ_LEN 512
@@ -42,6 +42,10 @@ public:
     return buffer;
   }
 
+  T* data() {
+    return buffer;
+  }
+
   T* release_data() {
     T* data = buffer;
     buffer = nullptr;
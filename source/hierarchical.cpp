@@ -9,58 +9,200 @@ namespace Themepark {
 
 bool HierarchicalModel::init(DynamicAllocator* allocator) {
   ASSERT(allocator != NULL);
-  hierarchy.init(allocator, MemoryTag::Mesh);
+  parents.init(allocator, MemoryTag::Mesh);
+  depths.init(allocator, MemoryTag::Mesh);
+  world_transforms.init(allocator, MemoryTag::Mesh);
+  world_versions.init(allocator, MemoryTag::Mesh);
+  vertex_arrays.init(allocator, MemoryTag::Mesh);
+  instance_counts.init(allocator, MemoryTag::Mesh);
+  instance_positions.init(allocator, MemoryTag::Mesh);
+  rotations.init(allocator, MemoryTag::Mesh);
+  translations.init(allocator, MemoryTag::Mesh);
+  dirty.init(allocator, MemoryTag::Mesh);
+  placements.init(allocator, MemoryTag::Mesh);
+
+  mat4 identity = mat4_identity();
+  placements.push_back(identity);
   return true;
 }
 
 void HierarchicalModel::cleanup() {
-  hierarchy.clear();
+  parents.clear();
+  depths.clear();
+  world_transforms.clear();
+  world_versions.clear();
+  vertex_arrays.clear();
+  instance_counts.clear();
+  instance_positions.clear();
+  rotations.clear();
+  translations.clear();
+  dirty.clear();
+  placements.clear();
+  first_dirty = U32_MAX;
 }
 
 u32 HierarchicalModel::set_root_node(u32 vertex_array_idx,
     const mat4& rotation,
-    const mat4& translation) {
+    const vec3& translation) {
 
-  if (hierarchy.size() > 0) {
-    hierarchy[0].vertex_array_idx = vertex_array_idx;
-    hierarchy[0].rotation = rotation;
-    hierarchy[0].translation = translation;
-    hierarchy[0].instances = 0;
+  if (parents.size() > 0) {
+    vertex_arrays[0] = vertex_array_idx;
+    instance_counts[0] = 0;
+    set_rotation(0, rotation);
+    set_translation(0, translation);
     return 0;
   } else {
-    ModelNode node;
-    memset(&node, 0, sizeof(ModelNode));
-    node.vertex_array_idx = vertex_array_idx;
-    node.rotation = rotation;
-    node.translation = translation;
-    hierarchy.push_back(node);
-    return (u32)(hierarchy.size() - 1);
+    return add_node(HIERARCHICAL_NO_PARENT, 0, vertex_array_idx, rotation, translation, nullptr, 0);
   }
 }
 
 u32 HierarchicalModel::add_child_node(u32 parent_idx,
     u32 vertex_array_idx,
     const mat4& rotation,
-    const mat4& translation,
-    vec3* instance_positions,
+    const vec3& translation,
+    vec3* positions,
     u32 instances) {
 
-  ASSERT(hierarchy.size() > parent_idx);
-  ModelNode node;
-  memset(&node, 0, sizeof(ModelNode));
-  node.vertex_array_idx = vertex_array_idx;
-  node.instances = instances;
-  node.instance_positions = instance_positions;
-  node.rotation = rotation;
-  node.translation = translation;
-  hierarchy.push_back(node);
-
-  ModelNode& parent = hierarchy[parent_idx];
-  ASSERT(parent.child_count < HIERARCHICAL_MAX_CHILD);
-  parent.child_idx[parent.child_count] = (u32)(hierarchy.size() - 1);
-  parent.child_count++;
-
-  return (u32)(hierarchy.size() - 1);
+  ASSERT(parents.size() > parent_idx);
+  const u32 depth = depths[parent_idx] + 1;
+  ASSERT(depth >= depths[depths.size() - 1]);
+  return add_node(parent_idx, depth, vertex_array_idx, rotation, translation, positions, instances);
+}
+
+u32 HierarchicalModel::add_node(u32 parent_idx, u32 depth, u32 vertex_array_idx, const mat4& rotation,
+    const vec3& translation, vec3* positions, u32 instances) {
+  mat4 local_rotation = rotation;
+  vec3 local_translation = translation;
+  mat4 world = mat4_identity();
+  u64 world_version = 0;
+  u8 node_dirty = 0;
+  parents.push_back(parent_idx);
+  depths.push_back(depth);
+  for (u64 i = 0; i < placements.size(); ++i) {
+    world_transforms.push_back(world);
+  }
+  world_versions.push_back(world_version);
+  vertex_arrays.push_back(vertex_array_idx);
+  instance_counts.push_back(instances);
+  instance_positions.push_back(positions);
+  rotations.push_back(local_rotation);
+  translations.push_back(local_translation);
+  dirty.push_back(node_dirty);
+
+  const u32 idx = (u32)(parents.size() - 1);
+  mark_dirty(idx);
+  return idx;
+}
+
+void HierarchicalModel::set_rotation(u32 node, const mat4& rotation) {
+  ASSERT(node < node_count());
+  if (memcmp(&rotations[node], &rotation, sizeof(mat4)) != 0) {
+    rotations[node] = rotation;
+    mark_dirty(node);
+  }
+}
+
+void HierarchicalModel::set_translation(u32 node, const vec3& translation) {
+  ASSERT(node < node_count());
+  if (memcmp(&translations[node], &translation, sizeof(vec3)) != 0) {
+    translations[node] = translation;
+    mark_dirty(node);
+  }
+}
+
+void HierarchicalModel::set_placement_count(u32 count) {
+  ASSERT(count > 0);
+  if (count == placements.size()) {
+    return;
+  }
+
+  mat4 identity = mat4_identity();
+  placements.reset();
+  while (placements.size() < count) {
+    placements.push_back(identity);
+  }
+  resize_world_transforms();
+}
+
+void HierarchicalModel::set_placement(u32 placement, const mat4& transform) {
+  ASSERT(placement < placement_count());
+  if (memcmp(&placements[placement], &transform, sizeof(mat4)) != 0) {
+    placements[placement] = transform;
+    if (node_count() > 0) {
+      mark_dirty(0);
+    }
+  }
+}
+
+// Every world transform is recomputed after the layout changes.
+void HierarchicalModel::resize_world_transforms() {
+  mat4 identity = mat4_identity();
+  world_transforms.reset();
+  for (u64 i = 0; i < parents.size() * placements.size(); ++i) {
+    world_transforms.push_back(identity);
+  }
+  if (node_count() > 0) {
+    mark_dirty(0);
+  }
+}
+
+void HierarchicalModel::mark_dirty(u32 node) {
+  dirty[node] = 1;
+  first_dirty = node < first_dirty ? node : first_dirty;
+}
+
+u32 HierarchicalModel::update() {
+  const u32 count = node_count();
+  if (first_dirty >= count) {
+    return 0;
+  }
+
+  const u32* parent = parents.data();
+  const mat4* rotation = rotations.data();
+  const vec3* translation = translations.data();
+  const mat4* placement = placements.data();
+  const u64 placement_count = placements.size();
+  mat4* world = world_transforms.data();
+  u8* changed = dirty.data();
+
+  // Nothing before the first dirty node can change. Past it a node is
+  // recomputed when it or its parent changed, parents come first so
+  // the flag spreads down a subtree within this one pass.
+  version_++;
+  u32 updated = 0;
+  for (u32 i = first_dirty; i < count; ++i) {
+    if (!changed[i] && (parent[i] == HIERARCHICAL_NO_PARENT || !changed[parent[i]])) {
+      continue;
+    }
+    changed[i] = 1;
+
+    // rotation * translate(t) only moves the translation row
+    mat4 local = rotation[i];
+    for (u32 row = 0; row < 4; ++row) {
+      const f32 w = local.m[row * 4 + 3];
+      local.m[row * 4 + 0] += w * translation[i].x;
+      local.m[row * 4 + 1] += w * translation[i].y;
+      local.m[row * 4 + 2] += w * translation[i].z;
+    }
+
+    mat4* node_world = &world[i * placement_count];
+    if (parent[i] == HIERARCHICAL_NO_PARENT) {
+      for (u64 p = 0; p < placement_count; ++p) {
+        node_world[p] = local * placement[p];
+      }
+    } else {
+      const mat4* parent_world = &world[parent[i] * placement_count];
+      for (u64 p = 0; p < placement_count; ++p) {
+        node_world[p] = local * parent_world[p];
+      }
+    }
+    world_versions[i] = version_;
+    updated++;
+  }
+
+  memset(&changed[first_dirty], 0, count - first_dirty);
+  first_dirty = U32_MAX;
+  return updated;
 }
 
 } // namespace Themepark
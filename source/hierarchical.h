@@ -11,20 +11,22 @@
 #include "vec3.h"
 #include "mat4.h"
 
-#define HIERARCHICAL_MAX_CHILD 9
+#define HIERARCHICAL_NO_PARENT U32_MAX
 
 namespace Themepark {
 
-struct ModelNode {
-  u32 vertex_array_idx;
-  u32 instances;
-  vec3* instance_positions;
-  mat4 rotation;
-  mat4 translation;
-  u32 child_idx[HIERARCHICAL_MAX_CHILD];
-  u32 child_count;
-};
-
+// Nodes live in parallel arrays in breadth first order, so every parent
+// precedes its children and update() is one pass front to back. The
+// local transform is rotation followed by translation, the world
+// transform is local * parent world.
+//
+// Local transforms change through the setters, which mark the node
+// dirty. update() only recomputes dirty nodes and their descendants,
+// every other node keeps its cached world transform.
+//
+// One hierarchy can stand in several places at once. Each placement
+// is a root transform, world transforms are stored per node with the
+// placements side by side so a node's are ready to be instanced.
 class HierarchicalModel final {
   DISABLE_COPY_AND_MOVE(HierarchicalModel);
 public:
@@ -36,17 +38,59 @@ public:
 
   u32 set_root_node(u32 vertex_array_idx,
       const mat4& rotation,
-      const mat4& translation);
+      const vec3& translation);
 
+  // Children are added a level at a time, asserted.
   u32 add_child_node(u32 parent_idx,
       u32 vertex_array_idx,
       const mat4& rotation,
-      const mat4& translation,
+      const vec3& translation,
       vec3* instance_positions,
       u32 instances);
 
-  DynArray<ModelNode> hierarchy;
+  // Setting a value equal to the current one doesn't dirty the node.
+  void set_rotation(u32 node, const mat4& rotation);
+  void set_translation(u32 node, const vec3& translation);
+  // A new model has one placement at the origin, changing the count
+  // moves every placement back to it.
+  void set_placement_count(u32 count);
+  void set_placement(u32 placement, const mat4& transform);
+
+  u32 update(); // returns the number of world transforms recomputed
+
+  u32 node_count() const { return (u32)parents.size(); }
+  u32 placement_count() const { return (u32)placements.size(); }
+  const mat4* node_world_transforms(u32 node) const {
+    return &world_transforms[(u64)node * placements.size()];
+  }
+
+  DynArray<u32> parents;
+  DynArray<u32> depths;
+  DynArray<mat4> world_transforms; // node * placement_count() + placement
+  // The update() each node's world transforms last changed in, counted
+  // per model. Renderer::queue_hierarchical rebuilds a node's instances
+  // only when it moves.
+  DynArray<u64> world_versions;
+
+  // Draw data, read by Renderer::queue_hierarchical
+  DynArray<u32> vertex_arrays;
+  DynArray<u32> instance_counts;
+  DynArray<vec3*> instance_positions;
+
   u32 shader_program;
+
+private:
+  u32 add_node(u32 parent_idx, u32 depth, u32 vertex_array_idx, const mat4& rotation,
+      const vec3& translation, vec3* positions, u32 instances);
+  void mark_dirty(u32 node);
+  void resize_world_transforms();
+
+  DynArray<mat4> rotations;
+  DynArray<vec3> translations;
+  DynArray<u8> dirty;
+  DynArray<mat4> placements;
+  u32 first_dirty = U32_MAX;
+  u64 version_ = 0;
 };
 
 } // namespace Themepark
@@ -22,64 +22,204 @@ typedef struct TGAHeader {
   u8 image_descriptor;
 } TGAHeader;
 
+static_assert(sizeof(TGAHeader) == 18, "Unexpected TGAHeader size!");
+
+namespace {
+
+constexpr u8 cTGATrueColor = 2;
+constexpr u8 cTGAGrey = 3;
+constexpr u8 cTGATrueColorRLE = 10;
+constexpr u8 cTGAGreyRLE = 11;
+constexpr u8 cTGAAlphaBits = 0x0F;
+constexpr u8 cTGATopOrigin = 0x20;
+constexpr u8 cTGARightOrigin = 0x10;
+
+// Packets may run across rows, the state carries over between calls.
+struct RLEDecoder {
+  const u8* src;
+  const u8* end;
+  u32 remaining; // pixels left in the current packet
+  bool repeat;
+  u8 pixel[4];
+};
+
+bool rle_decode_row(RLEDecoder* rle, u8* row, u32 width, u32 bpp) {
+  u32 x = 0;
+  while (x < width) {
+    if (rle->remaining == 0) {
+      if (rle->src >= rle->end) {
+        return false;
+      }
+      const u8 packet = *rle->src++;
+      rle->remaining = (packet & 0x7F) + 1;
+      rle->repeat = (packet & 0x80) != 0;
+      if (rle->repeat) {
+        if (rle->src + bpp > rle->end) {
+          return false;
+        }
+        memcpy(rle->pixel, rle->src, bpp);
+        rle->src += bpp;
+      }
+    }
+
+    u32 count = width - x < rle->remaining ? width - x : rle->remaining;
+    if (rle->repeat) {
+      for (u32 i = 0; i < count; ++i) {
+        memcpy(&row[(x + i) * bpp], rle->pixel, bpp);
+      }
+    } else {
+      if (rle->src + (u64)count * bpp > rle->end) {
+        return false;
+      }
+      memcpy(&row[x * bpp], rle->src, (u64)count * bpp);
+      rle->src += (u64)count * bpp;
+    }
+    x += count;
+    rle->remaining -= count;
+  }
+  return true;
+}
+
+// 32 bit images that declare no alpha bits leave the fourth byte
+// undefined.
+void force_opaque(const u8* src, u8* dst, u32 count) {
+  const __m128i alpha = _mm_set1_epi32((i32)0xFF000000);
+  u32 i = 0;
+  for (; i + 4 <= count; i += 4) {
+    const __m128i bgra = _mm_loadu_si128((const __m128i*)&src[i * 4]);
+    _mm_storeu_si128((__m128i*)&dst[i * 4], _mm_or_si128(bgra, alpha));
+  }
+  for (; i < count; ++i) {
+    memcpy(&dst[i * 4], &src[i * 4], 3);
+    dst[i * 4 + 3] = 0xFF;
+  }
+}
+
+// Mirrors a row in place for right to left images.
+void mirror_row(u8* row, u32 width, u32 bpp) {
+  u8 pixel[4];
+  for (u32 i = 0; i < width / 2; ++i) {
+    u8* a = &row[i * bpp];
+    u8* b = &row[(width - 1 - i) * bpp];
+    memcpy(pixel, a, bpp);
+    memcpy(a, b, bpp);
+    memcpy(b, pixel, bpp);
+  }
+}
+
+} // namespace
+
 bool load_tga_file(Image* image,
     DynamicAllocator* allocator,
     const char* filename) {
+  ASSERT(image != nullptr && allocator != nullptr);
+  memset(image, 0, sizeof(Image));
 
-  FILE* file = fopen(filename, "rb");
-  if (file == nullptr) {
-    LOG_ERROR("Failed to open %s!", filename);
+  SystemMappedFile file;
+  if (!system_map_file(&file, filename)) {
     return false;
   }
 
   TGAHeader header;
-  memset(&header, 0, sizeof(TGAHeader));
-  if (fread(&header, sizeof(TGAHeader), 1, file) < 1) {
+  if (file.size < sizeof(TGAHeader)) {
     LOG_ERROR("Failed to open %s!", filename);
-    fclose(file);
+    system_unmap_file(&file);
     return false;
   }
+  memcpy(&header, file.data, sizeof(TGAHeader));
 
-  if (header.image_type != 2) {
-    LOG_ERROR("Unsupported image type %s!", filename);
-    fclose(file);
+  const bool rle = header.image_type == cTGATrueColorRLE || header.image_type == cTGAGreyRLE;
+  const bool grey = header.image_type == cTGAGrey || header.image_type == cTGAGreyRLE;
+  const u32 src_bpp = header.image_bits_per_pixel / 8;
+  const bool supported = header.color_map_type == 0
+      && (header.image_type == cTGATrueColor || header.image_type == cTGATrueColorRLE || grey)
+      && (grey ? src_bpp == 1 : (src_bpp == 3 || src_bpp == 4));
+  if (!supported) {
+    LOG_ERROR("Unsupported image type %u (%u bpp) %s!", header.image_type,
+        header.image_bits_per_pixel, filename);
+    system_unmap_file(&file);
     return false;
   }
 
-  image->bytes_per_pixel = header.image_bits_per_pixel / 8;
-  /*if (bytes_per_pixel != 4) {
-    LOG_ERROR("Unsupported image BPP %u!", bytes_per_pixel);
-    fclose(file);
+  const u32 width = header.image_width;
+  const u32 height = header.image_height;
+  const bool top_down = (header.image_descriptor & cTGATopOrigin) != 0;
+  const bool right_to_left = (header.image_descriptor & cTGARightOrigin) != 0;
+  const bool opaque = src_bpp == 4 && (header.image_descriptor & cTGAAlphaBits) == 0;
+
+  const u8* pixels = file.data + sizeof(TGAHeader) + header.id_field_length;
+  const u8* end = file.data + file.size;
+  const u64 src_row_size = (u64)width * src_bpp;
+  if (pixels > end || (!rle && (u64)(end - pixels) < src_row_size * height)) {
+    LOG_ERROR("Truncated image data in %s!", filename);
+    system_unmap_file(&file);
     return false;
-  }*/
+  }
 
-  image->width = (int)header.image_width;
-  image->height = (int)header.image_height;
+  image->width = width;
+  image->height = height;
 
-  const u32 image_data_len = image->width * image->height * image->bytes_per_pixel;
+  // Already in upload order, the image is a view of the mapping
+  if (!rle && !top_down && !right_to_left && !opaque) {
+    image->data = pixels;
+    image->bytes_per_pixel = src_bpp;
+    image->file = file;
+    return true;
+  }
 
-  image->data = (u8*)allocator->allocate(sizeof(u8) * image_data_len, MemoryTag::Texture);
-  if (image->data == nullptr) {
+  // Pixels keep their source layout, rows are decoded straight into
+  // place and mirrored there.
+  image->bytes_per_pixel = src_bpp;
+  const u64 image_size = src_row_size * height;
+  u8* data = (u8*)allocator->allocate(image_size, MemoryTag::Texture);
+  if (data == nullptr) {
     LOG_ERROR("Failed to allocate image buffer for %s!", filename);
-    fclose(file);
+    system_unmap_file(&file);
     return false;
   }
 
-  if (fread(image->data, sizeof(u8), image_data_len, file) != image_data_len) {
-    LOG_ERROR("Failed to read data for %s!", filename);
-    fclose(file);
+  RLEDecoder decoder = {pixels, end, 0, false, {}};
+  bool result = true;
+  for (u32 y = 0; y < height && result; ++y) {
+    u8* dst = data + src_row_size * (top_down ? height - 1 - y : y);
+    if (rle) {
+      result = rle_decode_row(&decoder, dst, width, src_bpp);
+      if (opaque) {
+        force_opaque(dst, dst, width);
+      }
+    } else if (opaque) {
+      force_opaque(pixels + src_row_size * y, dst, width);
+    } else {
+      memcpy(dst, pixels + src_row_size * y, src_row_size);
+    }
+    if (right_to_left) {
+      mirror_row(dst, width, src_bpp);
+    }
+  }
+  system_unmap_file(&file);
+
+  if (!result) {
+    LOG_ERROR("Failed to decode RLE data for %s!", filename);
+    allocator->free(data, image_size, MemoryTag::Texture);
+    image->width = 0;
+    image->height = 0;
     return false;
   }
 
-  fclose(file);
+  image->data = data;
   return true;
 }
 
 void free_image(Image* image, DynamicAllocator* allocator) {
   ASSERT(image != nullptr && allocator != nullptr);
-  allocator->free(image->data,
-      image->width * image->height * image->bytes_per_pixel,
-      MemoryTag::Texture);
+  if (image->file.data != nullptr) {
+    system_unmap_file(&image->file);
+  } else if (image->data != nullptr) {
+    allocator->free((void*)image->data,
+        image->width * image->height * image->bytes_per_pixel,
+        MemoryTag::Texture);
+  }
+  image->data = nullptr;
 }
 
 } // namespace Themepark
@@ -7,16 +7,24 @@
 
 #include "defines.h"
 #include "memory.h"
+#include "system.h"
 
 namespace Themepark {
 
+// Rows are bottom up, the order GL expects. Pixels are 1 byte grey,
+// 3 byte BGR or 4 byte BGRA.
 struct Image {
-  u8* data;
+  const u8* data;
   u32 width;
   u32 height;
   u32 bytes_per_pixel;
+  SystemMappedFile file; // data points into the file when nothing needed converting
 };
 
+// Uncompressed and RLE true colour (types 2 and 10) and greyscale
+// (types 3 and 11). Pixels keep the file's grey, BGR or BGRA layout.
+// Top down images are flipped, right to left ones mirrored and 32 bit
+// images without alpha bits get an opaque alpha.
 bool load_tga_file(Image* image, DynamicAllocator* allocator, const char* filename);
 void free_image(Image* image, DynamicAllocator* allocator);
 
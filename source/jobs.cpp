@@ -0,0 +1,144 @@
+// jobs.cpp
+// Kostya Leshenko
+// CS447P
+// Themepark
+
+#include "jobs.h"
+#include "logging.h"
+
+namespace Themepark {
+
+bool JobSystem::startup(DynamicAllocator* allocator, u32 worker_count) {
+  ASSERT(allocator != nullptr);
+  allocator_ = allocator;
+  memset(&pending_, 0, sizeof(JobRing));
+  memset(&finished_, 0, sizeof(JobRing));
+  in_flight_ = 0;
+
+  if (!system_mutex_create(&mutex_) || !system_condition_create(&wake_)) {
+    return false;
+  }
+
+  running_ = true;
+  worker_count_ = 0;
+  if (worker_count > JOB_MAX_WORKERS) {
+    worker_count = JOB_MAX_WORKERS;
+  }
+
+  for (u32 i = 0; i < worker_count; ++i) {
+    if (!system_thread_create(&workers_[i], worker_main, "JobWorker", this)) {
+      break;
+    }
+    worker_count_++;
+  }
+
+  LOG_INFO("Job system: %u worker threads", worker_count_);
+  return true;
+}
+
+void JobSystem::shutdown() {
+  system_mutex_lock(&mutex_);
+  running_ = false;
+  system_condition_broadcast(&wake_);
+  system_mutex_unlock(&mutex_);
+
+  for (u32 i = 0; i < worker_count_; ++i) {
+    system_thread_join(&workers_[i]);
+  }
+  worker_count_ = 0;
+
+  if (in_flight_ > 0) {
+    LOG_INFO("Job system: dropped %u unfinished jobs", in_flight_);
+  }
+
+  system_condition_destroy(&wake_);
+  system_mutex_destroy(&mutex_);
+}
+
+void JobSystem::submit(JobFunction work, JobFunction finish, void* data) {
+  ASSERT(work != nullptr);
+  Job job{work, finish, data};
+
+  // Without workers, or with every slot taken, run the job right here.
+  if (worker_count_ == 0 || in_flight_ >= JOB_QUEUE_SIZE) {
+    job.work(job.data);
+    if (job.finish != nullptr) {
+      job.finish(job.data);
+    }
+    return;
+  }
+
+  in_flight_++;
+  system_mutex_lock(&mutex_);
+  push(&pending_, job);
+  system_condition_signal(&wake_);
+  system_mutex_unlock(&mutex_);
+}
+
+u32 JobSystem::run_finished() {
+  u32 finished = 0;
+  Job job{};
+
+  for (;;) {
+    system_mutex_lock(&mutex_);
+    const bool popped = pop(&finished_, &job);
+    system_mutex_unlock(&mutex_);
+    if (!popped) {
+      break;
+    }
+
+    if (job.finish != nullptr) {
+      job.finish(job.data);
+    }
+    in_flight_--;
+    finished++;
+  }
+
+  return finished;
+}
+
+i32 JobSystem::worker_main(void* data) {
+  JobSystem* jobs = (JobSystem*)data;
+  Job job{};
+
+  system_mutex_lock(&jobs->mutex_);
+  for (;;) {
+    while (jobs->running_ && jobs->pending_.count == 0) {
+      system_condition_wait(&jobs->wake_, &jobs->mutex_);
+    }
+
+    if (!jobs->running_) {
+      break;
+    }
+
+    pop(&jobs->pending_, &job);
+    system_mutex_unlock(&jobs->mutex_);
+
+    job.work(job.data);
+
+    system_mutex_lock(&jobs->mutex_);
+    push(&jobs->finished_, job);
+  }
+  system_mutex_unlock(&jobs->mutex_);
+
+  jobs->allocator_->release_thread_cache();
+  return 0;
+}
+
+void JobSystem::push(JobRing* ring, const Job& job) {
+  ASSERT(ring->count < JOB_QUEUE_SIZE);
+  ring->jobs[(ring->head + ring->count) % JOB_QUEUE_SIZE] = job;
+  ring->count++;
+}
+
+bool JobSystem::pop(JobRing* ring, Job* job) {
+  if (ring->count == 0) {
+    return false;
+  }
+  *job = ring->jobs[ring->head];
+  ring->head = (ring->head + 1) % JOB_QUEUE_SIZE;
+  ring->count--;
+  return true;
+}
+
+} // namespace Themepark
@@ -0,0 +1,63 @@
+// jobs.h
+// Kostya Leshenko
+// CS447P
+// Themepark
+
+#pragma once
+
+#include "defines.h"
+#include "system.h"
+#include "memory.h"
+
+#define JOB_QUEUE_SIZE 256
+#define JOB_MAX_WORKERS 8
+
+namespace Themepark {
+
+typedef void (*JobFunction)(void* data);
+
+class JobSystem final {
+  DISABLE_COPY_AND_MOVE(JobSystem);
+public:
+  JobSystem() = default;
+  ~JobSystem() = default;
+
+  bool startup(DynamicAllocator* allocator, u32 worker_count);
+  void shutdown();
+
+  // work runs on a worker thread, finish runs afterwards on the thread
+  // calling run_finished, which is where GL uploads belong.
+  void submit(JobFunction work, JobFunction finish, void* data);
+  u32 run_finished(); // returns number of finish callbacks run
+
+  u32 in_flight() const { return in_flight_; }
+
+private:
+  struct Job {
+    JobFunction work;
+    JobFunction finish;
+    void* data;
+  };
+
+  struct JobRing {
+    Job jobs[JOB_QUEUE_SIZE];
+    u32 head;
+    u32 count;
+  };
+
+  static i32 worker_main(void* data);
+  static void push(JobRing* ring, const Job& job);
+  static bool pop(JobRing* ring, Job* job);
+
+  JobRing pending_{};
+  JobRing finished_{};
+  SystemMutex mutex_{};
+  SystemCondition wake_{};
+  SystemThread workers_[JOB_MAX_WORKERS]{};
+  u32 worker_count_{};
+  u32 in_flight_{};
+  bool running_{};
+  DynamicAllocator* allocator_{};
+};
+
+} // namespace Themepark
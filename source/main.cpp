@@ -9,12 +9,51 @@
 #include "memory.h"
 #include "input.h"
 #include "themepark.h"
+#include "mesh.h"
+#include "dds.h"
+#include "spatial.h"
+
+#define BENCH_ITERATIONS 20
+#define BENCH_SPATIAL_OBJECTS 65536
 
 int main(int argc, char* argv[]) {
+  // --bench-obj <file.obj> measures OBJ parse throughput and the vertex
+  // cache optimiser, then exits
+  if (argc >= 3 && strcmp(argv[1], "--bench-obj") == 0) {
+    bool result = Themepark::mesh_benchmark_obj(argv[2], BENCH_ITERATIONS);
+    Themepark::memory_report_stats();
+    return result ? 0 : 1;
+  }
+
+  // --bench-spatial [max objects] times the spatial index against linear
+  // scans over growing parks and exits
+  if (argc >= 2 && strcmp(argv[1], "--bench-spatial") == 0) {
+    const u32 objects = argc >= 3 ? (u32)strtoul(argv[2], nullptr, 10) : BENCH_SPATIAL_OBJECTS;
+    bool result = Themepark::spatial_benchmark(objects);
+    Themepark::memory_report_stats();
+    return result ? 0 : 1;
+  }
+
+  // --cook-texture <in.tga> <out.dds> builds a compressed mip chain and exits
+  if (argc >= 4 && strcmp(argv[1], "--cook-texture") == 0) {
+    bool result = Themepark::cook_texture(argv[2], argv[3]);
+    Themepark::memory_report_stats();
+    return result ? 0 : 1;
+  }
+
+  // --check-bc round trips test images through the BC encoder and the
+  // CPU decoder, exits nonzero when the error is out of bounds
+  if (argc >= 2 && strcmp(argv[1], "--check-bc") == 0) {
+    bool result = Themepark::bc_check();
+    Themepark::memory_report_stats();
+    return result ? 0 : 1;
+  }
+
   Themepark::SystemContext context = {0};
   context.appname = (u8*)"Themepark";
   context.width = 2048;
   context.height = 1152;
+  context.frame_memory_size = Themepark::MiB(4);
   context.fullscreen = false;
   context.client_startup = Themepark::themepark_startup;
   context.client_run = Themepark::themepark_run;
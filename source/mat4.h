@@ -118,4 +118,18 @@ inline mat4 mat4_perspective(f32 fov, f32 front, f32 back, f32 aspect) {
   }};
 }
 
+// Inverse of a rotation followed by a translation, such as a view matrix.
+inline mat4 mat4_inverse_rigid(const mat4& a) {
+  const f32* m = a.m;
+  return mat4{{
+    m[0], m[4], m[8], 0,
+    m[1], m[5], m[9], 0,
+    m[2], m[6], m[10], 0,
+    -(m[12] * m[0] + m[13] * m[1] + m[14] * m[2]),
+    -(m[12] * m[4] + m[13] * m[5] + m[14] * m[6]),
+    -(m[12] * m[8] + m[13] * m[9] + m[14] * m[10]),
+    1,
+  }};
+}
+
 } // namespace Themepark
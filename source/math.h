@@ -43,5 +43,69 @@ inline f32 max(f32 a, f32 b) {
   return fmaxf(a, b);
 }
 
+// IEEE half precision conversions, round to nearest even. Values out of
+// range saturate to infinity.
+inline u16 float_to_half(f32 f) {
+  u32 x;
+  memcpy(&x, &f, sizeof(u32));
+  const u32 sign = (x >> 16) & 0x8000;
+  const i32 exponent = (i32)((x >> 23) & 0xFF) - 127 + 15;
+  u32 mantissa = x & 0x7FFFFF;
+
+  if (((x >> 23) & 0xFF) == 0xFF) {
+    return (u16)(sign | 0x7C00 | (mantissa != 0 ? 0x200 : 0));
+  }
+  if (exponent >= 31) {
+    return (u16)(sign | 0x7C00);
+  }
+  if (exponent <= 0) {
+    if (exponent < -10) {
+      return (u16)sign;
+    }
+    mantissa |= 0x800000;
+    const u32 shift = (u32)(14 - exponent);
+    u32 half = mantissa >> shift;
+    const u32 rest = mantissa & ((1U << shift) - 1);
+    const u32 halfway = 1U << (shift - 1);
+    if (rest > halfway || (rest == halfway && (half & 1))) {
+      half++;
+    }
+    return (u16)(sign | half);
+  }
+
+  u32 half = sign | ((u32)exponent << 10) | (mantissa >> 13);
+  const u32 rest = mantissa & 0x1FFF;
+  if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) {
+    half++; // may carry into the exponent, which is still correct
+  }
+  return (u16)half;
+}
+
+inline f32 half_to_float(u16 h) {
+  const u32 sign = (u32)(h & 0x8000) << 16;
+  u32 exponent = (h >> 10) & 0x1F;
+  u32 mantissa = h & 0x3FF;
+  u32 x;
+
+  if (exponent == 0x1F) {
+    x = sign | 0x7F800000 | (mantissa << 13);
+  } else if (exponent != 0) {
+    x = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+  } else if (mantissa == 0) {
+    x = sign;
+  } else {
+    exponent = 127 - 15 + 1;
+    while ((mantissa & 0x400) == 0) {
+      mantissa <<= 1;
+      exponent--;
+    }
+    x = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
+  }
+
+  f32 f;
+  memcpy(&f, &x, sizeof(f32));
+  return f;
+}
+
 } // namespace Math
 } // namespace Themepark
@@ -7,6 +7,8 @@
 #include "system.h"
 #include "logging.h"
 
+#include <atomic>
+
 namespace Themepark {
 namespace {
 
@@ -16,6 +18,71 @@ constexpr f64 cGiB = 1024.0 * 1024.0 * 1024.0;
 
 constexpr const char* XiB[4] = {"KiB", "MiB", "GiB", "bytes"};
 
+// Size classes run from 16 bytes up to 64 KiB in powers of two,
+// free chunks of 128 KiB and up go to the large block list.
+constexpr u64 cChunkAlignment = 16;
+constexpr u64 cMinChunkSize = 16;
+constexpr u64 cMaxClassSize = cMinChunkSize << (DYNAMIC_ALLOCATOR_SIZE_CLASSES - 1);
+
+constexpr u64 align_up(u64 value, u64 alignment) {
+  return (value + alignment - 1) & ~(alignment - 1);
+}
+
+inline u32 size_class_index(u64 size) {
+  if (size <= cMinChunkSize) {
+    return 0;
+  }
+  return (u32)(64 - __builtin_clzll(size - 1)) - 4;
+}
+
+// Thread caches keep up to cCacheDepth chunks for each of the classes up
+// to 1 KiB and refill from the arena cCacheBatch chunks at a time.
+constexpr u32 cCachedClasses = 7;
+constexpr u64 cMaxCachedSize = cMinChunkSize << (cCachedClasses - 1);
+constexpr u32 cCacheDepth = 64;
+constexpr u32 cCacheBatch = 16;
+
+// Bin holding a free chunk, DYNAMIC_ALLOCATOR_SIZE_CLASSES means the large list.
+inline u32 bin_index(u64 chunk_size) {
+  const u32 bin = (u32)(63 - __builtin_clzll(chunk_size)) - 4;
+  return bin < DYNAMIC_ALLOCATOR_SIZE_CLASSES ? bin : DYNAMIC_ALLOCATOR_SIZE_CLASSES;
+}
+
+// Small chunks cached by one thread for one thread safe allocator. The
+// chunks still count as allocated in the arena, they are linked through
+// their first bytes. epoch tells a restarted allocator from a stale one.
+struct ThreadCache {
+  const void* owner;
+  u64 epoch;
+  void* heads[cCachedClasses];
+  u32 counts[cCachedClasses];
+};
+
+thread_local ThreadCache thread_cache{};
+std::atomic<u64> allocator_epoch{1};
+
+// Binds the calling thread's cache to an allocator. A thread serves only
+// one allocator from its cache, others go straight to their arena.
+ThreadCache* thread_cache_for(const void* owner, u64 epoch) {
+  ThreadCache* cache = &thread_cache;
+  if (cache->owner == owner && cache->epoch == epoch) {
+    return cache;
+  }
+
+  bool empty = true;
+  for (u32 i = 0; i < cCachedClasses; ++i) {
+    empty = empty && cache->counts[i] == 0;
+  }
+
+  if (cache->owner == owner || empty) {
+    memset(cache, 0, sizeof(ThreadCache));
+    cache->owner = owner;
+    cache->epoch = epoch;
+    return cache;
+  }
+  return nullptr;
+}
+
 constexpr u32 mtag_int(MemoryTag tag) {
   return static_cast<u32>(tag);
 }
@@ -45,6 +112,24 @@ constexpr const char* memory_tag_str[mtag_int(MemoryTag::Count)] = {
   "RENDERER  :",
 };
 
+// Counters are relaxed atomics, nothing orders other memory against them
+// and the report only needs a reasonably recent snapshot. Each tag sits on
+// its own cache line so threads allocating different tags don't contend.
+struct alignas(64) TagCounters {
+  std::atomic<u64> bytes;
+  std::atomic<u64> count;
+  std::atomic<u64> peak_bytes;
+  std::atomic<u64> total_count;
+  std::atomic<u64> reported_count;
+};
+
+inline void raise_peak(std::atomic<u64>* peak, u64 value) {
+  u64 current = peak->load(std::memory_order_relaxed);
+  while (value > current
+      && !peak->compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+  }
+}
+
 class HeapAllocationTracker final {
   DISABLE_COPY_AND_MOVE(HeapAllocationTracker)
 public:
@@ -53,71 +138,79 @@ public:
     return instance;
   }
 
-  ~HeapAllocationTracker() {
-    system_mutex_destroy(&mux_);
-  }
+  ~HeapAllocationTracker() = default;
 
   inline void update_total_up(u64 bytes) {
-    system_mutex_lock(&mux_);
-    total_allocated_bytes += bytes;
-    system_mutex_unlock(&mux_);
+    const u64 total = total_allocated_bytes.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    raise_peak(&total_peak_bytes, total);
   }
 
   inline void update_total_down(u64 bytes) {
-    system_mutex_lock(&mux_);
-    total_allocated_bytes -= bytes;
-    system_mutex_unlock(&mux_);
+    total_allocated_bytes.fetch_sub(bytes, std::memory_order_relaxed);
   }
 
   inline void update_tag_up(MemoryTag tag, u64 bytes) {
-    system_mutex_lock(&mux_);
-    tag_allocated_bytes[mtag_int(tag)] += bytes;
-    tag_allocation_count[mtag_int(tag)]++;
-    system_mutex_unlock(&mux_);
+    TagCounters& counters = tags[mtag_int(tag)];
+    const u64 total = counters.bytes.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    counters.count.fetch_add(1, std::memory_order_relaxed);
+    counters.total_count.fetch_add(1, std::memory_order_relaxed);
+    raise_peak(&counters.peak_bytes, total);
   }
 
   inline void update_tag_down(MemoryTag tag, u64 bytes) {
-    system_mutex_lock(&mux_);
-    tag_allocated_bytes[mtag_int(tag)] -= bytes;
-    tag_allocation_count[mtag_int(tag)]--;
-    system_mutex_unlock(&mux_);
+    TagCounters& counters = tags[mtag_int(tag)];
+    counters.bytes.fetch_sub(bytes, std::memory_order_relaxed);
+    counters.count.fetch_sub(1, std::memory_order_relaxed);
   }
 
   const char* memory_stats_string() {
     static thread_local char buffer[8192]{};
-    system_mutex_lock(&mux_);
+
+    // Allocation rates cover the time since the previous report.
+    const u64 now = system_time_ns();
+    const u64 then = reported_time_ns.exchange(now, std::memory_order_relaxed);
+    const f64 seconds = now > then ? f64(now - then) * 1.0e-9 : 0.0;
 
     i32 used_len = 0;
     for (u32 i = 0; i < mtag_int(MemoryTag::Count); i++) {
+      TagCounters& counters = tags[i];
 
-      u64 count = tag_allocation_count[i];
-      f64 total = f64(tag_allocated_bytes[i]);
+      u64 count = counters.count.load(std::memory_order_relaxed);
+      f64 total = f64(counters.bytes.load(std::memory_order_relaxed));
+      f64 peak = f64(counters.peak_bytes.load(std::memory_order_relaxed));
+      const u64 total_count = counters.total_count.load(std::memory_order_relaxed);
+      const u64 reported = counters.reported_count.exchange(total_count, std::memory_order_relaxed);
+      const f64 rate = seconds > 0.0 ? f64(total_count - reported) / seconds : 0.0;
 
       u32 u = calc_units(&total);
+      u32 pu = calc_units(&peak);
 
       i32 len = snprintf(buffer + used_len, sizeof(buffer) - used_len,
-        "  %s %llu allocations of %0.2f%s\n", memory_tag_str[i], count, total, XiB[u]);
+        "  %s %llu allocations of %0.2f%s, peak %0.2f%s, %0.1f allocations/s\n",
+        memory_tag_str[i], count, total, XiB[u], peak, XiB[pu], rate);
 
       used_len += len;
     }
 
-    f64 total = f64(total_allocated_bytes);
+    f64 total = f64(total_allocated_bytes.load(std::memory_order_relaxed));
+    f64 peak = f64(total_peak_bytes.load(std::memory_order_relaxed));
     u32 u = calc_units(&total);
-    snprintf(buffer + used_len, sizeof(buffer) - used_len, "Total %0.2f%s\n", total, XiB[u]);
+    u32 pu = calc_units(&peak);
+    snprintf(buffer + used_len, sizeof(buffer) - used_len,
+        "Total %0.2f%s, peak %0.2f%s\n", total, XiB[u], peak, XiB[pu]);
 
-    system_mutex_unlock(&mux_);
     return buffer;
   }
 
 private:
   HeapAllocationTracker() {
-    system_mutex_create(&mux_);
+    reported_time_ns.store(system_time_ns(), std::memory_order_relaxed);
   }
 
-  u64 total_allocated_bytes{};
-  u64 tag_allocated_bytes[mtag_int(MemoryTag::Count)]{};
-  u64 tag_allocation_count[mtag_int(MemoryTag::Count)]{};
-  SystemMutex mux_{};
+  std::atomic<u64> total_allocated_bytes{};
+  std::atomic<u64> total_peak_bytes{};
+  std::atomic<u64> reported_time_ns{};
+  TagCounters tags[mtag_int(MemoryTag::Count)]{};
 };
 
 }
@@ -137,104 +230,483 @@ private:
 #endif
 
 
-bool DynamicAllocator::startup(u64 size) {
+LinearAllocator::LinearAllocator(u64 max_size) {
+  memory_ = (u8*)::calloc(max_size, sizeof(u8));
+  if (!memory_) {
+    LOG_FATAL("LinearAllocator failed to aquire a block of %llu bytes!", max_size);
+    return;
+  }
+
+  memory_size_ = max_size;
+  UPDATE_TOTAL_UP(max_size);
+}
+
+LinearAllocator::~LinearAllocator() {
+  if (memory_ && memory_size_ > 0) {
+    ::free(memory_);
+    UPDATE_TOTAL_DOWN(memory_size_);
+  }
+}
+
+void* LinearAllocator::allocate(u64 size) {
+  const u64 offset = align_up(memory_used_, cChunkAlignment);
+  if (memory_ == nullptr || offset + size > memory_size_) {
+    LOG_ERROR("LinearAllocator out of memory, failed to allocate %llu bytes!", size);
+    return nullptr;
+  }
+
+  memory_used_ = offset + size;
+  peak_used_ = memory_used_ > peak_used_ ? memory_used_ : peak_used_;
+  return memory_ + offset;
+}
+
+void LinearAllocator::free(void* memory) {
+  ASSERT(memory == nullptr || ((u8*)memory >= memory_ && (u8*)memory < memory_ + memory_used_));
+}
+
+void LinearAllocator::rewind(u64 mark) {
+  ASSERT(mark <= memory_used_);
+  memory_used_ = mark;
+}
+
+void LinearAllocator::reset() {
+  memory_used_ = 0;
+}
+
+FrameAllocator::FrameAllocator(u64 frame_size) : arenas_{frame_size, frame_size} {}
+
+void FrameAllocator::reset() {
+  frame_index_ ^= 1;
+  arenas_[frame_index_].reset();
+}
+
+void* FrameAllocator::allocate(u64 size) {
+  return arenas_[frame_index_].allocate(size);
+}
+
+bool DynamicAllocator::startup(u64 size, bool thread_safe) {
   memory_ = (u8*)::calloc(size, sizeof(u8));
   if (!memory_) {
     LOG_FATAL("DynamicAllocator failed to aquire a block of %d bytes!", size);
     return false;
   }
 
+  thread_safe_ = thread_safe;
+  if (thread_safe_ && !system_mutex_create(&mutex_)) {
+    ::free(memory_);
+    memory_ = nullptr;
+    return false;
+  }
+
+  epoch_ = allocator_epoch.fetch_add(1, std::memory_order_relaxed);
   memory_size_ = size;
+  memory_used_ = 0;
+  top_prev_size_ = 0;
+  allocated_bytes_ = 0;
+  free_bytes_ = 0;
+  free_blocks_ = 0;
+  memset(free_bins_, 0, sizeof(free_bins_));
+  bin_mask_ = 0;
+  large_free_head_ = nullptr;
   UPDATE_TOTAL_UP(size);
   return true;
 }
 
 void DynamicAllocator::shutdown() {
+  if (thread_cache.owner == this) {
+    memset(&thread_cache, 0, sizeof(ThreadCache));
+  }
+
+  if (thread_safe_) {
+    system_mutex_destroy(&mutex_);
+    thread_safe_ = false;
+  }
+
   if (memory_ && memory_size_ > 0) {
     ::free(memory_);
     UPDATE_TOTAL_DOWN(memory_size_);
   }
+  memory_ = nullptr;
+  memory_size_ = 0;
+  memory_used_ = 0;
+  epoch_ = 0;
 }
 
 void* DynamicAllocator::allocate(u64 size, MemoryTag tag) {
-  AllocNode* alloc = find_freed(size);
-  
-  if (alloc != nullptr) {
-    
-    alloc->chunk_size = size;
-    alloc->tag = tag;
-    alloc->freed = false;
+  AllocNode* alloc = nullptr;
 
+  if (thread_safe_ && size <= cMaxCachedSize) {
+    alloc = allocate_cached(size_class_index(size));
   } else {
-    const u64 total_size = sizeof(AllocNode) + size;
-    
-    if (total_size <= memory_size_ - memory_used_) {
-      alloc = (AllocNode*)(memory_ + memory_used_);
-      memory_used_ += total_size;
-
-      alloc->chunk = (u8*)alloc + sizeof(AllocNode);
-      alloc->chunk_size = size;
-      alloc->tag = tag;
-      alloc->freed = false;
-
-      if (!alloc_list_head_ || alloc_list_head_->chunk_size <= size) {
-        alloc->next = alloc_list_head_;
-        alloc_list_head_ = alloc;
-      } else {
-        AllocNode* previous = find_previous(size);
-        ASSERT(previous);
-        alloc->next = previous->next;
-        previous->next = alloc;
-      }
-    }
+    const u64 chunk_size = size <= cMinChunkSize ? cMinChunkSize : align_up(size, cChunkAlignment);
+    lock();
+    alloc = allocate_chunk(chunk_size);
+    unlock();
   }
 
   if (alloc) {
+    alloc->tag = tag;
     UPDATE_TAG_UP(tag, size);
-    return alloc->chunk;
+    return (u8*)alloc + sizeof(AllocNode);
   }
 
+  LOG_ERROR("DynamicAllocator out of memory, failed to allocate %llu bytes!", size);
   return nullptr;
 }
 
 void DynamicAllocator::free(void* memory, u64 size, MemoryTag tag) {
-  if (memory == nullptr && size == 0) {
+  if (memory == nullptr) {
     return;
   }
-  
-  AllocNode* alloc = alloc_list_head_;
-  for (; alloc != nullptr; alloc = alloc->next) {
-    if (alloc->chunk == memory) {
-      ASSERT(alloc->chunk_size == size);
-      ASSERT(alloc->tag == tag);
-      alloc->freed = true;
-      FILL_FREED(alloc->chunk, alloc->chunk_size);
-      UPDATE_TAG_DOWN(alloc->tag, alloc->chunk_size);
+
+  ASSERT((u8*)memory > memory_ && (u8*)memory < memory_ + memory_size_);
+  AllocNode* alloc = (AllocNode*)((u8*)memory - sizeof(AllocNode));
+  ASSERT(!alloc->freed && !alloc->cached);
+  ASSERT(alloc->chunk_size >= size);
+  ASSERT(alloc->tag == tag);
+  UPDATE_TAG_DOWN(alloc->tag, size);
+
+  // Chunks of exactly one class size go back to this thread's cache.
+  const u64 chunk_size = alloc->chunk_size;
+  if (thread_safe_ && chunk_size <= cMaxCachedSize && (chunk_size & (chunk_size - 1)) == 0) {
+    ThreadCache* cache = thread_cache_for(this, epoch_);
+    if (cache != nullptr) {
+      const u32 size_class = size_class_index(chunk_size);
+      FILL_FREED(memory, chunk_size);
+      alloc->cached = true;
+      links(alloc)->next = (AllocNode*)cache->heads[size_class];
+      cache->heads[size_class] = alloc;
+      cache->counts[size_class]++;
+
+      if (cache->counts[size_class] > cCacheDepth) {
+        lock();
+        while (cache->counts[size_class] > cCacheDepth / 2) {
+          AllocNode* flushed = (AllocNode*)cache->heads[size_class];
+          cache->heads[size_class] = links(flushed)->next;
+          cache->counts[size_class]--;
+          release_chunk(flushed);
+        }
+        unlock();
+      }
+      return;
     }
   }
+
+  lock();
+  release_chunk(alloc);
+  unlock();
 }
 
-DynamicAllocator::AllocNode* DynamicAllocator::find_freed(u64 size) {
-  AllocNode* alloc = alloc_list_head_;
-  for (; alloc != nullptr; alloc = alloc->next) {
-    if (size <= alloc->chunk_size && alloc->freed) {
-      return alloc;
+void DynamicAllocator::release_thread_cache() {
+  ThreadCache* cache = &thread_cache;
+  if (cache->owner != this || cache->epoch != epoch_) {
+    return;
+  }
+
+  lock();
+  for (u32 i = 0; i < cCachedClasses; ++i) {
+    while (cache->heads[i] != nullptr) {
+      AllocNode* alloc = (AllocNode*)cache->heads[i];
+      cache->heads[i] = links(alloc)->next;
+      release_chunk(alloc);
     }
   }
-  return nullptr;
+  unlock();
+
+  memset(cache, 0, sizeof(ThreadCache));
+}
+
+void DynamicAllocator::stats(DynamicAllocatorStats* out) const {
+  ASSERT(out != nullptr);
+  lock();
+  const u64 tail = memory_size_ - memory_used_;
+
+  u64 largest = tail;
+  for (AllocNode* alloc = large_free_head_; alloc != nullptr; alloc = links(alloc)->next) {
+    largest = alloc->chunk_size > largest ? alloc->chunk_size : largest;
+  }
+
+  if (bin_mask_ != 0) {
+    const u32 top_bin = 31 - __builtin_clz(bin_mask_);
+    for (AllocNode* alloc = free_bins_[top_bin]; alloc != nullptr; alloc = links(alloc)->next) {
+      largest = alloc->chunk_size > largest ? alloc->chunk_size : largest;
+    }
+  }
+
+  out->arena_size = memory_size_;
+  out->arena_used = memory_used_;
+  out->allocated_bytes = allocated_bytes_;
+  out->free_bytes = free_bytes_ + tail;
+  out->free_blocks = free_blocks_ + (tail > 0 ? 1 : 0);
+  out->largest_free_block = largest;
+  out->fragmentation = out->free_bytes > 0 ? 1.0 - f64(largest) / f64(out->free_bytes) : 0.0;
+  unlock();
+}
+
+void DynamicAllocator::lock() const {
+  if (thread_safe_) {
+    system_mutex_lock(&mutex_);
+  }
 }
 
-DynamicAllocator::AllocNode* DynamicAllocator::find_previous(u64 size) {
-  AllocNode* alloc = alloc_list_head_;
-  while (alloc->next != nullptr && alloc->next->chunk_size < size) {
-    alloc = alloc->next;
+void DynamicAllocator::unlock() const {
+  if (thread_safe_) {
+    system_mutex_unlock(&mutex_);
+  }
+}
+
+DynamicAllocator::AllocNode* DynamicAllocator::allocate_chunk(u64 chunk_size) {
+  AllocNode* alloc = take_free(chunk_size);
+  if (alloc != nullptr) {
+    split(alloc, chunk_size);
+  } else {
+    alloc = carve(chunk_size);
+  }
+
+  if (alloc != nullptr) {
+    alloc->freed = false;
+    alloc->cached = false;
+    allocated_bytes_ += alloc->chunk_size;
+  }
+  return alloc;
+}
+
+DynamicAllocator::AllocNode* DynamicAllocator::allocate_cached(u32 size_class) {
+  const u64 chunk_size = cMinChunkSize << size_class;
+  ThreadCache* cache = thread_cache_for(this, epoch_);
+
+  if (cache == nullptr) {
+    lock();
+    AllocNode* alloc = allocate_chunk(chunk_size);
+    unlock();
+    return alloc;
+  }
+
+  if (cache->heads[size_class] == nullptr) {
+    lock();
+    for (u32 i = 0; i < cCacheBatch; ++i) {
+      AllocNode* alloc = allocate_chunk(chunk_size);
+      if (alloc == nullptr) {
+        break;
+      }
+      alloc->cached = true;
+      links(alloc)->next = (AllocNode*)cache->heads[size_class];
+      cache->heads[size_class] = alloc;
+      cache->counts[size_class]++;
+    }
+    unlock();
+  }
+
+  AllocNode* alloc = (AllocNode*)cache->heads[size_class];
+  if (alloc != nullptr) {
+    cache->heads[size_class] = links(alloc)->next;
+    cache->counts[size_class]--;
+    alloc->cached = false;
+  }
+  return alloc;
+}
+
+void DynamicAllocator::release_chunk(AllocNode* alloc) {
+  alloc->freed = true;
+  alloc->cached = false;
+  allocated_bytes_ -= alloc->chunk_size;
+  FILL_FREED((u8*)alloc + sizeof(AllocNode), alloc->chunk_size);
+
+  alloc = coalesce(alloc);
+  if ((u8*)next_physical(alloc) == memory_ + memory_used_) {
+    // Last chunk before the untouched tail, give it back to the tail.
+    memory_used_ = (u8*)alloc - memory_;
+    top_prev_size_ = alloc->prev_size;
+  } else {
+    insert_free(alloc);
+  }
+}
+
+DynamicAllocator::AllocNode* DynamicAllocator::carve(u64 chunk_size) {
+  const u64 total_size = sizeof(AllocNode) + chunk_size;
+  if (total_size > memory_size_ - memory_used_) {
+    return nullptr;
+  }
+
+  AllocNode* alloc = (AllocNode*)(memory_ + memory_used_);
+  memory_used_ += total_size;
+
+  alloc->prev_size = top_prev_size_;
+  alloc->chunk_size = chunk_size;
+  top_prev_size_ = chunk_size;
+  return alloc;
+}
+
+DynamicAllocator::AllocNode* DynamicAllocator::take_free(u64 size) {
+  AllocNode* alloc = nullptr;
+
+  if (size <= cMaxClassSize) {
+    // Every chunk in a bin at or above the rounded up class fits.
+    const u32 mask = bin_mask_ & (~0U << size_class_index(size));
+    if (mask != 0) {
+      alloc = free_bins_[__builtin_ctz(mask)];
+    }
+  } else {
+    alloc = free_bins_[DYNAMIC_ALLOCATOR_SIZE_CLASSES - 1];
+    while (alloc != nullptr && alloc->chunk_size < size) {
+      alloc = links(alloc)->next;
+    }
+  }
+
+  if (alloc == nullptr) {
+    alloc = large_free_head_;
+    while (alloc != nullptr && alloc->chunk_size < size) {
+      alloc = links(alloc)->next;
+    }
+  }
+
+  if (alloc != nullptr) {
+    remove_free(alloc);
+  }
+  return alloc;
+}
+
+void DynamicAllocator::split(AllocNode* alloc, u64 size) {
+  if (alloc->chunk_size < size + sizeof(AllocNode) + cMinChunkSize) {
+    return;
+  }
+
+  AllocNode* rest = (AllocNode*)((u8*)alloc + sizeof(AllocNode) + size);
+  rest->prev_size = size;
+  rest->chunk_size = alloc->chunk_size - size - sizeof(AllocNode);
+  rest->freed = true;
+  alloc->chunk_size = size;
+
+  AllocNode* next = next_physical(rest);
+  if ((u8*)next < memory_ + memory_used_) {
+    // Neighbours of a free chunk are never free, so the rest can't merge.
+    next->prev_size = rest->chunk_size;
+    insert_free(rest);
+  } else {
+    memory_used_ = (u8*)rest - memory_;
+    top_prev_size_ = size;
+  }
+}
+
+DynamicAllocator::AllocNode* DynamicAllocator::coalesce(AllocNode* alloc) {
+  AllocNode* next = next_physical(alloc);
+  if ((u8*)next < memory_ + memory_used_ && next->freed) {
+    remove_free(next);
+    alloc->chunk_size += sizeof(AllocNode) + next->chunk_size;
+  }
+
+  if ((u8*)alloc > memory_) {
+    AllocNode* prev = prev_physical(alloc);
+    if (prev->freed) {
+      remove_free(prev);
+      prev->chunk_size += sizeof(AllocNode) + alloc->chunk_size;
+      alloc = prev;
+    }
+  }
+
+  next = next_physical(alloc);
+  if ((u8*)next < memory_ + memory_used_) {
+    next->prev_size = alloc->chunk_size;
   }
   return alloc;
 }
 
+void DynamicAllocator::insert_free(AllocNode* alloc) {
+  const u32 bin = bin_index(alloc->chunk_size);
+  FreeLinks* alloc_links = links(alloc);
+  alloc_links->prev = nullptr;
+
+  if (bin < DYNAMIC_ALLOCATOR_SIZE_CLASSES) {
+    alloc_links->next = free_bins_[bin];
+    free_bins_[bin] = alloc;
+    bin_mask_ |= 1U << bin;
+  } else if (!large_free_head_ || alloc->chunk_size <= large_free_head_->chunk_size) {
+    alloc_links->next = large_free_head_;
+    large_free_head_ = alloc;
+  } else {
+    AllocNode* previous = large_free_head_;
+    while (links(previous)->next != nullptr
+        && links(previous)->next->chunk_size < alloc->chunk_size) {
+      previous = links(previous)->next;
+    }
+    alloc_links->next = links(previous)->next;
+    alloc_links->prev = previous;
+    links(previous)->next = alloc;
+  }
+
+  if (alloc_links->next != nullptr) {
+    links(alloc_links->next)->prev = alloc;
+  }
+
+  free_bytes_ += alloc->chunk_size;
+  free_blocks_++;
+}
+
+void DynamicAllocator::remove_free(AllocNode* alloc) {
+  const u32 bin = bin_index(alloc->chunk_size);
+  FreeLinks* alloc_links = links(alloc);
+
+  if (alloc_links->prev != nullptr) {
+    links(alloc_links->prev)->next = alloc_links->next;
+  } else if (bin < DYNAMIC_ALLOCATOR_SIZE_CLASSES) {
+    free_bins_[bin] = alloc_links->next;
+    if (alloc_links->next == nullptr) {
+      bin_mask_ &= ~(1U << bin);
+    }
+  } else {
+    large_free_head_ = alloc_links->next;
+  }
+
+  if (alloc_links->next != nullptr) {
+    links(alloc_links->next)->prev = alloc_links->prev;
+  }
+
+  free_bytes_ -= alloc->chunk_size;
+  free_blocks_--;
+}
+
+DynamicAllocator::FreeLinks* DynamicAllocator::links(AllocNode* alloc) const {
+  return (FreeLinks*)((u8*)alloc + sizeof(AllocNode));
+}
+
+DynamicAllocator::AllocNode* DynamicAllocator::next_physical(AllocNode* alloc) const {
+  return (AllocNode*)((u8*)alloc + sizeof(AllocNode) + alloc->chunk_size);
+}
+
+DynamicAllocator::AllocNode* DynamicAllocator::prev_physical(AllocNode* alloc) const {
+  return (AllocNode*)((u8*)alloc - alloc->prev_size - sizeof(AllocNode));
+}
+
 void memory_report_stats() {
   LOG_INFO("~~~~~~~~~~ HEAP ALLOCATIONS ~~~~~~~~~~\n%s",
       HeapAllocationTracker::get().memory_stats_string());
 }
 
+void memory_report_stats(const DynamicAllocator* allocator) {
+  ASSERT(allocator != nullptr);
+  DynamicAllocatorStats stats{};
+  allocator->stats(&stats);
+
+  f64 arena_used = f64(stats.arena_used);
+  f64 arena_size = f64(stats.arena_size);
+  f64 allocated = f64(stats.allocated_bytes);
+  f64 free_bytes = f64(stats.free_bytes);
+  f64 largest = f64(stats.largest_free_block);
+  const u32 used_u = calc_units(&arena_used);
+  const u32 size_u = calc_units(&arena_size);
+  const u32 allocated_u = calc_units(&allocated);
+  const u32 free_u = calc_units(&free_bytes);
+  const u32 largest_u = calc_units(&largest);
+
+  LOG_INFO("~~~~~~~~~~ DYNAMIC ALLOCATOR ~~~~~~~~~~\n"
+      "  ARENA     : %0.2f%s of %0.2f%s carved\n"
+      "  LIVE      : %0.2f%s\n"
+      "  FREE      : %llu blocks of %0.2f%s, largest %0.2f%s\n"
+      "Fragmentation %0.2f%%\n",
+      arena_used, XiB[used_u], arena_size, XiB[size_u],
+      allocated, XiB[allocated_u],
+      stats.free_blocks, free_bytes, XiB[free_u], largest, XiB[largest_u],
+      stats.fragmentation * 100.0);
+}
+
 } // namespace Themepark
@@ -6,6 +6,9 @@
 #pragma once
 
 #include "defines.h"
+#include "system.h"
+
+#define DYNAMIC_ALLOCATOR_SIZE_CLASSES 13
 
 namespace Themepark {
 
@@ -30,7 +33,51 @@ public:
   ~LinearAllocator();
 
   void* allocate(u64 size);
-  void free(void* memory);
+  void free(void* memory); // no-op, memory is released by rewind/reset
+
+  u64 mark() const { return memory_used_; }
+  void rewind(u64 mark);
+  void reset();
+
+  u64 used() const { return memory_used_; }
+  u64 peak_used() const { return peak_used_; }
+  u64 capacity() const { return memory_size_; }
+
+private:
+  u8* memory_{};
+  u64 memory_size_{};
+  u64 memory_used_{};
+  u64 peak_used_{};
+};
+
+// Two linear arenas used on alternate frames. Memory handed out during
+// frame N stays valid while frame N + 1 is recorded and is recycled by
+// the reset at the start of frame N + 2.
+class FrameAllocator final {
+  DISABLE_COPY_AND_MOVE(FrameAllocator)
+public:
+  FrameAllocator(u64 frame_size);
+  ~FrameAllocator() = default;
+
+  void reset();
+  void* allocate(u64 size);
+
+  LinearAllocator* current() { return &arenas_[frame_index_]; }
+  LinearAllocator* previous() { return &arenas_[frame_index_ ^ 1]; }
+
+private:
+  LinearAllocator arenas_[2];
+  u32 frame_index_{};
+};
+
+struct DynamicAllocatorStats {
+  u64 arena_size;
+  u64 arena_used;       // high end of the carved region
+  u64 allocated_bytes;  // bytes owned by live chunks, headers excluded
+  u64 free_bytes;       // free chunks below arena_used plus the untouched tail
+  u64 free_blocks;
+  u64 largest_free_block;
+  f64 fragmentation;    // 1 - largest_free_block / free_bytes
 };
 
 class DynamicAllocator final {
@@ -39,31 +86,77 @@ public:
   DynamicAllocator() = default;
   ~DynamicAllocator() = default;
 
-  bool startup(u64 size);
+  // A thread safe allocator guards the arena with a mutex and serves small
+  // requests from per-thread caches. Threads other than the one calling
+  // shutdown must call release_thread_cache before they exit.
+  bool startup(u64 size, bool thread_safe = false);
   void shutdown();
 
   void* allocate(u64 size, MemoryTag tag);
   void free(void* memory, u64 size, MemoryTag tag);
+
+  void release_thread_cache();
+  void stats(DynamicAllocatorStats* out) const;
   
 private:
+  bool thread_safe_{};
+  u64 epoch_{};
+  mutable SystemMutex mutex_{};
+
   u8* memory_{};
   u64 memory_size_{};
   u64 memory_used_{};
-
-  struct AllocNode {
-    AllocNode* next;
-    u8* chunk;
+  u64 top_prev_size_{};
+  u64 allocated_bytes_{};
+  u64 free_bytes_{};
+  u64 free_blocks_{};
+
+  // Header placed right in front of every chunk. prev_size is the boundary
+  // tag of the physically preceding chunk, so both neighbours can be found
+  // in O(1) when coalescing.
+  struct alignas(16) AllocNode {
+    u64 prev_size;
     u64 chunk_size;
-    u8 freed;
     MemoryTag tag;
+    u8 freed;
+    u8 cached;
   };
+  static_assert(sizeof(AllocNode) == 32, "AllocNode must keep chunks 16 byte aligned!");
+
+  // Free list links, stored in the first bytes of a free chunk.
+  struct FreeLinks {
+    AllocNode* next;
+    AllocNode* prev;
+  };
+
+  void lock() const;
+  void unlock() const;
+
+  AllocNode* allocate_chunk(u64 chunk_size);
+  AllocNode* allocate_cached(u32 size_class);
+  void release_chunk(AllocNode* alloc);
+
+  AllocNode* carve(u64 chunk_size);
+  AllocNode* take_free(u64 size);
+  void split(AllocNode* alloc, u64 size);
+  AllocNode* coalesce(AllocNode* alloc);
+
+  void insert_free(AllocNode* alloc);
+  void remove_free(AllocNode* alloc);
 
-  AllocNode* find_freed(u64 size);
-  AllocNode* find_previous(u64 size);
+  FreeLinks* links(AllocNode* alloc) const;
+  AllocNode* next_physical(AllocNode* alloc) const;
+  AllocNode* prev_physical(AllocNode* alloc) const;
 
-  AllocNode* alloc_list_head_{};
+  // Free chunks of [16 << i, 16 << (i + 1)) bytes, bin_mask_ bit i is set
+  // while bin i is not empty.
+  AllocNode* free_bins_[DYNAMIC_ALLOCATOR_SIZE_CLASSES]{};
+  u32 bin_mask_{};
+  // Free chunks bigger than the largest size class, sorted by size.
+  AllocNode* large_free_head_{};
 };
 
 void memory_report_stats();
+void memory_report_stats(const DynamicAllocator* allocator);
 
 } // namespace Themepark
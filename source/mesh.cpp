@@ -5,113 +5,505 @@
 
 #include "mesh.h"
 #include "logging.h"
+#include "meshopt.h"
 
 namespace Themepark {
 
-Mesh::Mesh(DynamicAllocator* allocator) {
+// Binary mesh file, vertex and index blobs start on cMeshBlobAlignment
+// boundaries so they can be passed to GL straight from the mapping.
+struct MeshFileHeader {
+  u32 magic;
+  u32 version;
+  u64 source_size;
+  u64 source_time;
+  u32 vertex_count;
+  u32 index_count;
+  u32 index_size;
+  u32 vertex_format;
+  f32 bounds_min[3];
+  f32 bounds_max[3];
+  f32 bounding_sphere[4];
+  u64 vertex_offset;
+  u64 index_offset;
+};
+
+static_assert(sizeof(MeshFileHeader) == 96, "Unexpected MeshFileHeader size!");
+
+namespace {
+
+constexpr u64 cMeshBlobAlignment = 64;
+
+// Packed vertices are only used while the round trip stays this close.
+constexpr f32 cMaxPackedPositionError = 1.0e-2F; // 1 cm at the scene's metre scale
+constexpr f32 cMaxPackedNormalError = 0.5F; // degrees
+constexpr f32 cMaxPackedUvError = 1.0F / 2048.0F;
+
+u32 vertex_format_stride(VertexFormat format) {
+  return format == VertexFormat::Packed ? sizeof(PackedVertex) : sizeof(Vertex);
+}
+
+// Powers of ten for the float scanner, exponents outside the table fall
+// back to pow.
+constexpr f64 cPowersOfTen[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+  1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+constexpr i32 cMaxTableExponent = 22;
+constexpr u32 cMaxMantissaDigits = 19;
+
+inline bool is_space(u8 c) {
+  return c == ' ' || c == '\t' || c == '\v' || c == '\f';
+}
+
+inline bool is_digit(u8 c) {
+  return c >= '0' && c <= '9';
+}
+
+inline bool is_blank(const ObjCursor& cursor, u64 offset) {
+  return cursor.at + offset < cursor.end && is_space(cursor.at[offset]);
+}
+
+inline void skip_blanks(ObjCursor* cursor) {
+  while (cursor->at < cursor->end && is_space(*cursor->at)) {
+    cursor->at++;
+  }
+}
+
+inline void skip_line(ObjCursor* cursor) {
+  const u8* newline = (const u8*)memchr(cursor->at, '\n', cursor->end - cursor->at);
+  cursor->at = newline != nullptr ? newline + 1 : cursor->end;
+  cursor->line++;
+}
+
+bool parse_float(ObjCursor* cursor, f32* value) {
+  skip_blanks(cursor);
+  const u8* at = cursor->at;
+  const u8* end = cursor->end;
+
+  bool negative = false;
+  if (at < end && (*at == '-' || *at == '+')) {
+    negative = *at == '-';
+    at++;
+  }
+
+  u64 mantissa = 0;
+  u32 digits = 0;
+  i32 exponent = 0;
+  bool any = false;
+
+  for (; at < end && is_digit(*at); ++at, any = true) {
+    if (digits < cMaxMantissaDigits) {
+      mantissa = mantissa * 10 + (*at - '0');
+      digits += mantissa > 0 ? 1 : 0;
+    } else {
+      exponent++;
+    }
+  }
+
+  if (at < end && *at == '.') {
+    for (++at; at < end && is_digit(*at); ++at, any = true) {
+      if (digits < cMaxMantissaDigits) {
+        mantissa = mantissa * 10 + (*at - '0');
+        digits += mantissa > 0 ? 1 : 0;
+        exponent--;
+      }
+    }
+  }
+
+  if (!any) {
+    return false;
+  }
+
+  if (at < end && (*at == 'e' || *at == 'E')) {
+    const u8* mark = at++;
+    bool negative_exponent = false;
+    if (at < end && (*at == '-' || *at == '+')) {
+      negative_exponent = *at == '-';
+      at++;
+    }
+
+    if (at < end && is_digit(*at)) {
+      i32 e = 0;
+      for (; at < end && is_digit(*at); ++at) {
+        e = e < 10000 ? e * 10 + (*at - '0') : e;
+      }
+      exponent += negative_exponent ? -e : e;
+    } else {
+      at = mark;
+    }
+  }
+
+  f64 result = (f64)mantissa;
+  if (exponent < 0 && exponent >= -cMaxTableExponent) {
+    result /= cPowersOfTen[-exponent];
+  } else if (exponent > 0 && exponent <= cMaxTableExponent) {
+    result *= cPowersOfTen[exponent];
+  } else if (exponent != 0) {
+    result *= pow(10.0, exponent);
+  }
+
+  *value = (f32)(negative ? -result : result);
+  cursor->at = at;
+  return true;
+}
+
+// OBJ indices are 1-based, negative ones count back from the last
+// element read so far.
+bool parse_index(ObjCursor* cursor, u32 count, u32* index) {
+  const u8* at = cursor->at;
+  const u8* end = cursor->end;
+
+  bool negative = false;
+  if (at < end && *at == '-') {
+    negative = true;
+    at++;
+  }
+
+  if (at >= end || !is_digit(*at)) {
+    return false;
+  }
+
+  u64 value = 0;
+  for (; at < end && is_digit(*at); ++at) {
+    value = value * 10 + (*at - '0');
+    if (value > U32_MAX) {
+      return false;
+    }
+  }
+
+  if (value == 0 || value > count) {
+    return false;
+  }
+
+  *index = negative ? count - (u32)value : (u32)value - 1;
+  cursor->at = at;
+  return true;
+}
+
+// Hashes the raw bits of a vertex, identical vertices are merged.
+u64 hash_vertex(const Vertex& v) {
+  static_assert(sizeof(Vertex) == 8 * sizeof(u32), "Unexpected Vertex size!");
+  u32 words[8];
+  memcpy(words, &v, sizeof(Vertex));
+
+  u64 hash = 0xCBF29CE484222325ULL;
+  for (u32 i = 0; i < 8; ++i) {
+    hash = (hash ^ words[i]) * 0x100000001B3ULL;
+    hash ^= hash >> 29;
+  }
+  return hash;
+}
+
+u64 align_blob(u64 offset) {
+  return (offset + cMeshBlobAlignment - 1) & ~(cMeshBlobAlignment - 1);
+}
+
+// Swaps the extension of filename for .mesh.
+bool mesh_cache_path(char* path, const char* filename) {
+  const u64 len = strlen(filename);
+  if (len + 6 > MAX_PATH) {
+    return false;
+  }
+
+  memcpy(path, filename, len + 1);
+  char* ext = strrchr(path, '.');
+  char* slash = strrchr(path, '/');
+  if (ext == nullptr || (slash != nullptr && ext < slash)) {
+    ext = path + len;
+  }
+  memcpy(ext, ".mesh", 6);
+  return true;
+}
+
+} // namespace
+
+Mesh::Mesh(DynamicAllocator* allocator) : allocator(allocator) {
   positions.init(allocator, MemoryTag::Mesh);
   normals.init(allocator, MemoryTag::Mesh);
   texture_uvs.init(allocator, MemoryTag::Mesh);
   triangles.init(allocator, MemoryTag::Mesh);
   vertices.init(allocator, MemoryTag::Mesh);
+  packed_vertices.init(allocator, MemoryTag::Mesh);
+  indices.init(allocator, MemoryTag::Mesh);
 }
 
 Mesh::~Mesh() {
+  release();
+}
+
+bool Mesh::load(const char* filename) {
+  u64 source_size = 0;
+  u64 source_time = 0;
+  char cache_path[MAX_PATH];
+  if (filename == nullptr || !system_file_info(filename, &source_size, &source_time)
+      || !mesh_cache_path(cache_path, filename)) {
+    return load_from_obj(filename);
+  }
+
+  if (load_from_cache(cache_path, source_size, source_time)) {
+    return true;
+  }
+
+  if (!load_from_obj(filename)) {
+    return false;
+  }
+
+  const VertexCacheStats before = analyze_vertex_cache(indices.data(), indices.size(), (u32)vertices.size());
+  optimize();
+  const VertexCacheStats after = analyze_vertex_cache(indices.data(), indices.size(), (u32)vertices.size());
+  LOG_INFO("Mesh cache: %s ACMR %0.3f -> %0.3f, ATVR %0.3f -> %0.3f",
+      cache_path, before.acmr, after.acmr, before.atvr, after.atvr);
+  select_vertex_format(cache_path);
+
+  if (!write_cache(cache_path, source_size, source_time)) {
+    LOG_INFO("Mesh cache: could not write %s", cache_path);
+  }
+  return true;
+}
+
+void Mesh::optimize() {
+  ASSERT(cache_header == nullptr);
+  const u32 vertex_count = (u32)vertices.size();
+  optimize_vertex_cache(indices.data(), indices.size(), vertex_count, allocator);
+  optimize_vertex_fetch(vertices.data(), vertex_count, indices.data(), indices.size(), allocator);
+}
+
+VertexFormat Mesh::select_vertex_format(const char* name) {
+  ASSERT(cache_header == nullptr);
+  const u32 vertex_count = (u32)vertices.size();
+  PackedVertex* packed = (PackedVertex*)allocator->allocate(sizeof(PackedVertex) * vertex_count, MemoryTag::Mesh);
+  packed_vertices.clear();
+  if (packed == nullptr) {
+    LOG_ERROR("Mesh format: out of memory packing %s, keeping float vertices", name);
+    format = VertexFormat::Float32;
+    return format;
+  }
+  pack_vertices(packed, vertices.data(), vertex_count, bounds_min, bounds_max);
+  const VertexPackError error = measure_pack_error(packed, vertices.data(), vertex_count, bounds_min, bounds_max);
+
+  const bool use_packed = error.position <= cMaxPackedPositionError
+      && error.normal_degrees <= cMaxPackedNormalError
+      && error.uv <= cMaxPackedUvError;
+
+  if (use_packed) {
+    // The bulk push_back copies bytes, not elements
+    for (u32 i = 0; i < vertex_count; ++i) {
+      packed_vertices.push_back(packed[i]);
+    }
+  }
+  allocator->free(packed, sizeof(PackedVertex) * vertex_count, MemoryTag::Mesh);
+
+  format = use_packed ? VertexFormat::Packed : VertexFormat::Float32;
+  LOG_INFO("Mesh format: %s uses %s vertices, packed round trip error position %g, normal %0.4f deg, uv %g",
+      name, use_packed ? "packed" : "float", error.position, error.normal_degrees, error.uv);
+  return format;
+}
+
+void Mesh::release() {
   vertices.clear();
+  packed_vertices.clear();
+  indices.clear();
+  system_unmap_file(&cache_file);
+  cache_header = nullptr;
+  format = VertexFormat::Float32;
 }
 
-bool Mesh::load_from_obj(const char* filename) {
+VertexFormat Mesh::vertex_format() const {
+  return format;
+}
+
+const void* Mesh::vertex_data() const {
+  if (cache_header != nullptr) {
+    return cache_file.data + cache_header->vertex_offset;
+  }
+  return format == VertexFormat::Packed ? (const void*)packed_vertices.data() : (const void*)vertices.data();
+}
+
+u32 Mesh::vertex_stride() const {
+  return vertex_format_stride(format);
+}
 
-  FILE* file = fopen(filename, "r");
+u32 Mesh::vertex_count() const {
+  return cache_header != nullptr ? cache_header->vertex_count : (u32)vertices.size();
+}
+
+const void* Mesh::index_data() const {
+  if (cache_header != nullptr) {
+    return cache_file.data + cache_header->index_offset;
+  }
+  return indices.data();
+}
+
+u32 Mesh::index_count() const {
+  return cache_header != nullptr ? cache_header->index_count : (u32)indices.size();
+}
+
+u32 Mesh::index_size() const {
+  return cache_header != nullptr ? cache_header->index_size : sizeof(u32);
+}
+
+bool Mesh::load_from_cache(const char* filename, u64 source_size, u64 source_time) {
+  u64 size = 0;
+  u64 time = 0;
+  if (!system_file_info(filename, &size, &time) || !system_map_file(&cache_file, filename)) {
+    return false;
+  }
+
+  const MeshFileHeader* header = (const MeshFileHeader*)cache_file.data;
+  bool valid = cache_file.size >= sizeof(MeshFileHeader)
+      && header->magic == MESH_FILE_MAGIC
+      && header->version == MESH_FILE_VERSION
+      && (header->index_size == sizeof(u16) || header->index_size == sizeof(u32))
+      && header->vertex_offset % cMeshBlobAlignment == 0
+      && header->index_offset % cMeshBlobAlignment == 0
+      && (header->vertex_format == (u32)VertexFormat::Float32 || header->vertex_format == (u32)VertexFormat::Packed)
+      && header->vertex_offset + (u64)header->vertex_count * vertex_format_stride((VertexFormat)header->vertex_format) <= cache_file.size
+      && header->index_offset + (u64)header->index_count * header->index_size <= cache_file.size;
+
+  if (!valid) {
+    LOG_INFO("Mesh cache: %s is invalid, rebuilding", filename);
+  } else if (header->source_size != source_size || header->source_time != source_time) {
+    LOG_INFO("Mesh cache: %s is stale, rebuilding", filename);
+    valid = false;
+  }
+
+  if (!valid) {
+    system_unmap_file(&cache_file);
+    return false;
+  }
+
+  cache_header = header;
+  format = (VertexFormat)header->vertex_format;
+  bounds_min = vec3(header->bounds_min);
+  bounds_max = vec3(header->bounds_max);
+  bounding_sphere = vec4(header->bounding_sphere);
+  return true;
+}
+
+bool Mesh::write_cache(const char* filename, u64 source_size, u64 source_time) const {
+  const u32 vertex_count = (u32)vertices.size();
+  const u32 vertex_stride = vertex_format_stride(format);
+  const u32 index_count = (u32)indices.size();
+  const u32 index_size = vertex_count <= U16_MAX + 1 ? sizeof(u16) : sizeof(u32);
+
+  MeshFileHeader header;
+  memset(&header, 0, sizeof(MeshFileHeader));
+  header.magic = MESH_FILE_MAGIC;
+  header.version = MESH_FILE_VERSION;
+  header.source_size = source_size;
+  header.source_time = source_time;
+  header.vertex_count = vertex_count;
+  header.index_count = index_count;
+  header.index_size = index_size;
+  header.vertex_format = (u32)format;
+  memcpy(header.bounds_min, &bounds_min, sizeof(header.bounds_min));
+  memcpy(header.bounds_max, &bounds_max, sizeof(header.bounds_max));
+  memcpy(header.bounding_sphere, &bounding_sphere, sizeof(header.bounding_sphere));
+  header.vertex_offset = align_blob(sizeof(MeshFileHeader));
+  header.index_offset = align_blob(header.vertex_offset + (u64)vertex_count * vertex_stride);
+
+  // Written under a temporary name and renamed so a reader never maps a
+  // half written file.
+  char temp_path[MAX_PATH + 4];
+  snprintf(temp_path, sizeof(temp_path), "%s.tmp", filename);
+  FILE* file = fopen(temp_path, "wb");
   if (file == nullptr) {
-    LOG_ERROR("Failed to open %s!", filename);
     return false;
   }
 
-  char buf[MAX_READ_LEN];
+  static const u8 padding[cMeshBlobAlignment] = {};
+  bool result = fwrite(&header, sizeof(MeshFileHeader), 1, file) == 1
+      && fwrite(padding, header.vertex_offset - sizeof(MeshFileHeader), 1, file) == 1
+      && fwrite(vertex_data(), vertex_stride, vertex_count, file) == vertex_count;
 
-  for (;;) {
-    memset(buf, 0, sizeof(buf));
-    if (fgets(buf, sizeof(buf), file) == nullptr) {
+  const u64 vertex_end = header.vertex_offset + (u64)vertex_count * vertex_stride;
+  if (result && header.index_offset > vertex_end) {
+    result = fwrite(padding, header.index_offset - vertex_end, 1, file) == 1;
+  }
+
+  if (result && index_size == sizeof(u16)) {
+    u16* narrow = (u16*)allocator->allocate(sizeof(u16) * index_count, MemoryTag::Mesh);
+    if (narrow == nullptr) {
+      LOG_ERROR("Mesh cache: out of memory narrowing %u indices for %s", index_count, filename);
+      result = false;
+    } else {
+      for (u32 i = 0; i < index_count; ++i) {
+        narrow[i] = (u16)indices[i];
+      }
+      result = fwrite(narrow, sizeof(u16), index_count, file) == index_count;
+      allocator->free(narrow, sizeof(u16) * index_count, MemoryTag::Mesh);
+    }
+  } else if (result) {
+    result = fwrite(indices.data(), sizeof(u32), index_count, file) == index_count;
+  }
+
+  result = fclose(file) == 0 && result;
+  if (result) {
+    result = rename(temp_path, filename) == 0;
+  }
+
+  if (!result) {
+    remove(temp_path);
+  }
+  return result;
+}
+
+bool Mesh::load_from_obj(const char* filename) {
+  release();
+
+  SystemMappedFile file;
+  if (!system_map_file(&file, filename)) {
+    return false;
+  }
+
+  ObjCursor cursor{file.data, file.data + file.size, 1};
+  bool valid = true;
+
+  while (valid && cursor.at < cursor.end) {
+    skip_blanks(&cursor);
+    if (cursor.at >= cursor.end) {
       break;
     }
 
-    if (strncmp(buf, "v ", 2) == 0) {
+    const u8* line = cursor.at;
+    if (line[0] == 'v' && is_blank(cursor, 1)) {
+      cursor.at += 1;
       vec3 p;
-
-      if (sscanf(buf, "v %f %f %f\n", &p.x, &p.y, &p.z) == 3) {
+      valid = parse_float(&cursor, &p.x) && parse_float(&cursor, &p.y) && parse_float(&cursor, &p.z);
+      if (valid) {
         positions.push_back(p);
-      } else {
-        LOG_ERROR("OBJ loader: failed to parse \"%s\"", buf);
       }
-
-    } else if (strncmp(buf, "vn ", 3) == 0) {
+    } else if (line[0] == 'v' && cursor.at + 1 < cursor.end && line[1] == 'n' && is_blank(cursor, 2)) {
+      cursor.at += 2;
       vec3 n;
-
-      if (sscanf(buf, "vn %f %f %f\n", &n.x, &n.y, &n.z) == 3) {
+      valid = parse_float(&cursor, &n.x) && parse_float(&cursor, &n.y) && parse_float(&cursor, &n.z);
+      if (valid) {
         normals.push_back(n);
-      } else {
-        LOG_ERROR("OBJ loader: failed to parse \"%s\"", buf);
       }
-
-    } else if (strncmp(buf, "vt ", 3) == 0) {
+    } else if (line[0] == 'v' && cursor.at + 1 < cursor.end && line[1] == 't' && is_blank(cursor, 2)) {
+      cursor.at += 2;
       vec2 uv;
-
-      if (sscanf(buf, "vt %f %f\n", &uv.u, &uv.v) == 2) {
+      valid = parse_float(&cursor, &uv.u) && parse_float(&cursor, &uv.v);
+      if (valid) {
         texture_uvs.push_back(uv);
-      } else {
-        LOG_ERROR("OBJ loader: failed to parse \"%s\"", buf);
-      }
-
-    } else if (strncmp(buf, "f ", 2) == 0) {
-      u32 v[3], uv[3], n[3];
-
-      if (sscanf(buf, "f %i/%i/%i\t%i/%i/%i\t%i/%i/%i\n",
-                 &v[0], &uv[0], &n[0],
-                 &v[1], &uv[1], &n[1],
-                 &v[2], &uv[2], &n[2]) == 9) {
-
-        Triangle tri;
-        tri.v_idx[0] = v[0] - 1;
-        tri.v_idx[1] = v[1] - 1;
-        tri.v_idx[2] = v[2] - 1;
-        tri.uv_idx[0] = uv[0] - 1;
-        tri.uv_idx[1] = uv[1] - 1;
-        tri.uv_idx[2] = uv[2] - 1;
-        tri.n_idx[0] = n[0] - 1;
-        tri.n_idx[1] = n[1] - 1;
-        tri.n_idx[2] = n[2] - 1;
-
-        triangles.push_back(tri);
-      } else {
-        LOG_ERROR("OBJ loader: failed to parse \"%s\"", buf);
       }
+    } else if (line[0] == 'f' && is_blank(cursor, 1)) {
+      cursor.at += 1;
+      valid = parse_face(&cursor);
     }
-  }
 
-  u64 triangle_count = triangles.size();
-  for (u64 i = 0; i < triangle_count; ++i) {
-    Vertex a = {
-      positions[triangles[i].v_idx[0]],
-      normals[triangles[i].n_idx[0]],
-      texture_uvs[triangles[i].uv_idx[0]],
-    };
+    if (!valid) {
+      LOG_ERROR("OBJ loader: %s:%u: failed to parse line", filename, cursor.line);
+      break;
+    }
 
-    Vertex b = {
-      positions[triangles[i].v_idx[1]],
-      normals[triangles[i].n_idx[1]],
-      texture_uvs[triangles[i].uv_idx[1]],
-    };
+    skip_line(&cursor);
+  }
 
-    Vertex c = {
-      positions[triangles[i].v_idx[2]],
-      normals[triangles[i].n_idx[2]],
-      texture_uvs[triangles[i].uv_idx[2]],
-    };
+  system_unmap_file(&file);
 
-    vertices.push_back(a);
-    vertices.push_back(b);
-    vertices.push_back(c);
+  if (valid) {
+    valid = build_vertices();
   }
 
   positions.clear();
@@ -119,8 +511,203 @@ bool Mesh::load_from_obj(const char* filename) {
   texture_uvs.clear();
   triangles.clear();
 
-  fclose(file);
+  if (!valid) {
+    vertices.clear();
+    indices.clear();
+  }
+  return valid;
+}
+
+bool Mesh::parse_face(ObjCursor* cursor) {
+  u32 corners[3][3];
+  u32 count = 0;
+
+  for (;;) {
+    skip_blanks(cursor);
+    if (cursor->at >= cursor->end || *cursor->at == '\n' || *cursor->at == '\r' || *cursor->at == '#') {
+      break;
+    }
+
+    u32 corner[3] = {U32_MAX, U32_MAX, U32_MAX};
+    if (!parse_index(cursor, (u32)positions.size(), &corner[0])) {
+      return false;
+    }
+
+    if (cursor->at < cursor->end && *cursor->at == '/') {
+      cursor->at++;
+      if (cursor->at < cursor->end && *cursor->at != '/') {
+        if (!parse_index(cursor, (u32)texture_uvs.size(), &corner[1])) {
+          return false;
+        }
+      }
+
+      if (cursor->at < cursor->end && *cursor->at == '/') {
+        cursor->at++;
+        if (!parse_index(cursor, (u32)normals.size(), &corner[2])) {
+          return false;
+        }
+      }
+    }
+
+    // Polygons are split into a fan around their first corner.
+    if (count < 3) {
+      memcpy(corners[count], corner, sizeof(corner));
+    } else {
+      memcpy(corners[1], corners[2], sizeof(corner));
+      memcpy(corners[2], corner, sizeof(corner));
+    }
+    count++;
+
+    if (count >= 3) {
+      Triangle tri;
+      for (u32 i = 0; i < 3; ++i) {
+        tri.v_idx[i] = corners[i][0];
+        tri.uv_idx[i] = corners[i][1];
+        tri.n_idx[i] = corners[i][2];
+      }
+      triangles.push_back(tri);
+    }
+  }
+
+  return count >= 3;
+}
+
+bool Mesh::build_vertices() {
+  static const vec2 no_uv(0.0F, 0.0F);
+
+  const u64 triangle_count = triangles.size();
+  if (triangle_count == 0) {
+    return false;
+  }
+
+  // Open addressed table of vertex indices, at most half full.
+  u64 table_size = 1;
+  while (table_size < triangle_count * 6) {
+    table_size <<= 1;
+  }
+  u32* table = (u32*)allocator->allocate(sizeof(u32) * table_size, MemoryTag::Mesh);
+  if (table == nullptr) {
+    LOG_ERROR("OBJ loader: out of memory for the vertex table of %llu triangles", triangle_count);
+    return false;
+  }
+  memset(table, 0xFF, sizeof(u32) * table_size);
+
+  for (u64 i = 0; i < triangle_count; ++i) {
+    const Triangle& tri = triangles[i];
+
+    // Faces without normals get the flat face normal.
+    vec3 face_normal;
+    if (tri.n_idx[0] == U32_MAX || tri.n_idx[1] == U32_MAX || tri.n_idx[2] == U32_MAX) {
+      const vec3& a = positions[tri.v_idx[0]];
+      const vec3& b = positions[tri.v_idx[1]];
+      const vec3& c = positions[tri.v_idx[2]];
+      face_normal = normalized(cross(b - a, c - a));
+    }
+
+    for (u32 j = 0; j < 3; ++j) {
+      Vertex v = {
+        positions[tri.v_idx[j]],
+        tri.n_idx[j] == U32_MAX ? face_normal : normals[tri.n_idx[j]],
+        tri.uv_idx[j] == U32_MAX ? no_uv : texture_uvs[tri.uv_idx[j]],
+      };
+
+      u64 slot = hash_vertex(v) & (table_size - 1);
+      while (table[slot] != U32_MAX && memcmp(&vertices[table[slot]], &v, sizeof(Vertex)) != 0) {
+        slot = (slot + 1) & (table_size - 1);
+      }
+
+      if (table[slot] == U32_MAX) {
+        table[slot] = (u32)vertices.size();
+        vertices.push_back(v);
+      }
+      indices.push_back(table[slot]);
+    }
+  }
+
+  allocator->free(table, sizeof(u32) * table_size, MemoryTag::Mesh);
+
+  bounds_min = vertices[0].position;
+  bounds_max = vertices[0].position;
+  for (u64 i = 1; i < vertices.size(); ++i) {
+    const vec3& p = vertices[i].position;
+    bounds_min.set(fminf(bounds_min.x, p.x), fminf(bounds_min.y, p.y), fminf(bounds_min.z, p.z));
+    bounds_max.set(fmaxf(bounds_max.x, p.x), fmaxf(bounds_max.y, p.y), fmaxf(bounds_max.z, p.z));
+  }
+
+  // Centred on the box, the radius reaches the furthest vertex which is
+  // usually tighter than the half diagonal.
+  const vec3 center = (bounds_min + bounds_max) * 0.5F;
+  f32 radius = 0.0F;
+  for (u64 i = 0; i < vertices.size(); ++i) {
+    const vec3 d = vertices[i].position - center;
+    radius = fmaxf(radius, dot(d, d));
+  }
+  bounding_sphere = vec4(center.x, center.y, center.z, sqrtf(radius));
   return true;
 }
 
+bool mesh_benchmark_obj(const char* filename, u32 iterations) {
+  DynamicAllocator allocator;
+  if (!allocator.startup(MiB(512))) {
+    return false;
+  }
+
+  bool result = true;
+  u64 file_size = 0;
+  u64 best_ns = U64_MAX;
+  u64 total_ns = 0;
+  u64 vertex_count = 0;
+  u64 index_count = 0;
+
+  for (u32 i = 0; i < iterations && result; ++i) {
+    Mesh mesh(&allocator);
+    const u64 start = system_time_ns();
+    result = mesh.load_from_obj(filename);
+    const u64 elapsed = system_time_ns() - start;
+
+    best_ns = elapsed < best_ns ? elapsed : best_ns;
+    total_ns += elapsed;
+    vertex_count = mesh.vertices.size();
+    index_count = mesh.indices.size();
+  }
+
+  SystemMappedFile file;
+  if (result && system_map_file(&file, filename)) {
+    file_size = file.size;
+    system_unmap_file(&file);
+  }
+
+  if (result && file_size > 0) {
+    const f64 mib = f64(file_size) / f64(MiB(1));
+    LOG_INFO("OBJ benchmark: %s", filename);
+    LOG_INFO("  %0.2f MiB, %llu vertices, %llu indices, %u iterations",
+        mib, vertex_count, index_count, iterations);
+    LOG_INFO("  best %0.3f ms, %0.1f MiB/s", f64(best_ns) * 1.0e-6, mib / (f64(best_ns) * 1.0e-9));
+    LOG_INFO("  mean %0.3f ms, %0.1f MiB/s", f64(total_ns) * 1.0e-6 / iterations,
+        mib / (f64(total_ns) * 1.0e-9 / iterations));
+  } else {
+    LOG_ERROR("OBJ benchmark: failed to load %s", filename);
+  }
+
+  // The cache optimiser on the parsed mesh, the same pass load runs
+  // before writing a cache
+  if (result) {
+    Mesh mesh(&allocator);
+    result = mesh.load_from_obj(filename);
+    if (result) {
+      const u32 count = (u32)mesh.vertices.size();
+      const VertexCacheStats before = analyze_vertex_cache(mesh.indices.data(), mesh.indices.size(), count);
+      const u64 start = system_time_ns();
+      mesh.optimize();
+      const u64 elapsed = system_time_ns() - start;
+      const VertexCacheStats after = analyze_vertex_cache(mesh.indices.data(), mesh.indices.size(), count);
+      LOG_INFO("  optimize %0.3f ms, ACMR %0.3f -> %0.3f, ATVR %0.3f -> %0.3f",
+          f64(elapsed) * 1.0e-6, before.acmr, after.acmr, before.atvr, after.atvr);
+    }
+  }
+
+  allocator.shutdown();
+  return result;
+}
+
 } // namespace Themepark
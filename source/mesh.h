@@ -7,36 +7,112 @@
 
 #include "defines.h"
 #include "dynarray.h"
+#include "system.h"
 #include "vec3.h"
 #include "vec2.h"
+#include "vec4.h"
+
+#define MESH_FILE_MAGIC 0x4853454D // "MESH"
+#define MESH_FILE_VERSION 4
 
 namespace Themepark {
 
+struct MeshFileHeader;
+
 struct Triangle {
   u32 v_idx[3];
   u32 uv_idx[3];
   u32 n_idx[3]; 
 };
 
+struct ObjCursor {
+  const u8* at;
+  const u8* end;
+  u32 line;
+};
+
 struct Vertex {
   vec3 position;
   vec3 normal;
   vec2 uv;
 };
 
+// 16 bytes: snorm16 position relative to the mesh bounds, octahedral
+// snorm16 normal and half float uv.
+struct PackedVertex {
+  i16 position[4];
+  i16 normal[2];
+  u16 uv[2];
+};
+
+enum class VertexFormat : u32 {
+  Float32 = 0, // Vertex
+  Packed,      // PackedVertex
+};
+
 class Mesh final {
   DISABLE_COPY_AND_MOVE(Mesh);
 public:
   Mesh(DynamicAllocator* allocator);
   ~Mesh();
 
+  // Loads the binary cache next to filename, or parses the OBJ and
+  // writes a new cache when it is missing or older than the source.
+  bool load(const char* filename);
+
+  // Accepts v, v/vt, v//vn and v/vt/vn corners, polygons are fanned
+  // into triangles.
   bool load_from_obj(const char* filename);
 
+  // Reorders triangles for the post-transform cache, then vertices
+  // by first use. Cached meshes are stored optimised.
+  void optimize();
+
+  // Packs the vertices when the round trip error stays within limits,
+  // logs the error either way and returns the chosen format.
+  VertexFormat select_vertex_format(const char* name);
+
+  // Frees parsed data and unmaps the cache file.
+  void release();
+
+  // Vertex and index data, pointing into the mapped cache when loaded
+  // from one. Index size is 2 or 4 bytes.
+  VertexFormat vertex_format() const;
+  const void* vertex_data() const;
+  u32 vertex_stride() const;
+  u32 vertex_count() const;
+  const void* index_data() const;
+  u32 index_count() const;
+  u32 index_size() const;
+
+  // Computed with the vertices and kept in the cache.
+  vec3 bounds_min;
+  vec3 bounds_max;
+  vec4 bounding_sphere; // xyz centre, w radius
+
+  // Unique vertices, indices holds three entries per triangle.
   DynArray<Vertex> vertices;
+  DynArray<PackedVertex> packed_vertices;
+  DynArray<u32> indices;
   DynArray<vec3> positions;
   DynArray<vec3> normals;
   DynArray<vec2> texture_uvs;
   DynArray<Triangle> triangles;
+
+private:
+  bool parse_face(ObjCursor* cursor);
+  bool build_vertices();
+  bool load_from_cache(const char* filename, u64 source_size, u64 source_time);
+  bool write_cache(const char* filename, u64 source_size, u64 source_time) const;
+
+  SystemMappedFile cache_file{};
+  const MeshFileHeader* cache_header = nullptr;
+  VertexFormat format = VertexFormat::Float32;
+  DynamicAllocator* allocator = nullptr;
 };
 
+// Loads filename repeatedly and logs parse throughput, then runs the
+// vertex cache optimiser once and logs ACMR and ATVR before and after.
+bool mesh_benchmark_obj(const char* filename, u32 iterations);
+
 } // namespace Themepark
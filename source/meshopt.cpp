@@ -0,0 +1,369 @@
+// meshopt.cpp
+// Kostya Leshenko
+// CS447P
+// Themepark
+
+#include "meshopt.h"
+#include "logging.h"
+
+namespace Themepark {
+
+namespace {
+
+constexpr f32 cCacheDecayPower = 1.5F;
+constexpr f32 cLastTriangleScore = 0.75F;
+constexpr f32 cValenceBoostScale = 2.0F;
+constexpr f32 cValenceBoostPower = 0.5F;
+constexpr u32 cNoPosition = U32_MAX;
+
+struct OptVertex {
+  u32 cache_position;
+  u32 remaining;   // triangles not emitted yet
+  u32 first;       // into the adjacency list
+  u32 count;       // all triangles using the vertex
+  f32 score;
+};
+
+f32 vertex_score(const OptVertex& v) {
+  if (v.remaining == 0) {
+    return -1.0F;
+  }
+
+  f32 score = 0.0F;
+  if (v.cache_position != cNoPosition) {
+    if (v.cache_position < 3) {
+      // The last triangle's vertices get a fixed score so the next one
+      // doesn't simply reuse the same edge.
+      score = cLastTriangleScore;
+    } else {
+      const f32 scale = 1.0F / (MESHOPT_CACHE_SIZE - 3);
+      score = powf(1.0F - (v.cache_position - 3) * scale, cCacheDecayPower);
+    }
+  }
+
+  return score + cValenceBoostScale * powf((f32)v.remaining, -cValenceBoostPower);
+}
+
+i16 encode_snorm16(f32 f) {
+  f = f < -1.0F ? -1.0F : (f > 1.0F ? 1.0F : f);
+  return (i16)lrintf(f * 32767.0F);
+}
+
+f32 decode_snorm16(i16 i) {
+  const f32 f = f32(i) / 32767.0F;
+  return f < -1.0F ? -1.0F : f;
+}
+
+// Octahedral normal encoding, the lower hemisphere is folded over the
+// diagonals.
+void encode_octahedral(const vec3& n, i16* out) {
+  const f32 l1 = Math::abs(n.x) + Math::abs(n.y) + Math::abs(n.z);
+  f32 x = l1 > 0.0F ? n.x / l1 : 0.0F;
+  f32 y = l1 > 0.0F ? n.y / l1 : 0.0F;
+  if (n.z < 0.0F) {
+    const f32 fx = (1.0F - Math::abs(y)) * (x >= 0.0F ? 1.0F : -1.0F);
+    const f32 fy = (1.0F - Math::abs(x)) * (y >= 0.0F ? 1.0F : -1.0F);
+    x = fx;
+    y = fy;
+  }
+  out[0] = encode_snorm16(x);
+  out[1] = encode_snorm16(y);
+}
+
+vec3 decode_octahedral(const i16* in) {
+  vec3 n(decode_snorm16(in[0]), decode_snorm16(in[1]), 0.0F);
+  n.z = 1.0F - Math::abs(n.x) - Math::abs(n.y);
+  const f32 t = n.z < 0.0F ? -n.z : 0.0F;
+  n.x += n.x >= 0.0F ? -t : t;
+  n.y += n.y >= 0.0F ? -t : t;
+  return n * (1.0F / sqrtf(n.x * n.x + n.y * n.y + n.z * n.z));
+}
+
+} // namespace
+
+void quantization_range(const vec3& bounds_min, const vec3& bounds_max, vec3* offset, vec3* scale) {
+  ASSERT(offset != nullptr && scale != nullptr);
+  *offset = (bounds_min + bounds_max) * 0.5F;
+  *scale = (bounds_max - bounds_min) * 0.5F;
+  scale->x = scale->x > 0.0F ? scale->x : 1.0F;
+  scale->y = scale->y > 0.0F ? scale->y : 1.0F;
+  scale->z = scale->z > 0.0F ? scale->z : 1.0F;
+}
+
+void pack_vertices(PackedVertex* packed, const Vertex* vertices, u32 vertex_count,
+    const vec3& bounds_min, const vec3& bounds_max) {
+  ASSERT(packed != nullptr && vertices != nullptr);
+  vec3 offset;
+  vec3 scale;
+  quantization_range(bounds_min, bounds_max, &offset, &scale);
+
+  for (u32 i = 0; i < vertex_count; ++i) {
+    const Vertex& v = vertices[i];
+    PackedVertex& p = packed[i];
+    p.position[0] = encode_snorm16((v.position.x - offset.x) / scale.x);
+    p.position[1] = encode_snorm16((v.position.y - offset.y) / scale.y);
+    p.position[2] = encode_snorm16((v.position.z - offset.z) / scale.z);
+    p.position[3] = 0;
+    encode_octahedral(v.normal, p.normal);
+    p.uv[0] = Math::float_to_half(v.uv.u);
+    p.uv[1] = Math::float_to_half(v.uv.v);
+  }
+}
+
+VertexPackError measure_pack_error(const PackedVertex* packed, const Vertex* vertices, u32 vertex_count,
+    const vec3& bounds_min, const vec3& bounds_max) {
+  vec3 offset;
+  vec3 scale;
+  quantization_range(bounds_min, bounds_max, &offset, &scale);
+
+  VertexPackError error{};
+  f32 max_angle = 0.0F;
+  for (u32 i = 0; i < vertex_count; ++i) {
+    const Vertex& v = vertices[i];
+    const PackedVertex& p = packed[i];
+
+    const vec3 position(
+        decode_snorm16(p.position[0]) * scale.x + offset.x,
+        decode_snorm16(p.position[1]) * scale.y + offset.y,
+        decode_snorm16(p.position[2]) * scale.z + offset.z);
+    const vec3 d = position - v.position;
+    error.position = Math::max(error.position, Math::max(Math::abs(d.x), Math::max(Math::abs(d.y), Math::abs(d.z))));
+
+    // atan2 of the cross and dot products stays accurate for the tiny
+    // angles involved, unlike acos of an approximately normalised dot.
+    const vec3 normal = decode_octahedral(p.normal);
+    const vec3 c = cross(normal, v.normal);
+    const f32 sine = sqrtf(c.x * c.x + c.y * c.y + c.z * c.z);
+    const f32 cosine = normal.x * v.normal.x + normal.y * v.normal.y + normal.z * v.normal.z;
+    max_angle = Math::max(max_angle, atan2f(sine, cosine));
+
+    const f32 du = Math::abs(Math::half_to_float(p.uv[0]) - v.uv.u);
+    const f32 dv = Math::abs(Math::half_to_float(p.uv[1]) - v.uv.v);
+    error.uv = Math::max(error.uv, Math::max(du, dv));
+  }
+
+  error.normal_degrees = max_angle * 180.0F / Math::PI;
+  return error;
+}
+
+void optimize_vertex_cache(u32* indices, u64 index_count, u32 vertex_count, DynamicAllocator* allocator) {
+  ASSERT(indices != nullptr && allocator != nullptr);
+  ASSERT(index_count % 3 == 0);
+  const u64 triangle_count = index_count / 3;
+  if (triangle_count < 2 || vertex_count == 0) {
+    return;
+  }
+
+  OptVertex* vertices = (OptVertex*)allocator->allocate(sizeof(OptVertex) * vertex_count, MemoryTag::Mesh);
+  u32* adjacency = (u32*)allocator->allocate(sizeof(u32) * index_count, MemoryTag::Mesh);
+  f32* triangle_scores = (f32*)allocator->allocate(sizeof(f32) * triangle_count, MemoryTag::Mesh);
+  bool* emitted = (bool*)allocator->allocate(sizeof(bool) * triangle_count, MemoryTag::Mesh);
+  u32* output = (u32*)allocator->allocate(sizeof(u32) * index_count, MemoryTag::Mesh);
+  if (vertices == nullptr || adjacency == nullptr || triangle_scores == nullptr || emitted == nullptr
+      || output == nullptr) {
+    // Only an optimisation, the triangles keep their order. Freeing null is a no-op.
+    LOG_ERROR("Mesh optimizer: out of memory reordering %llu triangles", triangle_count);
+    allocator->free(output, sizeof(u32) * index_count, MemoryTag::Mesh);
+    allocator->free(emitted, sizeof(bool) * triangle_count, MemoryTag::Mesh);
+    allocator->free(triangle_scores, sizeof(f32) * triangle_count, MemoryTag::Mesh);
+    allocator->free(adjacency, sizeof(u32) * index_count, MemoryTag::Mesh);
+    allocator->free(vertices, sizeof(OptVertex) * vertex_count, MemoryTag::Mesh);
+    return;
+  }
+
+  memset(vertices, 0, sizeof(OptVertex) * vertex_count);
+  memset(emitted, 0, sizeof(bool) * triangle_count);
+
+  // Triangle lists per vertex, laid out back to back.
+  for (u64 i = 0; i < index_count; ++i) {
+    vertices[indices[i]].count++;
+  }
+
+  u32 offset = 0;
+  for (u32 i = 0; i < vertex_count; ++i) {
+    vertices[i].first = offset;
+    vertices[i].remaining = 0;
+    vertices[i].cache_position = cNoPosition;
+    offset += vertices[i].count;
+  }
+
+  for (u64 i = 0; i < index_count; ++i) {
+    OptVertex& v = vertices[indices[i]];
+    adjacency[v.first + v.remaining] = (u32)(i / 3);
+    v.remaining++;
+  }
+
+  for (u32 i = 0; i < vertex_count; ++i) {
+    vertices[i].score = vertex_score(vertices[i]);
+  }
+
+  for (u64 t = 0; t < triangle_count; ++t) {
+    triangle_scores[t] = vertices[indices[t * 3]].score
+        + vertices[indices[t * 3 + 1]].score
+        + vertices[indices[t * 3 + 2]].score;
+  }
+
+  // Cache holds the current LRU plus room for the three vertices that
+  // are pushed in front before the tail is dropped.
+  u32 cache[MESHOPT_CACHE_SIZE + 3];
+  u32 cache_count = 0;
+  u64 best_triangle = U64_MAX;
+  u64 scan_cursor = 0;
+
+  for (u64 t = 0; t < triangle_count; ++t) {
+    if (best_triangle == U64_MAX) {
+      // Nothing in the cache has work left, take the best remaining one.
+      f32 best_score = -1.0F;
+      for (u64 i = scan_cursor; i < triangle_count; ++i) {
+        if (!emitted[i] && triangle_scores[i] > best_score) {
+          best_score = triangle_scores[i];
+          best_triangle = i;
+        }
+      }
+    }
+
+    ASSERT(best_triangle != U64_MAX && !emitted[best_triangle]);
+    const u32* tri = &indices[best_triangle * 3];
+    memcpy(&output[t * 3], tri, sizeof(u32) * 3);
+    emitted[best_triangle] = true;
+    while (scan_cursor < triangle_count && emitted[scan_cursor]) {
+      scan_cursor++;
+    }
+
+    // Remove the triangle from its vertices' remaining lists.
+    for (u32 k = 0; k < 3; ++k) {
+      OptVertex& v = vertices[tri[k]];
+      u32* list = &adjacency[v.first];
+      for (u32 j = 0; j < v.remaining; ++j) {
+        if (list[j] == best_triangle) {
+          list[j] = list[v.remaining - 1];
+          break;
+        }
+      }
+      v.remaining--;
+    }
+
+    // Move the triangle's vertices to the front of the cache.
+    u32 new_cache[MESHOPT_CACHE_SIZE + 3];
+    u32 new_count = 0;
+    for (u32 k = 0; k < 3; ++k) {
+      new_cache[new_count++] = tri[k];
+    }
+    for (u32 i = 0; i < cache_count; ++i) {
+      const u32 index = cache[i];
+      if (index != tri[0] && index != tri[1] && index != tri[2]) {
+        new_cache[new_count++] = index;
+      }
+    }
+
+    for (u32 i = 0; i < new_count; ++i) {
+      vertices[new_cache[i]].cache_position = i < MESHOPT_CACHE_SIZE ? i : cNoPosition;
+    }
+    cache_count = new_count < MESHOPT_CACHE_SIZE ? new_count : MESHOPT_CACHE_SIZE;
+    memcpy(cache, new_cache, sizeof(u32) * cache_count);
+
+    // Rescore everything that moved and pick the best triangle touching
+    // the cache, including vertices that just fell out of it.
+    for (u32 i = 0; i < new_count; ++i) {
+      OptVertex& v = vertices[new_cache[i]];
+      const f32 delta = vertex_score(v) - v.score;
+      v.score += delta;
+      for (u32 j = 0; j < v.remaining; ++j) {
+        triangle_scores[adjacency[v.first + j]] += delta;
+      }
+    }
+
+    f32 best_score = -1.0F;
+    best_triangle = U64_MAX;
+    for (u32 i = 0; i < cache_count; ++i) {
+      const OptVertex& v = vertices[cache[i]];
+      for (u32 j = 0; j < v.remaining; ++j) {
+        const u32 candidate = adjacency[v.first + j];
+        if (triangle_scores[candidate] > best_score) {
+          best_score = triangle_scores[candidate];
+          best_triangle = candidate;
+        }
+      }
+    }
+  }
+
+  memcpy(indices, output, sizeof(u32) * index_count);
+
+  allocator->free(output, sizeof(u32) * index_count, MemoryTag::Mesh);
+  allocator->free(emitted, sizeof(bool) * triangle_count, MemoryTag::Mesh);
+  allocator->free(triangle_scores, sizeof(f32) * triangle_count, MemoryTag::Mesh);
+  allocator->free(adjacency, sizeof(u32) * index_count, MemoryTag::Mesh);
+  allocator->free(vertices, sizeof(OptVertex) * vertex_count, MemoryTag::Mesh);
+}
+
+void optimize_vertex_fetch(Vertex* vertices, u32 vertex_count, u32* indices, u64 index_count,
+    DynamicAllocator* allocator) {
+  ASSERT(vertices != nullptr && indices != nullptr && allocator != nullptr);
+  if (vertex_count == 0) {
+    return;
+  }
+
+  u32* remap = (u32*)allocator->allocate(sizeof(u32) * vertex_count, MemoryTag::Mesh);
+  Vertex* reordered = (Vertex*)allocator->allocate(sizeof(Vertex) * vertex_count, MemoryTag::Mesh);
+  if (remap == nullptr || reordered == nullptr) {
+    LOG_ERROR("Mesh optimizer: out of memory reordering %u vertices", vertex_count);
+    allocator->free(reordered, sizeof(Vertex) * vertex_count, MemoryTag::Mesh);
+    allocator->free(remap, sizeof(u32) * vertex_count, MemoryTag::Mesh);
+    return;
+  }
+  memset(remap, 0xFF, sizeof(u32) * vertex_count);
+
+  u32 next = 0;
+  for (u64 i = 0; i < index_count; ++i) {
+    const u32 index = indices[i];
+    if (remap[index] == U32_MAX) {
+      remap[index] = next;
+      reordered[next] = vertices[index];
+      next++;
+    }
+    indices[i] = remap[index];
+  }
+
+  // Vertices no triangle references are kept at the end.
+  for (u32 i = 0; i < vertex_count; ++i) {
+    if (remap[i] == U32_MAX) {
+      reordered[next++] = vertices[i];
+    }
+  }
+
+  memcpy(vertices, reordered, sizeof(Vertex) * vertex_count);
+  allocator->free(reordered, sizeof(Vertex) * vertex_count, MemoryTag::Mesh);
+  allocator->free(remap, sizeof(u32) * vertex_count, MemoryTag::Mesh);
+}
+
+VertexCacheStats analyze_vertex_cache(const u32* indices, u64 index_count, u32 vertex_count) {
+  VertexCacheStats stats{};
+  if (index_count < 3 || vertex_count == 0) {
+    return stats;
+  }
+
+  u32 fifo[MESHOPT_FIFO_SIZE];
+  u32 head = 0;
+  u32 size = 0;
+  u64 transformed = 0;
+
+  for (u64 i = 0; i < index_count; ++i) {
+    bool hit = false;
+    for (u32 j = 0; j < size && !hit; ++j) {
+      hit = fifo[j] == indices[i];
+    }
+
+    if (!hit) {
+      fifo[head] = indices[i];
+      head = (head + 1) % MESHOPT_FIFO_SIZE;
+      size = size < MESHOPT_FIFO_SIZE ? size + 1 : size;
+      transformed++;
+    }
+  }
+
+  stats.acmr = f32(transformed) / f32(index_count / 3);
+  stats.atvr = f32(transformed) / f32(vertex_count);
+  return stats;
+}
+
+} // namespace Themepark
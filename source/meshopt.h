@@ -0,0 +1,49 @@
+// meshopt.h
+// Kostya Leshenko
+// CS447P
+// Themepark
+
+#pragma once
+
+#include "defines.h"
+#include "memory.h"
+#include "mesh.h"
+
+#define MESHOPT_CACHE_SIZE 32     // LRU size the reordering optimises for
+#define MESHOPT_FIFO_SIZE 16      // FIFO size used to measure ACMR/ATVR
+
+namespace Themepark {
+
+struct VertexPackError {
+  f32 position;       // world units
+  f32 normal_degrees;
+  f32 uv;
+};
+
+struct VertexCacheStats {
+  f32 acmr; // transformed vertices per triangle
+  f32 atvr; // transformed vertices per unique vertex
+};
+
+// Reorders triangles for post-transform cache hits (Forsyth's linear
+// speed vertex cache optimisation).
+void optimize_vertex_cache(u32* indices, u64 index_count, u32 vertex_count, DynamicAllocator* allocator);
+
+// Reorders vertices by first use and remaps the indices to match.
+void optimize_vertex_fetch(Vertex* vertices, u32 vertex_count, u32* indices, u64 index_count,
+    DynamicAllocator* allocator);
+
+// Position dequantisation is position * scale + offset. The renderer
+// passes both as constant vertex attributes.
+void quantization_range(const vec3& bounds_min, const vec3& bounds_max, vec3* offset, vec3* scale);
+
+void pack_vertices(PackedVertex* packed, const Vertex* vertices, u32 vertex_count,
+    const vec3& bounds_min, const vec3& bounds_max);
+
+// Largest difference between the original and the unpacked vertices.
+VertexPackError measure_pack_error(const PackedVertex* packed, const Vertex* vertices, u32 vertex_count,
+    const vec3& bounds_min, const vec3& bounds_max);
+
+VertexCacheStats analyze_vertex_cache(const u32* indices, u64 index_count, u32 vertex_count);
+
+} // namespace Themepark
@@ -7,6 +7,8 @@
 #include "logging.h"
 #include "mesh.h"
 #include "image.h"
+#include "meshopt.h"
+#include "dds.h"
 
 #include <glad/glad.h>
 
@@ -14,6 +16,121 @@
 
 namespace Themepark {
 namespace {
+
+// Constant attributes the vertex shaders use to decode positions and
+// normals, set per draw since they are not part of the VAO.
+constexpr GLuint cPositionOffsetAttrib = 3;
+constexpr GLuint cPositionScaleAttrib = 4;
+
+// The instance transform takes one attribute per column, all sourced
+// from a binding point of their own so the VAO keeps its vertex layout
+// while the instance buffer changes per draw.
+constexpr GLuint cInstanceAttrib = 5;
+constexpr GLuint cInstanceBinding = 5;
+
+// Full chain down to 1x1.
+u32 mip_level_count(u32 width, u32 height) {
+  u32 size = width > height ? width : height;
+  u32 levels = 1;
+  while (size > 1) {
+    size >>= 1;
+    levels++;
+  }
+  return levels;
+}
+
+// Client side layout of a loaded Image.
+GLenum image_upload_format(u32 bytes_per_pixel) {
+  switch (bytes_per_pixel) {
+    case 1: return GL_RED;
+    case 3: return GL_BGR;
+    default: return GL_BGRA;
+  }
+}
+
+// Immutable storage for a loaded Image.
+GLenum image_storage_format(u32 bytes_per_pixel) {
+  switch (bytes_per_pixel) {
+    case 1: return GL_R8;
+    case 3: return GL_RGB8;
+    default: return GL_RGBA8;
+  }
+}
+
+// Greyscale images are stored as one channel and read back as grey.
+void set_grey_swizzle(GLenum target) {
+  const GLint swizzle[4] = {GL_RED, GL_RED, GL_RED, GL_ONE};
+  glTexParameteriv(target, GL_TEXTURE_SWIZZLE_RGBA, swizzle);
+}
+
+// LSD radix sort on the 64 bit keys, 8 bits per pass. Passes over a
+// digit every key shares are skipped, which with few programs and
+// textures is most of them.
+template <typename T>
+void radix_sort(T* items, T* scratch, u32 count) {
+  T* src = items;
+  T* dst = scratch;
+  for (u32 shift = 0; shift < 64; shift += 8) {
+    u32 histogram[256] = {};
+    for (u32 i = 0; i < count; ++i) {
+      histogram[(src[i].key >> shift) & 0xFF]++;
+    }
+    if (histogram[(src[0].key >> shift) & 0xFF] == count) {
+      continue;
+    }
+
+    u32 sum = 0;
+    for (u32 b = 0; b < 256; ++b) {
+      const u32 c = histogram[b];
+      histogram[b] = sum;
+      sum += c;
+    }
+    for (u32 i = 0; i < count; ++i) {
+      dst[histogram[(src[i].key >> shift) & 0xFF]++] = src[i];
+    }
+
+    T* tmp = src;
+    src = dst;
+    dst = tmp;
+  }
+
+  if (src != items) {
+    memcpy(items, src, sizeof(T) * count);
+  }
+}
+
+bool is_sampler_type(GLenum type) {
+  return type == GL_SAMPLER_2D || type == GL_SAMPLER_CUBE || type == GL_SAMPLER_2D_ARRAY;
+}
+
+#define STRINGIFY_VALUE(x) #x
+#define STRINGIFY(x) STRINGIFY_VALUE(x)
+constexpr const char* cShaderPrelude =
+    "#define RENDERER_MAX_MATERIALS " STRINGIFY(RENDERER_MAX_MATERIALS) "\n";
+constexpr const char* cShaderPreludeBindless =
+    "#define RENDERER_MAX_MATERIALS " STRINGIFY(RENDERER_MAX_MATERIALS) "\n"
+    "#define RENDERER_BINDLESS 1\n";
+
+u64 uniform_name_hash(const char* name, u64 len) {
+  u64 hash = 0xCBF29CE484222325ULL;
+  for (u64 i = 0; i < len; ++i) {
+    hash = (hash ^ (u8)name[i]) * 0x100000001B3ULL;
+  }
+  return hash;
+}
+
+constexpr GLenum TextureGLTarget(TextureType type) {
+  switch (type) {
+    case TextureType::Cube:
+      return GL_TEXTURE_CUBE_MAP;
+    case TextureType::Array:
+      return GL_TEXTURE_2D_ARRAY;
+    case TextureType::Texture2D:
+    default:
+      return GL_TEXTURE_2D;
+  }
+}
+
 constexpr GLenum ShaderGLType(ShaderType type) {
   switch (type) {
     case ShaderType::Vertex:
@@ -34,34 +151,121 @@ bool Renderer::startup(DynamicAllocator* allocator) {
   ASSERT(allocator != nullptr);
   global_allocator = allocator;
   shader_programs.init(global_allocator, MemoryTag::Renderer);
+  shader_uniforms.init(global_allocator, MemoryTag::Renderer);
   vertex_arrays.init(global_allocator, MemoryTag::Renderer);
-  active_textures.init(global_allocator, MemoryTag::Renderer);
-  return true;
+  cull_spheres.init(global_allocator, MemoryTag::Renderer);
+  cull_visible.init(global_allocator, MemoryTag::Renderer);
+  hierarchy_cache.init(global_allocator, MemoryTag::Renderer);
+  hierarchy_transforms.init(global_allocator, MemoryTag::Renderer);
+  hierarchy_spheres.init(global_allocator, MemoryTag::Renderer);
+  instance_buffers.init(global_allocator, MemoryTag::Renderer);
+  resident_handles.init(global_allocator, MemoryTag::Renderer);
+  queued_draws.init(global_allocator, MemoryTag::Renderer);
+  sort_items.init(global_allocator, MemoryTag::Renderer);
+  sort_scratch.init(global_allocator, MemoryTag::Renderer);
+  staged_uploads.init(global_allocator, MemoryTag::Renderer);
+
+  GLint units = 0;
+  glGetIntegerv(GL_MAX_COMBINED_TEXTURE_IMAGE_UNITS, &units);
+  texture_unit_count = units < RENDERER_MAX_TEXTURE_UNITS ? (u32)units : RENDERER_MAX_TEXTURE_UNITS;
+  ASSERT(texture_unit_count >= RENDERER_COMMAND_TEXTURES);
+
+  bindless = GLAD_GL_ARB_bindless_texture != 0;
+  LOG_INFO("Renderer: materials use %s", bindless ? "bindless textures" : "texture arrays");
+
+  if (GLAD_GL_ARB_texture_filter_anisotropic || GLAD_GL_EXT_texture_filter_anisotropic) {
+    GLfloat driver_max = 1.0F;
+    glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY, &driver_max);
+    max_anisotropy = driver_max < RENDERER_MAX_ANISOTROPY ? driver_max : RENDERER_MAX_ANISOTROPY;
+  }
+  compressed_s3tc = GLAD_GL_EXT_texture_compression_s3tc != 0;
+  LOG_INFO("Renderer: %.0fx anisotropy, S3TC %s", max_anisotropy,
+      compressed_s3tc ? "native" : "decoded on the CPU");
+
+  // TGA rows are tightly packed, 24 bit ones included
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+  // Every patch is a triangle
+  glPatchParameteri(GL_PATCH_VERTICES, 3);
+
+  // Bound for every draw that isn't instanced.
+  mat4 identity = mat4_identity();
+  identity_instance = build_instance_buffer(&identity, 1);
+  return create_uniform_ring() && create_staging_ring();
 }
 
 void Renderer::shutdown() {
+  // Uploads still queued are dropped, their callbacks never run
+  staged_uploads.clear();
+  staged_upload_head = 0;
+  destroy_staging_ring();
+  destroy_uniform_ring();
+  if (instance_buffers.size() > 0) {
+    glDeleteBuffers((GLsizei)instance_buffers.size(), instance_buffers.data());
+  }
+  instance_buffers.clear();
+
+  for (u64 i = 0; i < resident_handles.size(); ++i) {
+    glMakeTextureHandleNonResidentARB(resident_handles[i]);
+  }
+  resident_handles.clear();
+  if (material_buffer != 0) {
+    glDeleteBuffers(1, &material_buffer);
+    material_buffer = 0;
+  }
+  queued_draws.clear();
+  sort_items.clear();
+  sort_scratch.clear();
   shader_programs.clear();
+  shader_uniforms.clear();
   vertex_arrays.clear();
-  active_textures.clear();
+  cull_spheres.clear();
+  cull_visible.clear();
+  hierarchy_cache.clear();
+  hierarchy_transforms.clear();
+  hierarchy_spheres.clear();
 }
 
 u32 Renderer::begin_shader_program() {
   ShaderProgram program;
   memset(&program, 0, sizeof(ShaderProgram));
   program.program_handle = glCreateProgram();
+  for (u32 i = 0; i < RENDERER_COMMAND_TEXTURES; ++i) {
+    program.sampler_locations[i] = -1;
+  }
   shader_programs.push_back(program);
   return shader_programs.size() - 1;
 }
 
-bool Renderer::program_add_shader(u32 program_idx, ShaderType type, const DynArray<i8>* shader_text) {
+bool Renderer::program_add_shader(u32 program_idx, ShaderType type, const DynArray<i8>* shader_text,
+    const char* defines) {
   ASSERT(program_idx >= 0 && program_idx < shader_programs.size());
   ASSERT(shader_text != nullptr && shader_text->size() > 0);
   GLint success = 0;
 
+  // The defines go between the #version line and the rest, #line keeps
+  // the compiler's line numbers matching the file.
+  const GLchar* text = (const GLchar*)shader_text->data();
+  const GLint text_len = shader_text->size();
+  GLint version_len = 0;
+  while (version_len < text_len && text[version_len] != '\n') {
+    version_len++;
+  }
+  if (version_len < text_len) {
+    version_len++;
+  }
+
+  const GLchar* sources[5] = {
+    text,
+    bindless ? cShaderPreludeBindless : cShaderPrelude,
+    defines != nullptr ? defines : "",
+    "#line 2\n",
+    text + version_len,
+  };
+  const GLint lengths[5] = {version_len, -1, -1, -1, text_len - version_len};
+
   const GLuint shader_handle = glCreateShader(ShaderGLType(type));
-  const GLchar* shader_data = (const GLchar*)shader_text->data();
-  const GLint shader_len = shader_text->size();
-  glShaderSource(shader_handle, 1, &shader_data, &shader_len);
+  glShaderSource(shader_handle, 5, sources, lengths);
 
   glCompileShader(shader_handle);
   glGetShaderiv(shader_handle, GL_COMPILE_STATUS, &success);
@@ -113,15 +317,74 @@ u32 Renderer::link_shader_program(u32 program_idx) {
     return 0;
   }
 
+  reflect_uniforms(&program);
   return program.program_handle;
 }
 
+void Renderer::reflect_uniforms(ShaderProgram* program) {
+  GLint active = 0;
+  glGetProgramiv(program->program_handle, GL_ACTIVE_UNIFORMS, &active);
+  program->uniform_first = (u32)shader_uniforms.size();
+  program->uniform_count = 0;
+
+  for (GLint i = 0; i < active; ++i) {
+    ShaderUniform uniform;
+    memset(&uniform, 0, sizeof(ShaderUniform));
+    GLsizei len = 0;
+    GLint size = 0;
+    GLenum type = 0;
+    glGetActiveUniform(program->program_handle, (GLuint)i, MAX_UNIFORM_NAME_LEN, &len, &size, &type, uniform.name);
+
+    // Arrays are reported as name[0], they are looked up by plain name.
+    if (len > 3 && strcmp(&uniform.name[len - 3], "[0]") == 0) {
+      len -= 3;
+      uniform.name[len] = '\0';
+    }
+
+    uniform.location = glGetUniformLocation(program->program_handle, uniform.name);
+    if (uniform.location < 0) {
+      continue; // block members have no location
+    }
+
+    if (is_sampler_type(type)) {
+      // The initial value is the layout(binding) of the sampler
+      GLint binding = 0;
+      glGetUniformiv(program->program_handle, uniform.location, &binding);
+      if (binding >= 0 && binding < RENDERER_COMMAND_TEXTURES) {
+        program->sampler_locations[binding] = uniform.location;
+        program->sampler_units[binding] = binding;
+      }
+    }
+
+    uniform.name_hash = uniform_name_hash(uniform.name, (u64)len);
+    shader_uniforms.push_back(uniform);
+    program->uniform_count++;
+  }
+}
+
 i32 Renderer::shader_uniform_location(u32 handle, const char* uniform_name) {
-  GLint loc = glGetUniformLocation(handle, &uniform_name[0]);
-  auto error = glGetError();
-  ASSERT(error != GL_INVALID_VALUE);
-  ASSERT(error != GL_INVALID_OPERATION);
-  return loc;
+  ASSERT(uniform_name != nullptr);
+  const ShaderProgram* program = nullptr;
+  for (u64 i = 0; i < shader_programs.size(); ++i) {
+    if (shader_programs[i].program_handle == handle) {
+      program = &shader_programs[i];
+      break;
+    }
+  }
+
+  ASSERT(program != nullptr);
+  if (program == nullptr) {
+    return -1;
+  }
+
+  const u64 hash = uniform_name_hash(uniform_name, strlen(uniform_name));
+  for (u32 i = 0; i < program->uniform_count; ++i) {
+    const ShaderUniform& uniform = shader_uniforms[program->uniform_first + i];
+    if (uniform.name_hash == hash && strcmp(uniform.name, uniform_name) == 0) {
+      return uniform.location;
+    }
+  }
+  return -1;
 }
 
 void Renderer::shader_set_uniform(i32 location, const mat4& m) {
@@ -130,6 +393,17 @@ void Renderer::shader_set_uniform(i32 location, const mat4& m) {
 
 void Renderer::shader_set_uniform(i32 location, u32 value) {
   glUniform1i(location, value);
+
+  // Keep the sampler units queued draws rely on in sync
+  if (location < 0 || bound_program == ~0U) {
+    return;
+  }
+  ShaderProgram& program = shader_programs[program_index(bound_program)];
+  for (u32 slot = 0; slot < RENDERER_COMMAND_TEXTURES; ++slot) {
+    if (program.sampler_locations[slot] == location) {
+      program.sampler_units[slot] = (i32)value;
+    }
+  }
 }
 
 void Renderer::shader_set_uniform(i32 location, const vec3* data, u32 count) {
@@ -141,80 +415,327 @@ void Renderer::shader_set_uniform(i32 location, const vec4* data, u32 count) {
 }
 
 u32 Renderer::build_texture_2d(const Image* image) {
+  const u32 texture_id = create_texture_2d(image->width, image->height, image->bytes_per_pixel);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, image->width, image->height,
+      image_upload_format(image->bytes_per_pixel), GL_UNSIGNED_BYTE, image->data);
+  glGenerateMipmap(GL_TEXTURE_2D);
+  bind_upload_texture(GL_TEXTURE_2D, 0);
+  return texture_id;
+}
+
+void Renderer::stream_texture_2d(const Image* image, UploadCallback done, void* data) {
+  const u32 texture_id = create_texture_2d(image->width, image->height, image->bytes_per_pixel);
+  bind_upload_texture(GL_TEXTURE_2D, 0);
+
+  StagedUpload upload = {};
+  upload.type = UploadType::TextureRows;
+  upload.destination = texture_id;
+  upload.source = image->data;
+  upload.size = (u64)image->width * image->height * image->bytes_per_pixel;
+  upload.width = image->width;
+  upload.height = image->height;
+  upload.format = image_upload_format(image->bytes_per_pixel);
+  upload.callback = done;
+  upload.handle = texture_id;
+  upload.callback_data = data;
+  queue_upload(upload);
+}
+
+u32 Renderer::create_texture_2d(u32 width, u32 height, u32 bytes_per_pixel) {
   u32 texture_id = 0;
   glGenTextures(1, &texture_id);
-  glBindTexture(GL_TEXTURE_2D, texture_id);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, image->width, image->height,
-      0, GL_BGR, GL_UNSIGNED_BYTE, image->data);
+  bind_upload_texture(GL_TEXTURE_2D, texture_id);
+  glTexStorage2D(GL_TEXTURE_2D, mip_level_count(width, height), image_storage_format(bytes_per_pixel),
+      width, height);
+  if (bytes_per_pixel == 1) {
+    set_grey_swizzle(GL_TEXTURE_2D);
+  }
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-  glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glBindTexture(GL_TEXTURE_2D, 0);
+  set_texture_filtering(GL_TEXTURE_2D);
   return texture_id;
 }
 
-u32 Renderer::build_texture_cube(const Image* images) {
+u32 Renderer::build_texture_compressed(const CompressedImage* image) {
+  ASSERT(image != nullptr && image->level_count > 0);
+  const bool native = compressed_s3tc;
+  GLenum internal_format = GL_RGBA8;
+  if (native) {
+    switch (image->format) {
+      case TextureFormat::BC1: internal_format = GL_COMPRESSED_RGB_S3TC_DXT1_EXT; break;
+      case TextureFormat::BC3: internal_format = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT; break;
+    }
+  }
+
+  u8* pixels = nullptr;
+  const u64 pixels_size = (u64)image->width * image->height * 4;
+  if (!native) {
+    pixels = (u8*)global_allocator->allocate(pixels_size, MemoryTag::Texture);
+    if (pixels == nullptr) {
+      return 0;
+    }
+  }
+
   u32 texture_id = 0;
   glGenTextures(1, &texture_id);
+  bind_upload_texture(GL_TEXTURE_2D, texture_id);
+  glTexStorage2D(GL_TEXTURE_2D, image->level_count, internal_format, image->width, image->height);
+
+  u32 width = image->width;
+  u32 height = image->height;
+  for (u32 level = 0; level < image->level_count; ++level) {
+    if (native) {
+      glCompressedTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, width, height, internal_format,
+          (GLsizei)image->level_sizes[level], image->levels[level]);
+    } else {
+      bc_decode_level(image->format, image->levels[level], width, height, pixels);
+      glTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+    }
+    width = width > 1 ? width / 2 : 1;
+    height = height > 1 ? height / 2 : 1;
+  }
+
+  // A chain the cooker cut short still samples with mipmaps
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, image->level_count - 1);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  set_texture_filtering(GL_TEXTURE_2D);
+  bind_upload_texture(GL_TEXTURE_2D, 0);
+
+  if (pixels != nullptr) {
+    global_allocator->free(pixels, pixels_size, MemoryTag::Texture);
+  }
+  return texture_id;
+}
 
-  glBindTexture(GL_TEXTURE_CUBE_MAP, texture_id);
-  glTexImage2D(GL_TEXTURE_CUBE_MAP_NEGATIVE_Z, 0, GL_RGB,
-      images[0].width, images[0].height, 0, GL_BGRA, GL_UNSIGNED_BYTE, images[0].data);
+MaterialSet Renderer::build_material_set(const Image* images, u32 count) {
+  ASSERT(count > 0 && count <= RENDERER_MAX_MATERIALS);
+  MaterialSet set = {};
+  for (u32 i = 0; i < count; ++i) {
+    if (images[i].width != images[0].width || images[i].height != images[0].height) {
+      LOG_ERROR("Renderer: material %u doesn't match the size of material 0", i);
+      return set;
+    }
+    // A swizzle would apply to every layer of the array
+    if (images[i].bytes_per_pixel == 1) {
+      LOG_ERROR("Renderer: material %u is greyscale", i);
+      return set;
+    }
+  }
 
-  glBindTexture(GL_TEXTURE_CUBE_MAP, texture_id);
-  glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_Z, 0, GL_RGB,
-      images[1].width, images[1].height, 0, GL_BGRA, GL_UNSIGNED_BYTE, images[1].data);
+  if (bindless) {
+    ASSERT(material_buffer == 0);
 
-  glBindTexture(GL_TEXTURE_CUBE_MAP, texture_id);
-  glTexImage2D(GL_TEXTURE_CUBE_MAP_NEGATIVE_X, 0, GL_RGB,
-      images[2].width, images[2].height, 0, GL_BGRA, GL_UNSIGNED_BYTE, images[2].data);
+    // std140 puts every array element on a 16 byte stride
+    u8 block[RENDERER_MAX_MATERIALS * 16] = {};
+    for (u32 i = 0; i < count; ++i) {
+      const u32 texture = build_texture_2d(&images[i]);
+      u64 handle = glGetTextureHandleARB(texture);
+      glMakeTextureHandleResidentARB(handle);
+      resident_handles.push_back(handle);
+      memcpy(&block[i * 16], &handle, sizeof(u64));
+    }
 
-  glBindTexture(GL_TEXTURE_CUBE_MAP, texture_id);
-  glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X, 0, GL_RGB,
-      images[3].width, images[3].height, 0, GL_BGRA, GL_UNSIGNED_BYTE, images[3].data);
+    glGenBuffers(1, &material_buffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, material_buffer);
+    glBufferStorage(GL_UNIFORM_BUFFER, sizeof(block), block, 0);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    glBindBufferBase(GL_UNIFORM_BUFFER, RENDERER_MATERIAL_BINDING, material_buffer);
 
-  glBindTexture(GL_TEXTURE_CUBE_MAP, texture_id);
-  glTexImage2D(GL_TEXTURE_CUBE_MAP_NEGATIVE_Y, 0, GL_RGB,
-      images[4].width, images[4].height, 0, GL_BGRA, GL_UNSIGNED_BYTE, images[4].data);
+    set.count = count;
+    return set;
+  }
 
-  glBindTexture(GL_TEXTURE_CUBE_MAP, texture_id);
-  glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_Y, 0, GL_RGB,
-      images[5].width, images[5].height, 0, GL_BGRA, GL_UNSIGNED_BYTE, images[5].data);
+  glGenTextures(1, &set.texture);
+  bind_upload_texture(GL_TEXTURE_2D_ARRAY, set.texture);
+  glTexStorage3D(GL_TEXTURE_2D_ARRAY, mip_level_count(images[0].width, images[0].height), GL_RGBA8,
+      images[0].width, images[0].height, count);
+  for (u32 i = 0; i < count; ++i) {
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, i, images[i].width, images[i].height, 1,
+        image_upload_format(images[i].bytes_per_pixel), GL_UNSIGNED_BYTE, images[i].data);
+  }
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+  set_texture_filtering(GL_TEXTURE_2D_ARRAY);
+  bind_upload_texture(GL_TEXTURE_2D_ARRAY, 0);
+
+  set.count = count;
+  return set;
+}
+
+u32 Renderer::build_texture_cube(const Image* images) {
+  // Face order of the images
+  static const GLenum faces[6] = {
+    GL_TEXTURE_CUBE_MAP_NEGATIVE_Z, GL_TEXTURE_CUBE_MAP_POSITIVE_Z,
+    GL_TEXTURE_CUBE_MAP_NEGATIVE_X, GL_TEXTURE_CUBE_MAP_POSITIVE_X,
+    GL_TEXTURE_CUBE_MAP_NEGATIVE_Y, GL_TEXTURE_CUBE_MAP_POSITIVE_Y,
+  };
+
+  u32 texture_id = 0;
+  glGenTextures(1, &texture_id);
+  bind_upload_texture(GL_TEXTURE_CUBE_MAP, texture_id);
+  glTexStorage2D(GL_TEXTURE_CUBE_MAP, mip_level_count(images[0].width, images[0].height),
+      image_storage_format(images[0].bytes_per_pixel), images[0].width, images[0].height);
+  for (u32 face = 0; face < 6; ++face) {
+    ASSERT(images[face].width == images[0].width && images[face].height == images[0].height);
+    glTexSubImage2D(faces[face], 0, 0, 0, images[face].width, images[face].height,
+        image_upload_format(images[face].bytes_per_pixel), GL_UNSIGNED_BYTE, images[face].data);
+  }
 
   glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
   glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
   glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-  glTexParameterf(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glTexParameterf(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  if (images[0].bytes_per_pixel == 1) {
+    set_grey_swizzle(GL_TEXTURE_CUBE_MAP);
+  }
+  glGenerateMipmap(GL_TEXTURE_CUBE_MAP);
+  set_texture_filtering(GL_TEXTURE_CUBE_MAP);
 
-  glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+  bind_upload_texture(GL_TEXTURE_CUBE_MAP, 0);
   return texture_id;
 }
 
 u32 Renderer::build_vertex_array(const Mesh* mesh) {
-  VertexArray va = {0};
-  
   // Per vertex data
-  glGenBuffers(1, &va.vbo);
-  glBindBuffer(GL_ARRAY_BUFFER, va.vbo);
+  u32 vbo = 0;
+  glGenBuffers(1, &vbo);
+  glBindBuffer(GL_ARRAY_BUFFER, vbo);
   glBufferData(GL_ARRAY_BUFFER,
-      mesh->vertices.size() * sizeof(Vertex), 
-      mesh->vertices.data(), GL_STATIC_DRAW);
+      (u64)mesh->vertex_count() * mesh->vertex_stride(), 
+      mesh->vertex_data(), GL_STATIC_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+  // Index data, 16 bit whenever the vertex count allows it. Cached
+  // meshes are already narrowed and upload straight from the mapping.
+  u32 ebo = 0;
+  GLenum index_type = GL_UNSIGNED_SHORT;
+  const u64 index_count = mesh->index_count();
+  if (index_count > 0) {
+    glGenBuffers(1, &ebo);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, ebo);
+
+    // Without memory for the narrow copy the indices stay 32 bit
+    u16* narrow = nullptr;
+    if (mesh->index_size() != sizeof(u16) && mesh->vertex_count() <= U16_MAX + 1) {
+      narrow = (u16*)global_allocator->allocate(sizeof(u16) * index_count, MemoryTag::Renderer);
+    }
+
+    if (mesh->index_size() == sizeof(u16)) {
+      glBufferData(GL_COPY_WRITE_BUFFER, index_count * sizeof(u16), mesh->index_data(), GL_STATIC_DRAW);
+    } else if (narrow != nullptr) {
+      const u32* wide = (const u32*)mesh->index_data();
+      for (u64 i = 0; i < index_count; ++i) {
+        narrow[i] = (u16)wide[i];
+      }
+      glBufferData(GL_COPY_WRITE_BUFFER, index_count * sizeof(u16), narrow, GL_STATIC_DRAW);
+      global_allocator->free(narrow, sizeof(u16) * index_count, MemoryTag::Renderer);
+    } else {
+      glBufferData(GL_COPY_WRITE_BUFFER, index_count * sizeof(u32), mesh->index_data(), GL_STATIC_DRAW);
+      index_type = GL_UNSIGNED_INT;
+    }
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+  }
+
+  return add_vertex_array(mesh, vbo, ebo, index_type);
+}
+
+void Renderer::stream_vertex_array(const Mesh* mesh, UploadCallback done, void* data) {
+  // Storage only, filled by copies out of the staging ring
+  const u64 vertex_size = (u64)mesh->vertex_count() * mesh->vertex_stride();
+  u32 vbo = 0;
+  glGenBuffers(1, &vbo);
+  glBindBuffer(GL_ARRAY_BUFFER, vbo);
+  glBufferStorage(GL_ARRAY_BUFFER, vertex_size, nullptr, 0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+  u32 ebo = 0;
+  GLenum index_type = GL_UNSIGNED_SHORT;
+  const u64 index_count = mesh->index_count();
+  const bool narrow = mesh->index_size() == sizeof(u32) && mesh->vertex_count() <= U16_MAX + 1;
+  if (index_count > 0) {
+    index_type = mesh->index_size() == sizeof(u16) || narrow ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+    glGenBuffers(1, &ebo);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, ebo);
+    glBufferStorage(GL_COPY_WRITE_BUFFER,
+        index_count * (index_type == GL_UNSIGNED_SHORT ? sizeof(u16) : sizeof(u32)), nullptr, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+  }
+
+  const u32 idx = add_vertex_array(mesh, vbo, ebo, index_type);
+
+  StagedUpload upload = {};
+  upload.type = UploadType::BufferBytes;
+  upload.destination = vbo;
+  upload.source = (const u8*)mesh->vertex_data();
+  upload.size = vertex_size;
+  upload.handle = idx;
+  if (index_count > 0) {
+    queue_upload(upload);
+    upload.destination = ebo;
+    upload.source = (const u8*)mesh->index_data();
+    upload.size = index_count * mesh->index_size();
+    upload.narrow = narrow;
+  }
+  upload.callback = done;
+  upload.callback_data = data;
+  queue_upload(upload);
+}
+
+u32 Renderer::add_vertex_array(const Mesh* mesh, u32 vbo, u32 ebo, u32 index_type) {
+  VertexArray va = {0};
+  va.vbo = vbo;
+  va.ebo = ebo;
+  va.index_type = index_type;
+  va.element_count = ebo != 0 ? mesh->index_count() : mesh->vertex_count();
 
+  glBindBuffer(GL_ARRAY_BUFFER, vbo);
   glGenVertexArrays(1, &va.vao);
   glBindVertexArray(va.vao);
   glEnableVertexAttribArray(0);
-  glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, position));
   glEnableVertexAttribArray(1);
-  glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, normal)); 
   glEnableVertexAttribArray(2);
-  glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, uv));  
+
+  for (GLuint i = 0; i < 4; ++i) {
+    glEnableVertexAttribArray(cInstanceAttrib + i);
+    glVertexAttribFormat(cInstanceAttrib + i, 4, GL_FLOAT, GL_FALSE, sizeof(vec4) * i);
+    glVertexAttribBinding(cInstanceAttrib + i, cInstanceBinding);
+  }
+  glVertexBindingDivisor(cInstanceBinding, 1);
+
+  if (mesh->vertex_format() == VertexFormat::Packed) {
+    const GLsizei stride = sizeof(PackedVertex);
+    glVertexAttribPointer(0, 3, GL_SHORT, GL_TRUE, stride, (void*)offsetof(PackedVertex, position));
+    glVertexAttribPointer(1, 2, GL_SHORT, GL_TRUE, stride, (void*)offsetof(PackedVertex, normal));
+    glVertexAttribPointer(2, 2, GL_HALF_FLOAT, GL_FALSE, stride, (void*)offsetof(PackedVertex, uv));
+
+    vec3 offset;
+    vec3 scale;
+    quantization_range(mesh->bounds_min, mesh->bounds_max, &offset, &scale);
+    va.position_offset = vec4(offset.x, offset.y, offset.z, 0.0F);
+    va.position_scale = vec4(scale.x, scale.y, scale.z, 1.0F);
+  } else {
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, position));
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, normal)); 
+    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, uv));  
+
+    va.position_offset = vec4(0.0F, 0.0F, 0.0F, 0.0F);
+    va.position_scale = vec4(1.0F, 1.0F, 1.0F, 0.0F);
+  }
+
+  if (ebo != 0) {
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+  }
   
   glBindVertexArray(0);
   glBindBuffer(GL_ARRAY_BUFFER, 0);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+  bound_vertex_array = 0;
 
-  va.element_count = (u32)mesh->vertices.size();
+  va.instance_buffer = ~0U;
+  va.bounds_min = mesh->bounds_min;
+  va.bounds_max = mesh->bounds_max;
+  va.bounding_sphere = mesh->bounding_sphere;
   vertex_arrays.push_back(va);
   return (u32)(vertex_arrays.size() - 1);
 }
@@ -254,103 +775,662 @@ void Renderer::enable_wireframe_mode(bool enable) {
 }
   
 void Renderer::begin_frame() {
+  // The region about to be rewritten was last used RENDERER_RING_FRAMES
+  // frames ago, this only blocks when the GPU is that far behind.
+  GLsync fence = (GLsync)uniform_ring_fences[uniform_ring_frame];
+  if (fence != nullptr) {
+    GLenum status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+    while (status == GL_TIMEOUT_EXPIRED) {
+      status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+    }
+    glDeleteSync(fence);
+    uniform_ring_fences[uniform_ring_frame] = nullptr;
+  }
+  uniform_ring_offset = 0;
+  process_uploads();
+
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 }
 
 void Renderer::end_frame() {
-  active_textures.reset();
-  active_texture_units = 0;
+  execute_draws();
+  last_stats = stats;
+  stats = {};
+
+  uniform_ring_fences[uniform_ring_frame] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  uniform_ring_frame = (uniform_ring_frame + 1) % RENDERER_RING_FRAMES;
 }
 
 void Renderer::use_shader_program(u32 program_handle) {
+  if (bound_program == program_handle) {
+    stats.skipped_changes++;
+    return;
+  }
   glUseProgram(program_handle);
+  bound_program = program_handle;
+  stats.state_changes++;
 }
 
 u32 Renderer::use_texture_2d(u32 texture_handle) {
-  ActiveTexture at{active_texture_units, texture_handle};
-  glActiveTexture(GL_TEXTURE0 + at.texture_unit);
-  glBindTexture(GL_TEXTURE_2D, at.texture_id);
-  active_textures.push_back(at);
-  active_texture_units++;
-  return at.texture_unit;
+  return use_texture(GL_TEXTURE_2D, texture_handle);
 }
 
 u32 Renderer::use_texture_cube(u32 texture_handle) {
-  ActiveTexture at{active_texture_units, texture_handle};
-  glActiveTexture(GL_TEXTURE0 + at.texture_unit);
-  glBindTexture(GL_TEXTURE_CUBE_MAP, at.texture_id);
-  active_textures.push_back(at);
-  active_texture_units++;
-  return at.texture_unit;
+  return use_texture(GL_TEXTURE_CUBE_MAP, texture_handle);
+}
+
+InstanceRange Renderer::build_instance_buffer(const mat4* transforms, u32 count) {
+  InstanceRange range = {};
+  glGenBuffers(1, &range.buffer);
+  glBindBuffer(GL_ARRAY_BUFFER, range.buffer);
+  glBufferStorage(GL_ARRAY_BUFFER, (u64)count * sizeof(mat4), transforms, 0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+  range.count = count;
+  instance_buffers.push_back(range.buffer);
+  return range;
+}
+
+InstanceRange Renderer::push_instances(const mat4* transforms, u32 count) {
+  InstanceRange range = {};
+  u8* memory = ring_allocate((u64)count * sizeof(mat4), &range.offset);
+  if (memory != nullptr) {
+    memcpy(memory, transforms, (u64)count * sizeof(mat4));
+    range.buffer = uniform_ring;
+    range.count = count;
+  }
+  return range;
+}
+
+void Renderer::set_frame_block(const FrameBlock& block) {
+  frame_view = block.view;
+  push_uniform_block(RENDERER_FRAME_BINDING, &block, sizeof(FrameBlock));
+}
+
+void Renderer::set_model_transform(const mat4& model) {
+  DrawBlock block{model, 0, {}};
+  bound_draw_block = push_uniform_block(RENDERER_DRAW_BINDING, &block, sizeof(DrawBlock));
+}
+
+bool Renderer::create_uniform_ring() {
+  GLint alignment = 0;
+  glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+  uniform_ring_alignment = alignment > 0 ? (u32)alignment : 256;
+
+  const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+  const u64 size = (u64)RENDERER_RING_FRAME_SIZE * RENDERER_RING_FRAMES;
+  glGenBuffers(1, &uniform_ring);
+  glBindBuffer(GL_UNIFORM_BUFFER, uniform_ring);
+  glBufferStorage(GL_UNIFORM_BUFFER, size, nullptr, flags);
+  uniform_ring_memory = (u8*)glMapBufferRange(GL_UNIFORM_BUFFER, 0, size, flags);
+  glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+  if (uniform_ring_memory == nullptr) {
+    LOG_ERROR("Renderer: failed to map the uniform ring buffer!");
+    return false;
+  }
+
+  uniform_ring_offset = 0;
+  uniform_ring_frame = 0;
+  return true;
+}
+
+void Renderer::destroy_uniform_ring() {
+  for (u32 i = 0; i < RENDERER_RING_FRAMES; ++i) {
+    if (uniform_ring_fences[i] != nullptr) {
+      glDeleteSync((GLsync)uniform_ring_fences[i]);
+      uniform_ring_fences[i] = nullptr;
+    }
+  }
+
+  if (uniform_ring != 0) {
+    glBindBuffer(GL_UNIFORM_BUFFER, uniform_ring);
+    glUnmapBuffer(GL_UNIFORM_BUFFER);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    glDeleteBuffers(1, &uniform_ring);
+  }
+  uniform_ring = 0;
+  uniform_ring_memory = nullptr;
+}
+
+u8* Renderer::ring_allocate(u64 size, u64* offset) {
+  ASSERT(uniform_ring_memory != nullptr);
+  const u64 aligned = (uniform_ring_offset + uniform_ring_alignment - 1) & ~(u64)(uniform_ring_alignment - 1);
+  if (aligned + size > RENDERER_RING_FRAME_SIZE) {
+    if (!uniform_ring_full) {
+      LOG_ERROR("Renderer: uniform ring full, raise RENDERER_RING_FRAME_SIZE");
+      uniform_ring_full = true;
+    }
+    return nullptr;
+  }
+
+  *offset = (u64)uniform_ring_frame * RENDERER_RING_FRAME_SIZE + aligned;
+  uniform_ring_offset = aligned + size;
+  return uniform_ring_memory + *offset;
+}
+
+bool Renderer::create_staging_ring() {
+  const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+  const u64 size = (u64)RENDERER_STAGING_FRAME_SIZE * RENDERER_RING_FRAMES;
+  glGenBuffers(1, &staging_ring);
+  glBindBuffer(GL_COPY_READ_BUFFER, staging_ring);
+  glBufferStorage(GL_COPY_READ_BUFFER, size, nullptr, flags);
+  staging_ring_memory = (u8*)glMapBufferRange(GL_COPY_READ_BUFFER, 0, size, flags);
+  glBindBuffer(GL_COPY_READ_BUFFER, 0);
+
+  if (staging_ring_memory == nullptr) {
+    LOG_ERROR("Renderer: failed to map the staging ring buffer!");
+    return false;
+  }
+  return true;
+}
+
+void Renderer::destroy_staging_ring() {
+  if (staging_ring != 0) {
+    glBindBuffer(GL_COPY_READ_BUFFER, staging_ring);
+    glUnmapBuffer(GL_COPY_READ_BUFFER);
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glDeleteBuffers(1, &staging_ring);
+  }
+  staging_ring = 0;
+  staging_ring_memory = nullptr;
+}
+
+void Renderer::queue_upload(const StagedUpload& upload) {
+  ASSERT(upload.size > 0);
+  StagedUpload copy = upload;
+  staged_uploads.push_back(copy);
+}
+
+// Stages whole rows or runs of bytes into this frame's region until it
+// is full, the copies out of it are ordered before the frame's fence.
+void Renderer::process_uploads() {
+  if (staged_upload_head == staged_uploads.size()) {
+    return;
+  }
+
+  const u64 region = (u64)uniform_ring_frame * RENDERER_STAGING_FRAME_SIZE;
+  const u64 first = staged_upload_head;
+  u64 offset = 0;
+  glBindBuffer(GL_COPY_READ_BUFFER, staging_ring);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging_ring);
+
+  while (staged_upload_head < staged_uploads.size()) {
+    StagedUpload& upload = staged_uploads[staged_upload_head];
+    const u64 space = RENDERER_STAGING_FRAME_SIZE - offset;
+    u8* staging = staging_ring_memory + region + offset;
+    u64 consumed = 0;
+    u64 staged = 0;
+
+    if (upload.type == UploadType::TextureRows) {
+      const u64 row_size = upload.size / upload.height;
+      ASSERT(row_size <= RENDERER_STAGING_FRAME_SIZE);
+      const u64 first_row = upload.done / row_size;
+      u64 rows = space / row_size;
+      rows = rows < upload.height - first_row ? rows : upload.height - first_row;
+      if (rows == 0) {
+        break;
+      }
+
+      consumed = staged = rows * row_size;
+      memcpy(staging, upload.source + upload.done, staged);
+      bind_upload_texture(GL_TEXTURE_2D, upload.destination);
+      glTexSubImage2D(GL_TEXTURE_2D, 0, 0, (GLint)first_row, upload.width, (GLsizei)rows,
+          upload.format, GL_UNSIGNED_BYTE, (void*)(region + offset));
+      if (upload.done + consumed == upload.size) {
+        glGenerateMipmap(GL_TEXTURE_2D);
+      }
+    } else {
+      u64 destination_offset = upload.done;
+      if (upload.narrow) {
+        const u64 count = (upload.size - upload.done) / sizeof(u32);
+        const u64 fit = space / sizeof(u16);
+        const u64 n = count < fit ? count : fit;
+        const u32* wide = (const u32*)(upload.source + upload.done);
+        u16* narrow = (u16*)staging;
+        for (u64 i = 0; i < n; ++i) {
+          narrow[i] = (u16)wide[i];
+        }
+        consumed = n * sizeof(u32);
+        staged = n * sizeof(u16);
+        destination_offset = upload.done / 2;
+      } else {
+        const u64 remaining = upload.size - upload.done;
+        consumed = staged = remaining < space ? remaining : space;
+        memcpy(staging, upload.source + upload.done, staged);
+      }
+      if (staged == 0) {
+        break;
+      }
+
+      glBindBuffer(GL_COPY_WRITE_BUFFER, upload.destination);
+      glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, region + offset, destination_offset, staged);
+    }
+
+    upload.done += consumed;
+    stats.uploaded_bytes += staged;
+    offset = (offset + staged + 15) & ~15ULL;
+
+    if (upload.done == upload.size) {
+      staged_upload_head++;
+    }
+    if (offset >= RENDERER_STAGING_FRAME_SIZE) {
+      break;
+    }
+  }
+
+  glBindBuffer(GL_COPY_READ_BUFFER, 0);
+  glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  bind_upload_texture(GL_TEXTURE_2D, 0);
+
+  // Run with the staging ring unbound, they may upload or queue more
+  const u64 last = staged_upload_head;
+  for (u64 i = first; i < last; ++i) {
+    if (staged_uploads[i].callback != nullptr) {
+      staged_uploads[i].callback(staged_uploads[i].handle, staged_uploads[i].callback_data);
+    }
+  }
+
+  if (staged_upload_head == staged_uploads.size()) {
+    staged_uploads.reset();
+    staged_upload_head = 0;
+  }
+}
+
+u64 Renderer::push_uniform_block(u32 binding, const void* data, u64 size) {
+  u64 offset = 0;
+  u8* memory = ring_allocate(size, &offset);
+  if (memory == nullptr) {
+    return U64_MAX;
+  }
+  memcpy(memory, data, size);
+  glBindBufferRange(GL_UNIFORM_BUFFER, binding, uniform_ring, offset, size);
+  return offset;
+}
+
+void Renderer::bind_vertex_array(VertexArray& va, const InstanceRange& instances) {
+  if (bound_vertex_array != va.vao) {
+    glBindVertexArray(va.vao);
+    glVertexAttrib4fv(cPositionOffsetAttrib, &va.position_offset.x);
+    glVertexAttrib4fv(cPositionScaleAttrib, &va.position_scale.x);
+    bound_vertex_array = va.vao;
+    stats.state_changes++;
+  } else {
+    stats.skipped_changes++;
+  }
+
+  // The instance binding is VAO state
+  if (va.instance_buffer != instances.buffer || va.instance_offset != instances.offset) {
+    glBindVertexBuffer(cInstanceBinding, instances.buffer, instances.offset, sizeof(mat4));
+    va.instance_buffer = instances.buffer;
+    va.instance_offset = instances.offset;
+  }
+}
+
+void Renderer::set_texture_filtering(u32 target) {
+  glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+  if (max_anisotropy > 1.0F) {
+    glTexParameterf(target, GL_TEXTURE_MAX_ANISOTROPY, max_anisotropy);
+  }
+}
+
+// Builds and uploads bind on whatever unit is active, bypassing
+// use_texture, so that unit's cached binding is dropped with every bind.
+void Renderer::bind_upload_texture(u32 target, u32 texture_handle) {
+  glBindTexture(target, texture_handle);
+  texture_units[active_texture_unit] = {};
+}
+
+u32 Renderer::use_texture(u32 target, u32 texture_handle) {
+  texture_clock++;
+
+  // Few enough units that a linear scan beats any lookup structure
+  u32 victim = 0;
+  for (u32 unit = 0; unit < texture_unit_count; ++unit) {
+    TextureUnit& tu = texture_units[unit];
+    if (tu.texture == texture_handle && tu.target == target) {
+      tu.last_use = texture_clock;
+      stats.skipped_changes++;
+      return unit;
+    }
+    if (tu.last_use < texture_units[victim].last_use) {
+      victim = unit;
+    }
+  }
+
+  TextureUnit& tu = texture_units[victim];
+  glActiveTexture(GL_TEXTURE0 + victim);
+  active_texture_unit = victim;
+  if (tu.texture != 0 && tu.target != target) {
+    // Only one target per unit is tracked, the old texture would
+    // otherwise stay bound behind the new one.
+    glBindTexture(tu.target, 0);
+  }
+  glBindTexture(target, texture_handle);
+  tu.texture = texture_handle;
+  tu.target = target;
+  tu.last_use = texture_clock;
+  stats.state_changes++;
+  return victim;
 }
 
 void Renderer::draw_vertex_array(u32 idx) {
   ASSERT(idx < vertex_arrays.size());
-  VertexArray va = vertex_arrays[idx];
-  glBindVertexArray(va.vao);
-  glDrawArrays(GL_TRIANGLES, 0, va.element_count);
-  glBindVertexArray(0);
+  VertexArray& va = vertex_arrays[idx];
+  bind_vertex_array(va, identity_instance);
+  if (va.ebo != 0) {
+    glDrawElements(GL_TRIANGLES, va.element_count, va.index_type, nullptr);
+  } else {
+    glDrawArrays(GL_TRIANGLES, 0, va.element_count);
+  }
+  stats.draws++;
 }
 
-void Renderer::draw_vertex_array_instanced(u32 idx, u32 instances) {
+void Renderer::draw_vertex_array_instanced(u32 idx, const InstanceRange& instances) {
   ASSERT(idx < vertex_arrays.size());
-  VertexArray va = vertex_arrays[idx];
-  glBindVertexArray(va.vao);
-  glDrawArraysInstanced(GL_TRIANGLES, 0, va.element_count, instances);
-  glBindVertexArray(0);
+  if (instances.count == 0) {
+    return;
+  }
+  VertexArray& va = vertex_arrays[idx];
+  bind_vertex_array(va, instances);
+  if (va.ebo != 0) {
+    glDrawElementsInstanced(GL_TRIANGLES, va.element_count, va.index_type, nullptr, instances.count);
+  } else {
+    glDrawArraysInstanced(GL_TRIANGLES, 0, va.element_count, instances.count);
+  }
+  stats.draws++;
 }
 
 void Renderer::draw_vertex_array_triangle_patches(u32 idx) {
   ASSERT(idx < vertex_arrays.size());
-  VertexArray va = vertex_arrays[idx];
-  glBindVertexArray(va.vao);
-  glPatchParameteri(GL_PATCH_VERTICES, 3);
-  glDrawArrays(GL_PATCHES, 0, va.element_count);
-  glBindVertexArray(0);
+  VertexArray& va = vertex_arrays[idx];
+  bind_vertex_array(va, identity_instance);
+  if (va.ebo != 0) {
+    glDrawElements(GL_PATCHES, va.element_count, va.index_type, nullptr);
+  } else {
+    glDrawArrays(GL_PATCHES, 0, va.element_count);
+  }
+  stats.draws++;
 }
 
-void Renderer::draw_vertex_array_triangle_patches_instanced(u32 idx, u32 instances) {
+void Renderer::draw_vertex_array_triangle_patches_instanced(u32 idx, const InstanceRange& instances) {
   ASSERT(idx < vertex_arrays.size());
-  VertexArray va = vertex_arrays[idx];
-  glBindVertexArray(va.vao);
-  glPatchParameteri(GL_PATCH_VERTICES, 3);
-  glDrawArraysInstanced(GL_PATCHES, 0, va.element_count, instances);
-  glBindVertexArray(0);
+  if (instances.count == 0) {
+    return;
+  }
+  VertexArray& va = vertex_arrays[idx];
+  bind_vertex_array(va, instances);
+  if (va.ebo != 0) {
+    glDrawElementsInstanced(GL_PATCHES, va.element_count, va.index_type, nullptr, instances.count);
+  } else {
+    glDrawArraysInstanced(GL_PATCHES, 0, va.element_count, instances.count);
+  }
+  stats.draws++;
 }
 
-void Renderer::draw_hierarchical(const HierarchicalModel* model) {
-  i32 transform_uniform = shader_uniform_location(model->shader_program, "model");
-  i32 instance_uniform = shader_uniform_location(model->shader_program, "instance_position");
-  mat4 identity = mat4_identity();
-  draw_hierarchical_impl(model->hierarchy, identity, transform_uniform, instance_uniform, 0);
+void Renderer::set_cull_frustum(const Frustum* frustum) {
+  culling = frustum != nullptr;
+  if (culling) {
+    cull_frustum = *frustum;
+  }
 }
 
-void Renderer::draw_hierarchical_impl(
-    const DynArray<ModelNode>& nodes,
-    const mat4& parent_transform,
-    i32 transform_uniform,
-    i32 instance_uniform,
-    u32 current_node_idx) {
+void Renderer::queue_draw(const DrawCommand& command, const mat4& model) {
+  if (culling && command.pass != RenderPass::Background && command.instances.count == 0) {
+    ASSERT(command.vertex_array < vertex_arrays.size());
+    const VertexArray& va = vertex_arrays[command.vertex_array];
+    vec3 bounds_min;
+    vec3 bounds_max;
+    transform_box(va.bounds_min, va.bounds_max, model, &bounds_min, &bounds_max);
+    if (!frustum_test_box(cull_frustum, bounds_min, bounds_max)) {
+      stats.culled++;
+      return;
+    }
+    stats.visible++;
+  }
 
-  static const vec3 zero{};
+  QueuedDraw draw;
+  draw.command = command;
+  u8* memory = ring_allocate(sizeof(DrawBlock), &draw.draw_block_offset);
+  if (memory == nullptr) {
+    return;
+  }
+  DrawBlock block{model, command.material, {}};
+  memcpy(memory, &block, sizeof(DrawBlock));
+
+  draw.program_idx = program_index(command.program);
+  SortItem item{sort_key(command, draw.program_idx, model), (u32)queued_draws.size()};
+  queued_draws.push_back(draw);
+  sort_items.push_back(item);
+  sort_scratch.push_back(item);
+}
+
+// Instance spheres are the mesh sphere in model space moved by each
+// instance transform, matching instance * model in the shaders.
+void Renderer::queue_instances(const DrawCommand& command, const mat4& model,
+    const mat4* transforms, u32 count) {
+  cull_spheres.reset();
+  if (culling) {
+    ASSERT(command.vertex_array < vertex_arrays.size());
+    const vec4 sphere = transform_sphere(vertex_arrays[command.vertex_array].bounding_sphere, model);
+    for (u32 i = 0; i < count; ++i) {
+      vec4 instance_sphere = transform_sphere(sphere, transforms[i]);
+      cull_spheres.push_back(instance_sphere);
+    }
+  }
+  queue_culled_instances(command, model, transforms, cull_spheres.data(), count);
+}
 
-  const ModelNode& node = nodes[current_node_idx];
-  mat4 transform = node.rotation * node.translation * parent_transform;
-  shader_set_uniform(transform_uniform, transform);
-  if (node.instances > 1) {
-    shader_set_uniform(instance_uniform, node.instance_positions, node.instances);
-    draw_vertex_array_instanced(node.vertex_array_idx, node.instances);
+void Renderer::queue_culled_instances(const DrawCommand& command, const mat4& model,
+    const mat4* transforms, const vec4* spheres, u32 count) {
+  DrawCommand instanced = command;
+  instanced.instances = {};
+
+  u32 visible = count;
+  if (culling) {
+    cull_visible.reset();
+    for (u32 i = 0; i < count; ++i) {
+      cull_visible.push_back(i);
+    }
+    visible = frustum_cull_spheres(cull_frustum, spheres, count, cull_visible.data());
+    stats.visible += visible;
+    stats.culled += count - visible;
+  }
+  if (visible == 0) {
+    return;
+  }
+
+  u8* memory = ring_allocate((u64)visible * sizeof(mat4), &instanced.instances.offset);
+  if (memory == nullptr) {
+    return;
+  }
+  if (visible == count) {
+    memcpy(memory, transforms, (u64)count * sizeof(mat4));
   } else {
-    shader_set_uniform(instance_uniform, &zero, 1);
-    draw_vertex_array(node.vertex_array_idx);
+    mat4* out = (mat4*)memory;
+    const u32* indices = cull_visible.data();
+    for (u32 i = 0; i < visible; ++i) {
+      out[i] = transforms[indices[i]];
+    }
   }
+  instanced.instances.buffer = uniform_ring;
+  instanced.instances.count = visible;
+  queue_draw(instanced, model);
+}
+
+void Renderer::queue_hierarchical(const HierarchicalModel* model, const DrawCommand& command) {
+  const u32 count = model->node_count();
+  const u32 placements = model->placement_count();
+  const mat4 identity = mat4_identity();
+  for (u32 i = 0; i < count; ++i) {
+    DrawCommand node_command = command;
+    node_command.vertex_array = model->vertex_arrays[i];
+    node_command.instances = {};
+
+    const mat4* worlds = model->node_world_transforms(i);
+    const u32 instances = model->instance_counts[i] > 1 ? model->instance_counts[i] : 1;
+    if (placements == 1 && instances == 1) {
+      queue_draw(node_command, worlds[0]);
+      continue;
+    }
+
+    // Every placement of the node goes out in one instanced draw, the
+    // world transforms become the instance transforms and the model
+    // matrix is left as identity. Instance positions are offsets
+    // applied after the node transform. Static nodes reuse what was
+    // built for them last time.
+    const u32 total = placements * instances;
+    HierarchyNodeCache* cache = hierarchy_node_cache(model, i, total);
+    mat4* transforms = &hierarchy_transforms[cache->first];
+    vec4* spheres = &hierarchy_spheres[cache->first];
+    if (cache->version != model->world_versions[i]) {
+      const vec3* positions = model->instance_positions[i];
+      for (u32 p = 0; p < placements; ++p) {
+        for (u32 j = 0; j < instances; ++j) {
+          transforms[p * instances + j] = instances == 1 ? worlds[p]
+              : worlds[p] * mat4_translate(positions[j].x, positions[j].y, positions[j].z);
+        }
+      }
+      ASSERT(node_command.vertex_array < vertex_arrays.size());
+      const vec4 sphere = vertex_arrays[node_command.vertex_array].bounding_sphere;
+      for (u32 k = 0; k < total; ++k) {
+        spheres[k] = transform_sphere(sphere, transforms[k]);
+      }
+      cache->version = model->world_versions[i];
+    }
+    queue_culled_instances(node_command, identity, transforms, spheres, total);
+  }
+}
 
-  for (i8 i = 0; i < node.child_count; ++i) {
-    draw_hierarchical_impl(nodes, transform,
-        transform_uniform,
-        instance_uniform,
-        node.child_idx[i]);
+// Entries are found by model and node. One whose instance count changed
+// drops the whole cache, which only happens when placements are added.
+Renderer::HierarchyNodeCache* Renderer::hierarchy_node_cache(const HierarchicalModel* model, u32 node,
+    u32 count) {
+  for (u64 i = 0; i < hierarchy_cache.size(); ++i) {
+    HierarchyNodeCache& cache = hierarchy_cache[i];
+    if (cache.model == model && cache.node == node) {
+      if (cache.count == count) {
+        return &cache;
+      }
+      hierarchy_cache.reset();
+      hierarchy_transforms.reset();
+      hierarchy_spheres.reset();
+      break;
+    }
   }
+
+  HierarchyNodeCache cache = {model, node, count, hierarchy_transforms.size(), U64_MAX};
+  mat4 transform = mat4_identity();
+  vec4 sphere;
+  for (u32 i = 0; i < count; ++i) {
+    hierarchy_transforms.push_back(transform);
+    hierarchy_spheres.push_back(sphere);
+  }
+  hierarchy_cache.push_back(cache);
+  return &hierarchy_cache[hierarchy_cache.size() - 1];
+}
+
+u32 Renderer::program_index(u32 program_handle) const {
+  for (u64 i = 0; i < shader_programs.size(); ++i) {
+    if (shader_programs[i].program_handle == program_handle) {
+      return (u32)i;
+    }
+  }
+  ASSERT(false);
+  return 0;
+}
+
+// pass:4 | program:8 | textures:16 | vertex array:12 | depth:24, so state
+// changes are grouped by cost and draws within a group run front to back.
+u64 Renderer::sort_key(const DrawCommand& command, u32 program_idx, const mat4& model) const {
+  const u64 program = program_idx;
+
+  const u64 textures = (command.textures[0] ^ (command.textures[1] << 8)) & 0xFFFF;
+
+  // View space depth of the model origin, the camera looks down -z
+  const f32* v = frame_view.m;
+  const f32* t = &model.m[12];
+  f32 depth = -(t[0] * v[2] + t[1] * v[6] + t[2] * v[10] + v[14]);
+  depth = depth < 0.0F ? 0.0F : (depth > RENDERER_SORT_DEPTH_RANGE ? RENDERER_SORT_DEPTH_RANGE : depth);
+  const u64 depth_bits = (u64)(depth * (f32(0xFFFFFF) / RENDERER_SORT_DEPTH_RANGE));
+
+  return ((u64)command.pass << 60) |
+      ((program & 0xFF) << 52) |
+      (textures << 36) |
+      (((u64)command.vertex_array & 0xFFF) << 24) |
+      depth_bits;
+}
+
+void Renderer::execute_draws() {
+  const u32 count = (u32)queued_draws.size();
+  if (count == 0) {
+    return;
+  }
+  radix_sort(sort_items.data(), sort_scratch.data(), count);
+
+  u32 pass = ~0U;
+  for (u32 i = 0; i < count; ++i) {
+    const QueuedDraw& draw = queued_draws[sort_items[i].index];
+    const DrawCommand& command = draw.command;
+    ASSERT(command.vertex_array < vertex_arrays.size());
+
+    if ((u32)command.pass != pass) {
+      pass = (u32)command.pass;
+      glDepthMask(command.pass == RenderPass::Background ? GL_FALSE : GL_TRUE);
+      stats.state_changes++;
+    }
+
+    use_shader_program(command.program);
+
+    // Point the program's samplers at wherever the textures ended up
+    ShaderProgram& program = shader_programs[draw.program_idx];
+    const u32 target = TextureGLTarget(command.texture_type);
+    for (u32 slot = 0; slot < RENDERER_COMMAND_TEXTURES; ++slot) {
+      if (command.textures[slot] == 0 || program.sampler_locations[slot] < 0) {
+        continue;
+      }
+      const i32 unit = (i32)use_texture(target, command.textures[slot]);
+      if (program.sampler_units[slot] != unit) {
+        glUniform1i(program.sampler_locations[slot], unit);
+        program.sampler_units[slot] = unit;
+        stats.state_changes++;
+      } else {
+        stats.skipped_changes++;
+      }
+    }
+
+    if (bound_draw_block != draw.draw_block_offset) {
+      glBindBufferRange(GL_UNIFORM_BUFFER, RENDERER_DRAW_BINDING, uniform_ring,
+          draw.draw_block_offset, sizeof(DrawBlock));
+      bound_draw_block = draw.draw_block_offset;
+      stats.state_changes++;
+    } else {
+      stats.skipped_changes++;
+    }
+
+    VertexArray& va = vertex_arrays[command.vertex_array];
+    const bool instanced = command.instances.count > 0;
+    bind_vertex_array(va, instanced ? command.instances : identity_instance);
+
+    const GLenum mode = command.primitive == DrawPrimitive::Patches ? GL_PATCHES : GL_TRIANGLES;
+    const u32 instances = instanced ? command.instances.count : 1;
+    if (va.ebo != 0) {
+      glDrawElementsInstanced(mode, va.element_count, va.index_type, nullptr, instances);
+    } else {
+      glDrawArraysInstanced(mode, 0, va.element_count, instances);
+    }
+    stats.draws++;
+  }
+
+  if (pass != (u32)RenderPass::Opaque) {
+    glDepthMask(GL_TRUE);
+  }
+
+  queued_draws.reset();
+  sort_items.reset();
+  sort_scratch.reset();
 }
 
 } // namespace Themepark
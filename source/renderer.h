@@ -9,11 +9,105 @@
 #include "dynarray.h"
 #include "mat4.h"
 #include "hierarchical.h"
+#include "culling.h"
+
+#define MAX_UNIFORM_NAME_LEN 64
+#define RENDERER_FRAME_BINDING 0     // FrameBlock
+#define RENDERER_DRAW_BINDING 1      // DrawBlock
+#define RENDERER_MATERIAL_BINDING 2  // bindless material handles
+#define RENDERER_MAX_MATERIALS 64    // also defined for every shader
+#define RENDERER_RING_FRAMES 3       // frames the GPU may lag behind
+#define RENDERER_RING_FRAME_SIZE MiB(1)  // uniform blocks and per frame instances
+#define RENDERER_COMMAND_TEXTURES 2  // slot i feeds the sampler with binding = i
+#define RENDERER_MAX_TEXTURE_UNITS 32
+#define RENDERER_SORT_DEPTH_RANGE 1000.0F // view distance covered by the sort key
+#define RENDERER_MAX_ANISOTROPY 8.0F  // clamped to what the driver supports
+#define RENDERER_STAGING_FRAME_SIZE MiB(4) // streamed upload bytes per frame
 
 namespace Themepark {
 
 class Mesh;
 class Image;
+struct CompressedImage;
+
+// std140 layout of the FrameBlock uniform block shared by all programs.
+struct FrameBlock {
+  mat4 view;
+  mat4 projection;
+  mat4 sky_view;     // view without the translation
+  mat4 view_inverse;
+};
+
+// std140 layout of the per draw DrawBlock uniform block.
+struct DrawBlock {
+  mat4 model;
+  u32 material; // base material, instances add their own offset
+  u32 padding[3];
+};
+
+// Per instance model transforms, fed to attributes 5-8 with a divisor
+// of one. Either owned by the renderer or a range of this frame's ring.
+struct InstanceRange {
+  u32 buffer;
+  u32 count;
+  u64 offset;
+};
+
+// Instance transforms are affine, the otherwise zero m[3] carries a
+// material offset for shaders using materials.
+inline void instance_set_material(mat4* transform, u32 material) {
+  transform->m[3] = (f32)material;
+}
+
+// Same sized textures addressed by index. With bindless textures every
+// material is a resident handle and texture is 0, otherwise texture is
+// a 2D array with one layer per material, bound like any other texture.
+struct MaterialSet {
+  u32 texture;
+  u32 count;
+};
+
+enum class TextureType : u32 {
+  Texture2D = 0,
+  Cube,
+  Array,
+};
+
+enum class RenderPass : u32 {
+  Background = 0, // no depth writes
+  Opaque,
+};
+
+enum class DrawPrimitive : u32 {
+  Triangles = 0,
+  Patches,
+};
+
+// A queued draw. Executed in sort key order at end_frame, the model
+// transform is captured when the command is queued.
+struct DrawCommand {
+  RenderPass pass;
+  DrawPrimitive primitive;
+  u32 program;                             // program handle
+  u32 vertex_array;
+  u32 textures[RENDERER_COMMAND_TEXTURES]; // 0 leaves the slot unused
+  TextureType texture_type;
+  u32 material;                            // base material index
+  InstanceRange instances;                 // count 0 draws once
+};
+
+struct RenderStats {
+  u32 draws;
+  u32 state_changes;
+  u32 skipped_changes; // binds the state cache found redundant
+  u64 uploaded_bytes;  // through the staging ring
+  u32 visible;         // draws and instances that passed frustum culling
+  u32 culled;
+};
+
+// handle is the texture handle or vertex array index of the finished
+// upload.
+typedef void (*UploadCallback)(u32 handle, void* data);
 
 enum class ShaderType {
   Vertex = 0,
@@ -32,12 +126,31 @@ public:
   void shutdown();
 
   u32 begin_shader_program(); // returns index
-  bool program_add_shader(u32 program_idx, ShaderType type, const DynArray<i8>* shader_text);
+  // defines are inserted after the #version line, along with the
+  // renderer's own (RENDERER_MAX_MATERIALS, RENDERER_BINDLESS).
+  bool program_add_shader(u32 program_idx, ShaderType type, const DynArray<i8>* shader_text,
+      const char* defines = nullptr);
   u32 link_shader_program(u32 program_idx); // returns handle
 
   u32 build_vertex_array(const Mesh* mesh);
   u32 build_texture_2d(const Image* image);
   u32 build_texture_cube(const Image* images);
+  // BC levels go up as they are when the driver can sample them, BC1
+  // and BC3 are otherwise decoded on the CPU and uploaded as RGBA8.
+  u32 build_texture_compressed(const CompressedImage* image);
+  // One material set at a time, the bindless handles live at
+  // RENDERER_MATERIAL_BINDING.
+  MaterialSet build_material_set(const Image* images, u32 count);
+  bool bindless_textures() const { return bindless; }
+
+  // Streamed uploads are copied through the staging ring over the
+  // frames that follow, at most RENDERER_STAGING_FRAME_SIZE bytes a
+  // frame. The source has to stay valid until done runs from
+  // begin_frame, the texture or vertex array is usable from then on.
+  void stream_texture_2d(const Image* image, UploadCallback done, void* data);
+  void stream_vertex_array(const Mesh* mesh, UploadCallback done, void* data);
+  u64 uploads_pending() const { return staged_uploads.size() - staged_upload_head; }
+  InstanceRange build_instance_buffer(const mat4* transforms, u32 count);
 
   void delete_textures();
 
@@ -50,12 +163,41 @@ public:
   void enable_wireframe_mode(bool enable);
 
   void begin_frame();
-  void end_frame();
+  void end_frame(); // executes the queued draws
+
+  // Draws without instances are culled against the frustum, as are
+  // the instances given to queue_instances and queue_hierarchical.
+  // Instance buffers built ahead of time and the background pass are
+  // always drawn.
+  void set_cull_frustum(const Frustum* frustum); // nullptr stops culling
+  void queue_draw(const DrawCommand& command, const mat4& model);
+  // Copies the visible instances into the ring and draws them with
+  // command, any instances already in command are replaced.
+  void queue_instances(const DrawCommand& command, const mat4& model, const mat4* transforms, u32 count);
+  // One command per node, vertex_array is taken from the nodes and the
+  // transforms from the model's last update(). A node is drawn once for
+  // all of the model's placements. Instance transforms and bounds are
+  // cached per node and only rebuilt when the node's world version moves.
+  void queue_hierarchical(const HierarchicalModel* model, const DrawCommand& command);
+  const RenderStats& frame_stats() const { return last_stats; }
+
+  // Both write into the persistently mapped ring and bind the range,
+  // valid until the next call of the same kind.
+  void set_frame_block(const FrameBlock& block);
+  void set_model_transform(const mat4& model);
+  // Valid until the end of the frame. Returns an empty range when the
+  // ring is full.
+  InstanceRange push_instances(const mat4* transforms, u32 count);
 
   void use_shader_program(u32 program_handle);
-  u32 use_texture_2d(u32 texture_handle); // returns texture unit
-  u32 use_texture_cube(u32 texture_handle); // returns texture unit
+  // Returns the unit the texture is bound to. Units keep their texture
+  // across draws and frames, the least recently used one is rebound
+  // when the texture isn't resident.
+  u32 use_texture_2d(u32 texture_handle);
+  u32 use_texture_cube(u32 texture_handle);
 
+  // Looks the name up in the table reflected at link time, no GL call.
+  // Returns -1 for names the program doesn't use.
   i32 shader_uniform_location(u32 handle, const char* uniform_name);
   void shader_set_uniform(i32 location, const mat4& m);
   void shader_set_uniform(i32 location, u32 value);
@@ -63,42 +205,166 @@ public:
   void shader_set_uniform(i32 location, const vec4* data, u32 count);
 
   void draw_vertex_array(u32 idx);
-  void draw_vertex_array_instanced(u32 idx, u32 instances);
+  void draw_vertex_array_instanced(u32 idx, const InstanceRange& instances);
   void draw_vertex_array_triangle_patches(u32 idx);
-  void draw_vertex_array_triangle_patches_instanced(u32 idx, u32 instances);
-  void draw_hierarchical(const HierarchicalModel* model);
-
-protected:
-  void draw_hierarchical_impl(
-      const DynArray<ModelNode>& nodes,
-      const mat4& parent_transform,
-      i32 transform_uniform,
-      i32 instance_uniform,
-      u32 current_node_idx);
+  void draw_vertex_array_triangle_patches_instanced(u32 idx, const InstanceRange& instances);
 
 protected:
   struct VertexArray {
     u32 vao;
     u32 vbo;
-    u32 element_count;
+    u32 ebo;           // 0 when drawn without indices
+    u32 index_type;
+    u32 element_count; // index count when indexed
+    vec4 position_offset;
+    vec4 position_scale; // w is 1 for octahedral normals
+    u32 instance_buffer; // currently bound at the instance binding
+    u64 instance_offset;
+    vec3 bounds_min;     // of the source mesh
+    vec3 bounds_max;
+    vec4 bounding_sphere;
+  };
+
+  enum class UploadType : u32 {
+    TextureRows = 0, // level 0 of a 2D texture
+    BufferBytes,
+  };
+
+  struct StagedUpload {
+    UploadType type;
+    u32 destination;   // texture or buffer handle
+    const u8* source;
+    u64 size;          // source bytes
+    u64 done;          // source bytes staged so far
+    u32 width;
+    u32 height;
+    u32 format;        // GL client format of the rows
+    bool narrow;       // u32 indices staged as u16
+    UploadCallback callback; // runs once the last byte is staged
+    u32 handle;
+    void* callback_data;
+  };
+
+  struct QueuedDraw {
+    DrawCommand command;
+    u32 program_idx;
+    u64 draw_block_offset; // into the ring
+  };
+
+  struct SortItem {
+    u64 key;
+    u32 index;
+  };
+
+  // Instance transforms and world spheres of one hierarchy node, at
+  // first in hierarchy_transforms and hierarchy_spheres.
+  struct HierarchyNodeCache {
+    const HierarchicalModel* model;
+    u32 node;
+    u32 count;
+    u64 first;
+    u64 version; // world version the entries were built from
   };
 
-  struct ActiveTexture {
-    u32 texture_unit;
-    u32 texture_id;
+  struct TextureUnit {
+    u32 texture;
+    u32 target;
+    u64 last_use;
   };
 
   struct ShaderProgram {
     u32 program_handle;
     u32 shader_handles[6];
     u32 shader_count;
+    u32 uniform_first; // into shader_uniforms
+    u32 uniform_count;
+    // Samplers by their layout(binding), and the unit each one is set to
+    i32 sampler_locations[RENDERER_COMMAND_TEXTURES];
+    i32 sampler_units[RENDERER_COMMAND_TEXTURES];
   };
 
-  u32 active_texture_units = 0;
+  struct ShaderUniform {
+    u64 name_hash;
+    i32 location;
+    char name[MAX_UNIFORM_NAME_LEN];
+  };
+
+  void bind_vertex_array(VertexArray& va, const InstanceRange& instances);
+  u32 use_texture(u32 target, u32 texture_handle);
+  void bind_upload_texture(u32 target, u32 texture_handle); // keeps texture_units honest
+  u32 create_texture_2d(u32 width, u32 height, u32 bytes_per_pixel); // left bound
+  u32 add_vertex_array(const Mesh* mesh, u32 vbo, u32 ebo, u32 index_type);
+  void queue_upload(const StagedUpload& upload);
+  void process_uploads();
+  void set_texture_filtering(u32 target);
+  u32 program_index(u32 program_handle) const;
+  u64 sort_key(const DrawCommand& command, u32 program_idx, const mat4& model) const;
+  void execute_draws();
+  void reflect_uniforms(ShaderProgram* program);
+  bool create_uniform_ring();
+  void destroy_uniform_ring();
+  bool create_staging_ring();
+  void destroy_staging_ring();
+  u8* ring_allocate(u64 size, u64* offset);
+  u64 push_uniform_block(u32 binding, const void* data, u64 size); // returns the ring offset
+  // spheres are the instance bounds, used when culling
+  void queue_culled_instances(const DrawCommand& command, const mat4& model, const mat4* transforms,
+      const vec4* spheres, u32 count);
+  HierarchyNodeCache* hierarchy_node_cache(const HierarchicalModel* model, u32 node, u32 count);
+
   DynArray<ShaderProgram> shader_programs;
+  DynArray<ShaderUniform> shader_uniforms;
   DynArray<VertexArray> vertex_arrays;
-  DynArray<ActiveTexture> active_textures;
+  DynArray<u32> instance_buffers;
+  InstanceRange identity_instance = {};
+
+  DynArray<QueuedDraw> queued_draws;
+  DynArray<SortItem> sort_items;
+  DynArray<SortItem> sort_scratch;
+  mat4 frame_view = {};
+
+  Frustum cull_frustum = {};
+  bool culling = false;
+  DynArray<vec4> cull_spheres;
+  DynArray<u32> cull_visible;
+  DynArray<HierarchyNodeCache> hierarchy_cache;
+  DynArray<mat4> hierarchy_transforms;
+  DynArray<vec4> hierarchy_spheres;
+
+  // State cache, ~0 is unknown
+  u32 bound_program = ~0U;
+  u32 bound_vertex_array = ~0U;
+  u64 bound_draw_block = ~0ULL;
+  RenderStats stats = {};
+  RenderStats last_stats = {};
+
+  TextureUnit texture_units[RENDERER_MAX_TEXTURE_UNITS] = {};
+  u32 texture_unit_count = 0;
+  u32 active_texture_unit = 0;
+  u64 texture_clock = 0;
+
+  f32 max_anisotropy = 1.0F;
+  bool compressed_s3tc = false;
+
+  bool bindless = false;
+  u32 material_buffer = 0;
+  DynArray<u64> resident_handles;
   DynamicAllocator* global_allocator = nullptr;
+
+  u32 uniform_ring = 0;
+  u8* uniform_ring_memory = nullptr;
+  u64 uniform_ring_offset = 0;
+  u32 uniform_ring_frame = 0;
+  u32 uniform_ring_alignment = 0;
+  bool uniform_ring_full = false;
+  void* uniform_ring_fences[RENDERER_RING_FRAMES] = {};
+
+  // Written in regions of RENDERER_STAGING_FRAME_SIZE, one per ring
+  // frame and reused under the uniform ring's fences.
+  u32 staging_ring = 0;
+  u8* staging_ring_memory = nullptr;
+  DynArray<StagedUpload> staged_uploads;
+  u64 staged_upload_head = 0;
 };
 
 } // namespace Themepark
@@ -0,0 +1,817 @@
+// spatial.cpp
+// Kostya Leshenko
+// CS447P
+// Themepark
+
+#include "spatial.h"
+#include "logging.h"
+#include "system.h"
+
+namespace Themepark {
+
+namespace {
+
+constexpr u32 cGridMaxCellsPerAxis = 1024;
+constexpr u32 cCullChunk = 64; // spheres handed to frustum_cull_spheres at once
+
+f32 sphere_axis(const vec4& sphere, u32 axis) {
+  return ((const f32*)&sphere)[axis];
+}
+
+void grow_bounds(vec3* bounds_min, vec3* bounds_max, const vec4& s) {
+  bounds_min->set(fminf(bounds_min->x, s.x - s.w), fminf(bounds_min->y, s.y - s.w),
+      fminf(bounds_min->z, s.z - s.w));
+  bounds_max->set(fmaxf(bounds_max->x, s.x + s.w), fmaxf(bounds_max->y, s.y + s.w),
+      fmaxf(bounds_max->z, s.z + s.w));
+}
+
+bool sphere_overlaps_box(const vec4& s, const vec3& bounds_min, const vec3& bounds_max) {
+  const f32 dx = fmaxf(fmaxf(bounds_min.x - s.x, s.x - bounds_max.x), 0.0F);
+  const f32 dy = fmaxf(fmaxf(bounds_min.y - s.y, s.y - bounds_max.y), 0.0F);
+  const f32 dz = fmaxf(fmaxf(bounds_min.z - s.z, s.z - bounds_max.z), 0.0F);
+  return dx * dx + dy * dy + dz * dz <= s.w * s.w;
+}
+
+bool spheres_overlap(const vec4& a, const vec4& b) {
+  const vec3 d(a.x - b.x, a.y - b.y, a.z - b.z);
+  const f32 r = a.w + b.w;
+  return dot(d, d) <= r * r;
+}
+
+// direction is unit length. A ray starting inside the sphere hits at 0.
+bool ray_hits_sphere(const vec3& origin, const vec3& direction, const vec4& s, f32* t) {
+  const vec3 oc(origin.x - s.x, origin.y - s.y, origin.z - s.z);
+  const f32 b = dot(oc, direction);
+  const f32 c = dot(oc, oc) - s.w * s.w;
+  if (c > 0.0F && b > 0.0F) {
+    return false;
+  }
+  const f32 discriminant = b * b - c;
+  if (discriminant < 0.0F) {
+    return false;
+  }
+  *t = fmaxf(-b - sqrtf(discriminant), 0.0F);
+  return true;
+}
+
+// Slab test, inverse_direction may hold infinities for axis aligned
+// rays. On a hit [t_enter, t_exit] is the part of the ray in the box.
+bool ray_clip_box(const vec3& origin, const vec3& inverse_direction, const vec3& bounds_min,
+    const vec3& bounds_max, f32 max_distance, f32* t_enter, f32* t_exit) {
+  f32 t_min = 0.0F;
+  f32 t_max = max_distance;
+  const f32* o = &origin.x;
+  const f32* inv = &inverse_direction.x;
+  const f32* lo = &bounds_min.x;
+  const f32* hi = &bounds_max.x;
+  for (u32 axis = 0; axis < 3; ++axis) {
+    f32 t0 = (lo[axis] - o[axis]) * inv[axis];
+    f32 t1 = (hi[axis] - o[axis]) * inv[axis];
+    if (t0 > t1) {
+      const f32 t = t0;
+      t0 = t1;
+      t1 = t;
+    }
+    t_min = t0 > t_min ? t0 : t_min;
+    t_max = t1 < t_max ? t1 : t_max;
+    if (t_min > t_max) {
+      return false;
+    }
+  }
+  *t_enter = t_min;
+  *t_exit = t_max;
+  return true;
+}
+
+bool ray_hits_box(const vec3& origin, const vec3& inverse_direction, const vec3& bounds_min,
+    const vec3& bounds_max, f32 max_distance) {
+  f32 t_enter;
+  f32 t_exit;
+  return ray_clip_box(origin, inverse_direction, bounds_min, bounds_max, max_distance, &t_enter, &t_exit);
+}
+
+// normalized() goes through rsqrt, which is too coarse for distances
+// along the ray.
+vec3 unit_direction(const vec3& direction) {
+  const f32 length = sqrtf(dot(direction, direction));
+  return vec3(direction.x / length, direction.y / length, direction.z / length);
+}
+
+vec3 inverse(const vec3& direction) {
+  return vec3(1.0F / direction.x, 1.0F / direction.y, 1.0F / direction.z);
+}
+
+// Partial quickselect, afterwards items[k] is where a sort by centre on
+// axis would put it with nothing greater before it and nothing smaller
+// after it.
+void select_nth(u32* items, i32 count, i32 k, const vec4* spheres, u32 axis) {
+  i32 lo = 0;
+  i32 hi = count - 1;
+  while (lo < hi) {
+    const f32 pivot = sphere_axis(spheres[items[(lo + hi) / 2]], axis);
+    i32 i = lo;
+    i32 j = hi;
+    while (i <= j) {
+      while (sphere_axis(spheres[items[i]], axis) < pivot) {
+        i++;
+      }
+      while (sphere_axis(spheres[items[j]], axis) > pivot) {
+        j--;
+      }
+      if (i <= j) {
+        const u32 item = items[i];
+        items[i] = items[j];
+        items[j] = item;
+        i++;
+        j--;
+      }
+    }
+    if (k <= j) {
+      hi = j;
+    } else if (k >= i) {
+      lo = i;
+    } else {
+      return;
+    }
+  }
+}
+
+} // namespace
+
+bool SpatialGrid::init(DynamicAllocator* allocator) {
+  ASSERT(allocator != nullptr);
+  spheres.init(allocator, MemoryTag::Mesh);
+  ids.init(allocator, MemoryTag::Mesh);
+  cell_starts.init(allocator, MemoryTag::Mesh);
+  cell_mins.init(allocator, MemoryTag::Mesh);
+  cell_maxs.init(allocator, MemoryTag::Mesh);
+  return true;
+}
+
+void SpatialGrid::cleanup() {
+  spheres.clear();
+  ids.clear();
+  cell_starts.clear();
+  cell_mins.clear();
+  cell_maxs.clear();
+  cells_x = 0;
+  cells_z = 0;
+}
+
+u32 SpatialGrid::cell_of(f32 x, f32 z) const {
+  const f32 fx = fminf(fmaxf((x - origin.x) / cell_size, 0.0F), f32(cells_x - 1));
+  const f32 fz = fminf(fmaxf((z - origin.z) / cell_size, 0.0F), f32(cells_z - 1));
+  return (u32)fz * cells_x + (u32)fx;
+}
+
+// A counting sort by cell, cell_starts doubles as the scatter cursor.
+void SpatialGrid::build(const vec4* objects, u32 count, f32 size) {
+  ASSERT(size > 0.0F);
+  spheres.reset();
+  ids.reset();
+  cell_starts.reset();
+  cell_mins.reset();
+  cell_maxs.reset();
+  cells_x = 0;
+  cells_z = 0;
+  max_radius = 0.0F;
+  bounds_min.set(FLT_MAX, FLT_MAX, FLT_MAX);
+  bounds_max.set(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+  if (count == 0) {
+    return;
+  }
+
+  f32 min_x = objects[0].x;
+  f32 max_x = objects[0].x;
+  f32 min_z = objects[0].z;
+  f32 max_z = objects[0].z;
+  for (u32 i = 0; i < count; ++i) {
+    min_x = fminf(min_x, objects[i].x);
+    max_x = fmaxf(max_x, objects[i].x);
+    min_z = fminf(min_z, objects[i].z);
+    max_z = fmaxf(max_z, objects[i].z);
+    max_radius = fmaxf(max_radius, objects[i].w);
+    grow_bounds(&bounds_min, &bounds_max, objects[i]);
+  }
+
+  const f32 extent = fmaxf(max_x - min_x, max_z - min_z);
+  cell_size = fmaxf(size, extent / f32(cGridMaxCellsPerAxis - 1));
+  origin.set(min_x, 0.0F, min_z);
+  cells_x = (u32)((max_x - min_x) / cell_size) + 1;
+  cells_z = (u32)((max_z - min_z) / cell_size) + 1;
+  const u32 cell_count = cells_x * cells_z;
+
+  u32 zero = 0;
+  vec3 empty_min(FLT_MAX, FLT_MAX, FLT_MAX);
+  vec3 empty_max(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+  for (u32 i = 0; i <= cell_count; ++i) {
+    cell_starts.push_back(zero);
+  }
+  for (u32 i = 0; i < cell_count; ++i) {
+    cell_mins.push_back(empty_min);
+    cell_maxs.push_back(empty_max);
+  }
+
+  for (u32 i = 0; i < count; ++i) {
+    const u32 cell = cell_of(objects[i].x, objects[i].z);
+    cell_starts[cell + 1]++;
+    grow_bounds(&cell_mins[cell], &cell_maxs[cell], objects[i]);
+  }
+  for (u32 i = 0; i < cell_count; ++i) {
+    cell_starts[i + 1] += cell_starts[i];
+  }
+
+  vec4 unset;
+  for (u32 i = 0; i < count; ++i) {
+    spheres.push_back(unset);
+    ids.push_back(zero);
+  }
+  for (u32 i = 0; i < count; ++i) {
+    const u32 slot = cell_starts[cell_of(objects[i].x, objects[i].z)]++;
+    spheres[slot] = objects[i];
+    ids[slot] = i;
+  }
+  for (u32 i = cell_count; i > 0; --i) {
+    cell_starts[i] = cell_starts[i - 1];
+  }
+  cell_starts[0] = 0;
+}
+
+void SpatialGrid::query_frustum(const Frustum& frustum, DynArray<u32>* result) const {
+  ASSERT(result != nullptr);
+  u32 visible[cCullChunk];
+  const u32 cell_count = cells_x * cells_z;
+  for (u32 cell = 0; cell < cell_count; ++cell) {
+    const u32 first = cell_starts[cell];
+    const u32 end = cell_starts[cell + 1];
+    if (first == end || !frustum_test_box(frustum, cell_mins[cell], cell_maxs[cell])) {
+      continue;
+    }
+    for (u32 i = first; i < end; i += cCullChunk) {
+      const u32 chunk = end - i < cCullChunk ? end - i : cCullChunk;
+      const u32 count = frustum_cull_spheres(frustum, &spheres[i], chunk, visible);
+      for (u32 j = 0; j < count; ++j) {
+        u32 id = ids[i + visible[j]];
+        result->push_back(id);
+      }
+    }
+  }
+}
+
+// Objects are bucketed by centre, so cells up to max_radius past the
+// query can still hold an overlapping sphere.
+void SpatialGrid::query_sphere(const vec4& sphere, DynArray<u32>* result) const {
+  ASSERT(result != nullptr);
+  if (cells_x == 0) {
+    return;
+  }
+  const f32 reach = sphere.w + max_radius;
+  const u32 lo = cell_of(sphere.x - reach, sphere.z - reach);
+  const u32 hi = cell_of(sphere.x + reach, sphere.z + reach);
+  for (u32 z = lo / cells_x; z <= hi / cells_x; ++z) {
+    for (u32 x = lo % cells_x; x <= hi % cells_x; ++x) {
+      const u32 cell = z * cells_x + x;
+      const u32 first = cell_starts[cell];
+      const u32 end = cell_starts[cell + 1];
+      if (first == end || !sphere_overlaps_box(sphere, cell_mins[cell], cell_maxs[cell])) {
+        continue;
+      }
+      for (u32 i = first; i < end; ++i) {
+        if (spheres_overlap(sphere, spheres[i])) {
+          u32 id = ids[i];
+          result->push_back(id);
+        }
+      }
+    }
+  }
+}
+
+// Only cells under the part of the ray inside the grid's bounds are
+// visited, widened by max_radius for spheres hanging out of their cell.
+u32 SpatialGrid::query_ray(const vec3& ray_origin, const vec3& direction, f32 max_distance,
+    f32* distance) const {
+  const vec3 dir = unit_direction(direction);
+  const vec3 inv = inverse(dir);
+  f32 t_enter;
+  f32 t_exit;
+  if (cells_x == 0 || !ray_clip_box(ray_origin, inv, bounds_min, bounds_max, max_distance, &t_enter, &t_exit)) {
+    return SPATIAL_NONE;
+  }
+
+  const f32 x0 = ray_origin.x + dir.x * t_enter;
+  const f32 x1 = ray_origin.x + dir.x * t_exit;
+  const f32 z0 = ray_origin.z + dir.z * t_enter;
+  const f32 z1 = ray_origin.z + dir.z * t_exit;
+  const u32 lo = cell_of(fminf(x0, x1) - max_radius, fminf(z0, z1) - max_radius);
+  const u32 hi = cell_of(fmaxf(x0, x1) + max_radius, fmaxf(z0, z1) + max_radius);
+
+  f32 nearest = max_distance;
+  u32 hit = SPATIAL_NONE;
+  for (u32 z = lo / cells_x; z <= hi / cells_x; ++z) {
+    for (u32 x = lo % cells_x; x <= hi % cells_x; ++x) {
+      const u32 cell = z * cells_x + x;
+      const u32 first = cell_starts[cell];
+      const u32 end = cell_starts[cell + 1];
+      if (first == end || !ray_hits_box(ray_origin, inv, cell_mins[cell], cell_maxs[cell], nearest)) {
+        continue;
+      }
+      for (u32 i = first; i < end; ++i) {
+        f32 t;
+        if (ray_hits_sphere(ray_origin, dir, spheres[i], &t) && t < nearest) {
+          nearest = t;
+          hit = ids[i];
+        }
+      }
+    }
+  }
+  if (hit != SPATIAL_NONE && distance != nullptr) {
+    *distance = nearest;
+  }
+  return hit;
+}
+
+bool SpatialBVH::init(DynamicAllocator* allocator) {
+  ASSERT(allocator != nullptr);
+  nodes.init(allocator, MemoryTag::Mesh);
+  parents.init(allocator, MemoryTag::Mesh);
+  objects.init(allocator, MemoryTag::Mesh);
+  object_leaves.init(allocator, MemoryTag::Mesh);
+  spheres.init(allocator, MemoryTag::Mesh);
+  return true;
+}
+
+void SpatialBVH::cleanup() {
+  nodes.clear();
+  parents.clear();
+  objects.clear();
+  object_leaves.clear();
+  spheres.clear();
+  total_area = 0.0F;
+  built_area = 0.0F;
+}
+
+void SpatialBVH::build(const vec4* bounds, u32 count) {
+  spheres.reset();
+  for (u32 i = 0; i < count; ++i) {
+    vec4 sphere = bounds[i];
+    spheres.push_back(sphere);
+  }
+  rebuild();
+}
+
+void SpatialBVH::rebuild() {
+  const u32 count = (u32)spheres.size();
+  nodes.reset();
+  parents.reset();
+  objects.reset();
+  object_leaves.reset();
+  total_area = 0.0F;
+  built_area = 0.0F;
+  if (count == 0) {
+    return;
+  }
+
+  u32 leaf = 0;
+  for (u32 i = 0; i < count; ++i) {
+    objects.push_back(i);
+    object_leaves.push_back(leaf);
+  }
+
+  Node root = {};
+  u32 no_parent = SPATIAL_NONE;
+  nodes.push_back(root);
+  parents.push_back(no_parent);
+  build_node(0, 0, count);
+
+  for (u64 i = 0; i < nodes.size(); ++i) {
+    total_area += node_area((u32)i);
+  }
+  built_area = total_area;
+}
+
+// Median split of the centres along the widest axis. Children are
+// allocated in pairs so their indices are only known once the parent's
+// range is split.
+void SpatialBVH::build_node(u32 node, u32 first, u32 count) {
+  nodes[node].first = first;
+  nodes[node].count = count;
+  if (count <= SPATIAL_BVH_LEAF_SIZE) {
+    fit_node(node);
+    for (u32 i = first; i < first + count; ++i) {
+      object_leaves[objects[i]] = node;
+    }
+    return;
+  }
+
+  vec3 centre_min(FLT_MAX, FLT_MAX, FLT_MAX);
+  vec3 centre_max(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+  for (u32 i = first; i < first + count; ++i) {
+    vec4 centre = spheres[objects[i]];
+    centre.w = 0.0F;
+    grow_bounds(&centre_min, &centre_max, centre);
+  }
+  const vec3 size = centre_max - centre_min;
+  const u32 axis = size.x >= size.y && size.x >= size.z ? 0 : (size.y >= size.z ? 1 : 2);
+  const u32 half = count / 2;
+  select_nth(&objects[first], (i32)count, (i32)half, spheres.data(), axis);
+
+  const u32 left = (u32)nodes.size();
+  Node child = {};
+  nodes.push_back(child);
+  nodes.push_back(child);
+  parents.push_back(node);
+  parents.push_back(node);
+  nodes[node].first = left;
+  nodes[node].count = 0;
+
+  build_node(left, first, half);
+  build_node(left + 1, first + half, count - half);
+  fit_node(node);
+}
+
+// Bounds of the objects in a leaf, or of the children of an inner node.
+void SpatialBVH::fit_node(u32 node) {
+  Node& n = nodes[node];
+  vec3 bounds_min(FLT_MAX, FLT_MAX, FLT_MAX);
+  vec3 bounds_max(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+  if (n.count > 0) {
+    for (u32 i = n.first; i < n.first + n.count; ++i) {
+      grow_bounds(&bounds_min, &bounds_max, spheres[objects[i]]);
+    }
+  } else {
+    for (u32 c = n.first; c < n.first + 2; ++c) {
+      const Node& child = nodes[c];
+      bounds_min.set(fminf(bounds_min.x, child.bounds_min.x), fminf(bounds_min.y, child.bounds_min.y),
+          fminf(bounds_min.z, child.bounds_min.z));
+      bounds_max.set(fmaxf(bounds_max.x, child.bounds_max.x), fmaxf(bounds_max.y, child.bounds_max.y),
+          fmaxf(bounds_max.z, child.bounds_max.z));
+    }
+  }
+  n.bounds_min = bounds_min;
+  n.bounds_max = bounds_max;
+}
+
+f32 SpatialBVH::node_area(u32 node) const {
+  const vec3 d = nodes[node].bounds_max - nodes[node].bounds_min;
+  return 2.0F * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+// Refits from the leaf up and stops at the first node whose bounds
+// didn't change.
+void SpatialBVH::set_sphere(u32 object, const vec4& sphere) {
+  ASSERT(object < object_count());
+  spheres[object] = sphere;
+  u32 node = object_leaves[object];
+  while (node != SPATIAL_NONE) {
+    const Node before = nodes[node];
+    const f32 area = node_area(node);
+    fit_node(node);
+    if (memcmp(&before, &nodes[node], sizeof(Node)) == 0) {
+      break;
+    }
+    total_area += node_area(node) - area;
+    node = parents[node];
+  }
+}
+
+bool SpatialBVH::rebuild_if_degraded() {
+  if (total_area <= built_area * SPATIAL_BVH_REBUILD_GROWTH) {
+    return false;
+  }
+  rebuild();
+  return true;
+}
+
+// Leaves gather their spheres for one SIMD step.
+void SpatialBVH::query_frustum(const Frustum& frustum, DynArray<u32>* result) const {
+  ASSERT(result != nullptr);
+  if (nodes.size() == 0) {
+    return;
+  }
+  u32 stack[SPATIAL_BVH_MAX_DEPTH];
+  u32 top = 0;
+  stack[top++] = 0;
+  while (top > 0) {
+    const Node& n = nodes[stack[--top]];
+    if (!frustum_test_box(frustum, n.bounds_min, n.bounds_max)) {
+      continue;
+    }
+    if (n.count == 0) {
+      ASSERT(top + 2 <= SPATIAL_BVH_MAX_DEPTH);
+      stack[top++] = n.first;
+      stack[top++] = n.first + 1;
+      continue;
+    }
+
+    vec4 leaf_spheres[SPATIAL_BVH_LEAF_SIZE];
+    u32 visible[SPATIAL_BVH_LEAF_SIZE];
+    for (u32 i = 0; i < n.count; ++i) {
+      leaf_spheres[i] = spheres[objects[n.first + i]];
+    }
+    const u32 count = frustum_cull_spheres(frustum, leaf_spheres, n.count, visible);
+    for (u32 i = 0; i < count; ++i) {
+      u32 id = objects[n.first + visible[i]];
+      result->push_back(id);
+    }
+  }
+}
+
+void SpatialBVH::query_sphere(const vec4& sphere, DynArray<u32>* result) const {
+  ASSERT(result != nullptr);
+  if (nodes.size() == 0) {
+    return;
+  }
+  u32 stack[SPATIAL_BVH_MAX_DEPTH];
+  u32 top = 0;
+  stack[top++] = 0;
+  while (top > 0) {
+    const Node& n = nodes[stack[--top]];
+    if (!sphere_overlaps_box(sphere, n.bounds_min, n.bounds_max)) {
+      continue;
+    }
+    if (n.count == 0) {
+      ASSERT(top + 2 <= SPATIAL_BVH_MAX_DEPTH);
+      stack[top++] = n.first;
+      stack[top++] = n.first + 1;
+      continue;
+    }
+    for (u32 i = n.first; i < n.first + n.count; ++i) {
+      if (spheres_overlap(sphere, spheres[objects[i]])) {
+        u32 id = objects[i];
+        result->push_back(id);
+      }
+    }
+  }
+}
+
+u32 SpatialBVH::query_ray(const vec3& origin, const vec3& direction, f32 max_distance,
+    f32* distance) const {
+  if (nodes.size() == 0) {
+    return SPATIAL_NONE;
+  }
+  const vec3 dir = unit_direction(direction);
+  const vec3 inv = inverse(dir);
+  f32 nearest = max_distance;
+  u32 hit = SPATIAL_NONE;
+
+  u32 stack[SPATIAL_BVH_MAX_DEPTH];
+  u32 top = 0;
+  stack[top++] = 0;
+  while (top > 0) {
+    const Node& n = nodes[stack[--top]];
+    if (!ray_hits_box(origin, inv, n.bounds_min, n.bounds_max, nearest)) {
+      continue;
+    }
+    if (n.count == 0) {
+      ASSERT(top + 2 <= SPATIAL_BVH_MAX_DEPTH);
+      stack[top++] = n.first;
+      stack[top++] = n.first + 1;
+      continue;
+    }
+    for (u32 i = n.first; i < n.first + n.count; ++i) {
+      f32 t;
+      if (ray_hits_sphere(origin, dir, spheres[objects[i]], &t) && t < nearest) {
+        nearest = t;
+        hit = objects[i];
+      }
+    }
+  }
+  if (hit != SPATIAL_NONE && distance != nullptr) {
+    *distance = nearest;
+  }
+  return hit;
+}
+
+namespace {
+
+constexpr u32 cBenchFirstCount = 1024;
+constexpr u32 cBenchQueries = 1000;
+constexpr u32 cBenchFrustumRepeats = 20;
+constexpr f32 cBenchSpacing = 8.0F; // park area per object, in metres
+constexpr f32 cBenchCellSize = 16.0F;
+
+// xorshift32, the benchmark parks are the same every run
+f32 bench_random(u32* state) {
+  u32 x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+  return f32(x) / f32(U32_MAX);
+}
+
+f64 elapsed_ms(u64 start) {
+  return f64(system_time_ns() - start) * 1.0e-6;
+}
+
+// Frustum, ray and sphere queries on a refitted tree against a linear
+// scan of the moved spheres, returns how many results differ.
+u32 refit_mismatches(const SpatialBVH& bvh, const vec4* spheres, u32 count, const Frustum& frustum,
+    f32 side, u32* state, DynArray<u32>* found) {
+  u32 linear_visible = 0;
+  for (u32 i = 0; i < count; ++i) {
+    linear_visible += frustum_test_sphere(frustum, spheres[i]) ? 1 : 0;
+  }
+  found->reset();
+  bvh.query_frustum(frustum, found);
+  u32 mismatches = (u32)found->size() != linear_visible;
+
+  for (u32 q = 0; q < cBenchQueries; ++q) {
+    const vec3 origin(bench_random(state) * side, 30.0F, bench_random(state) * side);
+    const vec3 direction = unit_direction(vec3(bench_random(state) - 0.5F, -1.0F,
+        bench_random(state) - 0.5F));
+    u32 linear_hit = SPATIAL_NONE;
+    f32 nearest = 1000.0F;
+    for (u32 i = 0; i < count; ++i) {
+      f32 t;
+      if (ray_hits_sphere(origin, direction, spheres[i], &t) && t < nearest) {
+        nearest = t;
+        linear_hit = i;
+      }
+    }
+    mismatches += bvh.query_ray(origin, direction, 1000.0F, nullptr) != linear_hit;
+
+    const vec4 query(bench_random(state) * side, 5.0F, bench_random(state) * side, 20.0F);
+    u32 linear_found = 0;
+    for (u32 i = 0; i < count; ++i) {
+      linear_found += spheres_overlap(query, spheres[i]) ? 1 : 0;
+    }
+    found->reset();
+    bvh.query_sphere(query, found);
+    mismatches += (u32)found->size() != linear_found;
+  }
+  return mismatches;
+}
+
+} // namespace
+
+// Queries run against both structures and a linear scan, and again on
+// the BVH once a tenth of the objects moved, a result that differs from
+// the scan fails the benchmark.
+bool spatial_benchmark(u32 max_objects) {
+  DynamicAllocator allocator;
+  if (!allocator.startup(MiB(512))) {
+    return false;
+  }
+
+  DynArray<vec4> spheres;
+  DynArray<u32> found;
+  spheres.init(&allocator, MemoryTag::Mesh);
+  found.init(&allocator, MemoryTag::Mesh);
+  SpatialGrid grid;
+  SpatialBVH bvh;
+  grid.init(&allocator);
+  bvh.init(&allocator);
+
+  bool result = true;
+  for (u32 count = cBenchFirstCount; count <= max_objects && result; count *= 4) {
+    u32 state = 0x9E3779B9;
+    const f32 side = sqrtf(f32(count) * cBenchSpacing * cBenchSpacing);
+    spheres.reset();
+    for (u32 i = 0; i < count; ++i) {
+      vec4 sphere(bench_random(&state) * side, bench_random(&state) * 10.0F,
+          bench_random(&state) * side, 0.5F + bench_random(&state) * 2.5F);
+      spheres.push_back(sphere);
+    }
+
+    u64 start = system_time_ns();
+    grid.build(spheres.data(), count, cBenchCellSize);
+    const f64 grid_build = elapsed_ms(start);
+    start = system_time_ns();
+    bvh.build(spheres.data(), count);
+    const f64 bvh_build = elapsed_ms(start);
+
+    // Standing at a corner of the park looking across it
+    const mat4 view = mat4_translate(0.0F, -10.0F, 0.0F) * mat4_rotate_y(Math::RADIANS(-135.0F));
+    Frustum frustum;
+    frustum_from_matrix(&frustum, view * mat4_perspective(45.0F, 0.1F, 1000.0F, 16.0F / 9.0F));
+
+    u32 linear_visible = 0;
+    u32 grid_visible = 0;
+    u32 bvh_visible = 0;
+    found.reset();
+    for (u32 i = 0; i < count; ++i) {
+      u32 unset = 0;
+      found.push_back(unset);
+    }
+    start = system_time_ns();
+    for (u32 r = 0; r < cBenchFrustumRepeats; ++r) {
+      linear_visible = frustum_cull_spheres(frustum, spheres.data(), count, found.data());
+    }
+    const f64 linear_frustum = elapsed_ms(start) / cBenchFrustumRepeats;
+    start = system_time_ns();
+    for (u32 r = 0; r < cBenchFrustumRepeats; ++r) {
+      found.reset();
+      grid.query_frustum(frustum, &found);
+      grid_visible = (u32)found.size();
+    }
+    const f64 grid_frustum = elapsed_ms(start) / cBenchFrustumRepeats;
+    start = system_time_ns();
+    for (u32 r = 0; r < cBenchFrustumRepeats; ++r) {
+      found.reset();
+      bvh.query_frustum(frustum, &found);
+      bvh_visible = (u32)found.size();
+    }
+    const f64 bvh_frustum = elapsed_ms(start) / cBenchFrustumRepeats;
+
+    // Rays from above pointing down and across, like picking
+    u32 ray_mismatches = 0;
+    f64 linear_ray = 0.0;
+    f64 grid_ray = 0.0;
+    f64 bvh_ray = 0.0;
+    for (u32 q = 0; q < cBenchQueries; ++q) {
+      const vec3 origin(bench_random(&state) * side, 30.0F, bench_random(&state) * side);
+      const vec3 direction = unit_direction(vec3(bench_random(&state) - 0.5F, -1.0F,
+          bench_random(&state) - 0.5F));
+
+      start = system_time_ns();
+      u32 linear_hit = SPATIAL_NONE;
+      f32 nearest = 1000.0F;
+      for (u32 i = 0; i < count; ++i) {
+        f32 t;
+        if (ray_hits_sphere(origin, direction, spheres[i], &t) && t < nearest) {
+          nearest = t;
+          linear_hit = i;
+        }
+      }
+      linear_ray += elapsed_ms(start);
+      start = system_time_ns();
+      const u32 grid_hit = grid.query_ray(origin, direction, 1000.0F, nullptr);
+      grid_ray += elapsed_ms(start);
+      start = system_time_ns();
+      const u32 bvh_hit = bvh.query_ray(origin, direction, 1000.0F, nullptr);
+      bvh_ray += elapsed_ms(start);
+      ray_mismatches += (grid_hit != linear_hit) + (bvh_hit != linear_hit);
+    }
+
+    // Proximity queries of about one ride's footprint
+    u32 sphere_mismatches = 0;
+    f64 linear_sphere = 0.0;
+    f64 grid_sphere = 0.0;
+    f64 bvh_sphere = 0.0;
+    for (u32 q = 0; q < cBenchQueries; ++q) {
+      const vec4 query(bench_random(&state) * side, 5.0F, bench_random(&state) * side, 20.0F);
+
+      start = system_time_ns();
+      u32 linear_found = 0;
+      for (u32 i = 0; i < count; ++i) {
+        linear_found += spheres_overlap(query, spheres[i]) ? 1 : 0;
+      }
+      linear_sphere += elapsed_ms(start);
+      found.reset();
+      start = system_time_ns();
+      grid.query_sphere(query, &found);
+      grid_sphere += elapsed_ms(start);
+      const u32 grid_found = (u32)found.size();
+      found.reset();
+      start = system_time_ns();
+      bvh.query_sphere(query, &found);
+      bvh_sphere += elapsed_ms(start);
+      sphere_mismatches += (grid_found != linear_found) + ((u32)found.size() != linear_found);
+    }
+
+    // Rides moving: a tenth of the objects shift by a few metres
+    start = system_time_ns();
+    for (u32 i = 0; i < count; i += 10) {
+      vec4 moved = spheres[i];
+      moved.x += bench_random(&state) * 4.0F - 2.0F;
+      moved.z += bench_random(&state) * 4.0F - 2.0F;
+      bvh.set_sphere(i, moved);
+      spheres[i] = moved;
+    }
+    const f64 refit = elapsed_ms(start);
+    const u32 refit_mismatch = refit_mismatches(bvh, spheres.data(), count, frustum, side, &state, &found);
+    start = system_time_ns();
+    const bool rebuilt = bvh.rebuild_if_degraded();
+    const f64 rebuild = elapsed_ms(start);
+
+    LOG_INFO("Spatial benchmark: %u objects", count);
+    LOG_INFO("  build    grid %0.3f ms, bvh %0.3f ms", grid_build, bvh_build);
+    LOG_INFO("  frustum  linear %0.3f ms, grid %0.3f ms, bvh %0.3f ms, %u visible",
+        linear_frustum, grid_frustum, bvh_frustum, linear_visible);
+    LOG_INFO("  ray      linear %0.2f us, grid %0.2f us, bvh %0.2f us per query",
+        linear_ray * 1.0e3 / cBenchQueries, grid_ray * 1.0e3 / cBenchQueries, bvh_ray * 1.0e3 / cBenchQueries);
+    LOG_INFO("  sphere   linear %0.2f us, grid %0.2f us, bvh %0.2f us per query",
+        linear_sphere * 1.0e3 / cBenchQueries, grid_sphere * 1.0e3 / cBenchQueries,
+        bvh_sphere * 1.0e3 / cBenchQueries);
+    LOG_INFO("  refit    %u moved %0.3f ms, rebuild %s %0.3f ms", (count + 9) / 10, refit,
+        rebuilt ? "ran" : "skipped", rebuild);
+
+    if (grid_visible != linear_visible || bvh_visible != linear_visible
+        || ray_mismatches != 0 || sphere_mismatches != 0 || refit_mismatch != 0) {
+      LOG_ERROR("Spatial benchmark: results differ from the linear scan (visible %u/%u/%u, "
+          "%u ray, %u sphere, %u refit mismatches)", linear_visible, grid_visible, bvh_visible,
+          ray_mismatches, sphere_mismatches, refit_mismatch);
+      result = false;
+    }
+  }
+
+  grid.cleanup();
+  bvh.cleanup();
+  found.clear();
+  spheres.clear();
+  allocator.shutdown();
+  return result;
+}
+
+} // namespace Themepark
@@ -0,0 +1,113 @@
+// spatial.h
+// Kostya Leshenko
+// CS447P
+// Themepark
+
+#pragma once
+
+#include "defines.h"
+#include "memory.h"
+#include "dynarray.h"
+#include "vec3.h"
+#include "vec4.h"
+#include "culling.h"
+
+#define SPATIAL_NONE U32_MAX
+#define SPATIAL_BVH_LEAF_SIZE 4          // objects per leaf
+#define SPATIAL_BVH_MAX_DEPTH 64         // traversal stack size
+#define SPATIAL_BVH_REBUILD_GROWTH 1.5F  // refit node area allowed before a rebuild
+
+namespace Themepark {
+
+// Objects are bounding spheres (xyz centre, w radius) identified by
+// their index in the array they were built from. Queries append the
+// ids they find to result, ray queries return the nearest hit.
+
+// Static partition for scenery. Objects are bucketed by centre into
+// square cells on x and z, a cell's bounds grow to hold all of its
+// spheres so every object lives in exactly one cell.
+class SpatialGrid final {
+  DISABLE_COPY_AND_MOVE(SpatialGrid);
+public:
+  SpatialGrid() = default;
+  ~SpatialGrid() = default;
+
+  bool init(DynamicAllocator* allocator);
+  void cleanup();
+
+  void build(const vec4* spheres, u32 count, f32 cell_size);
+
+  void query_frustum(const Frustum& frustum, DynArray<u32>* result) const;
+  void query_sphere(const vec4& sphere, DynArray<u32>* result) const;
+  u32 query_ray(const vec3& origin, const vec3& direction, f32 max_distance, f32* distance) const;
+
+  u32 object_count() const { return (u32)ids.size(); }
+
+private:
+  u32 cell_of(f32 x, f32 z) const;
+
+  DynArray<vec4> spheres;    // sorted by cell
+  DynArray<u32> ids;         // object id of each sorted sphere
+  DynArray<u32> cell_starts; // cell i holds [cell_starts[i], cell_starts[i + 1])
+  DynArray<vec3> cell_mins;
+  DynArray<vec3> cell_maxs;
+  vec3 origin;
+  vec3 bounds_min; // of every sphere
+  vec3 bounds_max;
+  f32 cell_size = 1.0F;
+  f32 max_radius = 0.0F;
+  u32 cells_x = 0;
+  u32 cells_z = 0;
+};
+
+// Bounding volume hierarchy for objects that move. set_sphere refits
+// the leaf's ancestors, rebuild_if_degraded rebuilds the tree once the
+// refits have grown its nodes too far past the last build.
+class SpatialBVH final {
+  DISABLE_COPY_AND_MOVE(SpatialBVH);
+public:
+  SpatialBVH() = default;
+  ~SpatialBVH() = default;
+
+  bool init(DynamicAllocator* allocator);
+  void cleanup();
+
+  void build(const vec4* spheres, u32 count);
+  void set_sphere(u32 object, const vec4& sphere);
+  bool rebuild_if_degraded(); // true when the tree was rebuilt
+
+  void query_frustum(const Frustum& frustum, DynArray<u32>* result) const;
+  void query_sphere(const vec4& sphere, DynArray<u32>* result) const;
+  u32 query_ray(const vec3& origin, const vec3& direction, f32 max_distance, f32* distance) const;
+
+  u32 object_count() const { return (u32)spheres.size(); }
+
+private:
+  // Leaves hold count objects from first in objects, inner nodes have
+  // count 0 and their children at first and first + 1.
+  struct Node {
+    vec3 bounds_min;
+    u32 first;
+    vec3 bounds_max;
+    u32 count;
+  };
+
+  void rebuild();
+  void build_node(u32 node, u32 first, u32 count);
+  void fit_node(u32 node);
+  f32 node_area(u32 node) const;
+
+  DynArray<Node> nodes;
+  DynArray<u32> parents;
+  DynArray<u32> objects;      // object ids in leaf order
+  DynArray<u32> object_leaves;
+  DynArray<vec4> spheres;     // by object id
+  f32 total_area = 0.0F;
+  f32 built_area = 0.0F;
+};
+
+// Builds and queries both structures over growing random parks, next
+// to linear scans over the same spheres.
+bool spatial_benchmark(u32 max_objects);
+
+} // namespace Themepark
@@ -5,6 +5,16 @@
 
 #include "system.h"
 #include "logging.h"
+#include "memory.h"
+
+#ifdef LINUX_BUILD
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define FRAME_MEMORY_SIZE MiB(4)
 
 namespace Themepark {
 
@@ -97,8 +107,14 @@ void system_run(SystemContext* context, Input* input) {
   u64 previous_frame_time = 0;
   u64 current_frame_time = 0;
 
+  if (context->frame_memory_size == 0) {
+    context->frame_memory_size = FRAME_MEMORY_SIZE;
+  }
+  FrameAllocator frame_allocator(context->frame_memory_size);
+
   RunContext run_context = {0};
   run_context.input = input;
+  run_context.frame_allocator = &frame_allocator;
   run_context.width = context->width;
   run_context.height = context->height;
 
@@ -120,11 +136,18 @@ void system_run(SystemContext* context, Input* input) {
       run_context.delta_time = double(current_frame_time - previous_frame_time) * 1.0e-9;
       previous_frame_time = current_frame_time;
 
+      frame_allocator.reset();
       context->client_run(&run_context);
       SDL_GL_SwapWindow(context->window);
     }
   }
   context->client_shutdown();
+
+  u64 frame_peak = frame_allocator.current()->peak_used();
+  if (frame_allocator.previous()->peak_used() > frame_peak) {
+    frame_peak = frame_allocator.previous()->peak_used();
+  }
+  LOG_INFO("Frame memory peak: %llu of %llu bytes", frame_peak, context->frame_memory_size);
 }
 
 void system_shutdown(SystemContext* context) {
@@ -160,6 +183,136 @@ void system_mutex_destroy(SystemMutex* m) {
   m->mutex = nullptr;
 }
 
+bool system_condition_create(SystemCondition* c) {
+  ASSERT(c != nullptr);
+  c->condition = SDL_CreateCondition();
+  ASSERT(c->condition != nullptr);
+  return c->condition == nullptr ? false : true;
+}
+
+void system_condition_wait(SystemCondition* c, SystemMutex* m) {
+  ASSERT(c != nullptr && c->condition != nullptr);
+  ASSERT(m != nullptr && m->mutex != nullptr);
+  SDL_WaitCondition(c->condition, m->mutex);
+}
+
+void system_condition_signal(SystemCondition* c) {
+  ASSERT(c != nullptr && c->condition != nullptr);
+  SDL_SignalCondition(c->condition);
+}
+
+void system_condition_broadcast(SystemCondition* c) {
+  ASSERT(c != nullptr && c->condition != nullptr);
+  SDL_BroadcastCondition(c->condition);
+}
+
+void system_condition_destroy(SystemCondition* c) {
+  ASSERT(c != nullptr && c->condition != nullptr);
+  SDL_DestroyCondition(c->condition);
+  c->condition = nullptr;
+}
+
+bool system_thread_create(SystemThread* t, SystemThreadFunction function, const char* name, void* data) {
+  ASSERT(t != nullptr && function != nullptr);
+  t->thread = SDL_CreateThread(function, name, data);
+  if (t->thread == nullptr) {
+    LOG_ERROR("System: failed to create thread %s, %s", name, SDL_GetError());
+    return false;
+  }
+  return true;
+}
+
+void system_thread_join(SystemThread* t) {
+  ASSERT(t != nullptr && t->thread != nullptr);
+  SDL_WaitThread(t->thread, nullptr);
+  t->thread = nullptr;
+}
+
+u32 system_cpu_count() {
+  const i32 count = SDL_GetNumLogicalCPUCores();
+  return count > 0 ? (u32)count : 1;
+}
+
+u64 system_time_ns() {
+  return SDL_GetTicksNS();
+}
+
+bool system_map_file(SystemMappedFile* file, const char* filename) {
+  ASSERT(file != nullptr);
+  memset(file, 0, sizeof(SystemMappedFile));
+  if (filename == nullptr) {
+    return false;
+  }
+
+#ifdef LINUX_BUILD
+  const i32 fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    LOG_ERROR("Failed to open %s!", filename);
+    return false;
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+    LOG_ERROR("Failed to stat %s!", filename);
+    close(fd);
+    return false;
+  }
+
+  void* data = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    LOG_ERROR("Failed to map %s!", filename);
+    return false;
+  }
+
+  madvise(data, (size_t)info.st_size, MADV_SEQUENTIAL);
+  file->data = (const u8*)data;
+  file->size = (u64)info.st_size;
+  file->mapped = true;
+#else
+  size_t size = 0;
+  void* data = SDL_LoadFile(filename, &size);
+  if (data == nullptr || size == 0) {
+    LOG_ERROR("Failed to read %s, %s", filename, SDL_GetError());
+    SDL_free(data);
+    return false;
+  }
+
+  file->data = (const u8*)data;
+  file->size = (u64)size;
+  file->mapped = false;
+#endif
+
+  return true;
+}
+
+void system_unmap_file(SystemMappedFile* file) {
+  ASSERT(file != nullptr);
+  if (file->data == nullptr) {
+    return;
+  }
+
+#ifdef LINUX_BUILD
+  munmap((void*)file->data, (size_t)file->size);
+#else
+  SDL_free((void*)file->data);
+#endif
+
+  memset(file, 0, sizeof(SystemMappedFile));
+}
+
+bool system_file_info(const char* filename, u64* size, u64* modify_time) {
+  ASSERT(size != nullptr && modify_time != nullptr);
+  SDL_PathInfo info;
+  if (filename == nullptr || !SDL_GetPathInfo(filename, &info) || info.type != SDL_PATHTYPE_FILE) {
+    return false;
+  }
+
+  *size = info.size;
+  *modify_time = (u64)info.modify_time;
+  return true;
+}
+
 const char* system_base_dir(const char* filename) {
   thread_local static char file_path[MAX_PATH];
   u64 len = SDL_strlcpy(file_path, SDL_GetBasePath(), MAX_PATH); 
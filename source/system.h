@@ -13,8 +13,11 @@
 
 namespace Themepark {
 
+class FrameAllocator;
+
 typedef struct RunContext {
   Input* input;
+  FrameAllocator* frame_allocator;
   f64 delta_time;
   u32 width;
   u32 height;
@@ -27,6 +30,7 @@ typedef void (*ClientShutdownCallback)();
 typedef struct SystemContext {
   u32 width;
   u32 height;
+  u64 frame_memory_size;
   u8* appname;
   SDL_Window* window;
   SDL_GLContext glcontext;
@@ -51,6 +55,40 @@ void system_mutex_lock(SystemMutex* m);
 void system_mutex_unlock(SystemMutex* m);
 void system_mutex_destroy(SystemMutex* m);
 
+typedef struct SystemCondition {
+  SDL_Condition* condition;
+} SystemCondition;
+
+bool system_condition_create(SystemCondition* c);
+void system_condition_wait(SystemCondition* c, SystemMutex* m);
+void system_condition_signal(SystemCondition* c);
+void system_condition_broadcast(SystemCondition* c);
+void system_condition_destroy(SystemCondition* c);
+
+typedef i32 (*SystemThreadFunction)(void* data);
+
+typedef struct SystemThread {
+  SDL_Thread* thread;
+} SystemThread;
+
+bool system_thread_create(SystemThread* t, SystemThreadFunction function, const char* name, void* data);
+void system_thread_join(SystemThread* t);
+u32 system_cpu_count();
+
+u64 system_time_ns();
+
+typedef struct SystemMappedFile {
+  const u8* data;
+  u64 size;
+  bool mapped;
+} SystemMappedFile;
+
+// Maps a whole file read-only, falls back to reading it into memory
+// where mapping is not available.
+bool system_map_file(SystemMappedFile* file, const char* filename);
+void system_unmap_file(SystemMappedFile* file);
+bool system_file_info(const char* filename, u64* size, u64* modify_time);
+
 const char* system_base_dir(const char* file_name);
 
 } // namespace Themepark
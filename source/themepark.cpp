@@ -15,15 +15,22 @@
 #include "camera.h"
 #include "image.h"
 #include "hierarchical.h"
+#include "jobs.h"
+#include "dds.h"
+#include "spatial.h"
 
 #define TESSELLATION_MAX 15
+#define NOT_LOADED U32_MAX
 
 namespace Themepark {
 
-u32 va_platform = 0;
-u32 va_tent = 0;
-u32 va_skybox = 0;
-u32 va_octahedron = 0;
+u32 va_platform = NOT_LOADED;
+u32 va_tent = NOT_LOADED;
+u32 va_skybox = NOT_LOADED;
+u32 va_octahedron = NOT_LOADED;
+u32 va_base = NOT_LOADED;
+u32 va_wheel = NOT_LOADED;
+u32 va_basket = NOT_LOADED;
 u32 world_program = 0;
 u32 platform_texture = 0;
 u32 ground_texture = 0;
@@ -31,80 +38,158 @@ u32 skybox_texture = 0;
 u32 skybox_program = 0;
 u32 balloon_program = 0;
 u32 tent_color = 0;
-u32 tent_texture = 0;
-u32 ferris_color = 0;
+u32 material_program = 0;
+MaterialSet park_materials = {};
+
+// Layers of park_materials
+constexpr u32 MATERIAL_TENT = 0;
+constexpr u32 MATERIAL_TENT_STRIPED = 1;
+constexpr u32 MATERIAL_FERRIS = 2;
+constexpr u32 MATERIAL_COUNT = 3;
+
+constexpr u32 FERRIS_WHEEL_NODE = 1; // child of the base, parent of the baskets
+constexpr u32 FERRIS_WHEEL_COUNT = 2;
+constexpr f32 STATS_LOG_INTERVAL = 1.0F; // seconds between culling reports
+constexpr f32 TENT_SCALE = 2.5F;
+constexpr f32 BALLOON_DRIFT = 1.25F; // longest wind offset, see themepark_run
+constexpr f32 SCENERY_CELL_SIZE = 16.0F;
 
 bool wireframe = false;
+bool ferris_ready = false;
+bool scenery_ready = false;
 f32 wheel_rotation_angle = 0.0F;
 i32 tess_level = 0;
 i32 tess_step = 1;
 
+u64 startup_time = 0;
+bool first_frame = true;
+u32 assets_pending = 0;
+u32 assets_failed = 0;
+f32 stats_log_time = 0.0F;
+
 DynamicAllocator allocator;
+JobSystem jobs;
 Renderer renderer;
 Camera camera;
 CameraMatrixBlock camera_block;
 DynArray<vec4> tent_data;
+// Kept on the CPU so the instances can be culled every frame.
+DynArray<mat4> tent_transforms;
+DynArray<mat4> balloon_transforms;
+
+// Tents and balloons never move and live in a grid, ids below the tent
+// count are tents and the rest balloons. Every ferris wheel placement is
+// a ride in the BVH, refitted as the wheels turn.
+SpatialGrid scenery;
+SpatialBVH rides;
+DynArray<u32> visible_ids;
 HierarchicalModel ferris_wheel;
 
-bool load_skybox_images(Image* images, DynamicAllocator* allocator);
-void free_skybox_images(Image* images, DynamicAllocator* allocator);
+// Assets are decoded by the job system and uploaded by the finish
+// callbacks, which run on the render thread in themepark_run.
+struct MeshAsset {
+  const char* filename;
+  Mesh* mesh;
+  u32* vertex_array;
+  bool loaded;
+};
+
+struct TextureAsset {
+  const char* filename;
+  Image image;
+  u32* texture;
+  bool loaded;
+  CompressedImage compressed; // cooked .dds next to the .tga, preferred when present
+};
+
+Mesh skybox_mesh(&allocator);
+Mesh platform_mesh(&allocator);
+Mesh tent_mesh(&allocator);
+Mesh octahedron_mesh(&allocator);
+Mesh base_mesh(&allocator);
+Mesh wheel_mesh(&allocator);
+Mesh basket_mesh(&allocator);
+
+MeshAsset mesh_assets[] = {
+  {"assets/cube.obj", &skybox_mesh, &va_skybox, false},
+  {"assets/platform.obj", &platform_mesh, &va_platform, false},
+  {"assets/tent.obj", &tent_mesh, &va_tent, false},
+  {"assets/octahedron.obj", &octahedron_mesh, &va_octahedron, false},
+  {"assets/base.obj", &base_mesh, &va_base, false},
+  {"assets/wheel.obj", &wheel_mesh, &va_wheel, false},
+  {"assets/basket.obj", &basket_mesh, &va_basket, false},
+};
+
+TextureAsset texture_assets[] = {
+  {"assets/platform2.tga", {}, &platform_texture, false},
+  {"assets/ground.tga", {}, &ground_texture, false},
+};
+
+// Same sized textures packed into park_materials, in material order.
+TextureAsset material_assets[MATERIAL_COUNT] = {
+  {"assets/tent_color.tga", {}, nullptr, false},
+  {"assets/tent_texture.tga", {}, nullptr, false},
+  {"assets/ferris_color.tga", {}, nullptr, false},
+};
+
+// Cube map faces in the order build_texture_cube expects.
+TextureAsset skybox_assets[6] = {
+  {"assets/pz.tga", {}, nullptr, false},
+  {"assets/nz.tga", {}, nullptr, false},
+  {"assets/px.tga", {}, nullptr, false},
+  {"assets/nx.tga", {}, nullptr, false},
+  {"assets/py.tga", {}, nullptr, false},
+  {"assets/ny.tga", {}, nullptr, false},
+};
+
+constexpr u32 mesh_asset_count = sizeof(mesh_assets) / sizeof(MeshAsset);
+constexpr u32 texture_asset_count = sizeof(texture_assets) / sizeof(TextureAsset);
+
 bool load_vec4_file(DynArray<vec4>* data, const char* filename);
 bool build_shader_programs();
-bool build_mesh_vertex_arrays(); //TODO:
-bool build_texture_objects();    //TODO:
 bool build_ferris_wheel();
+bool build_scenery();
+vec4 ride_bounds(u32 placement);
+u32 stage_visible(FrameAllocator* frame, const DynArray<mat4>& transforms, u32 first_id, mat4** staged);
+bool build_park_instances();
+void submit_asset_jobs();
+void asset_finished();
 
 bool themepark_startup(u32 view_width, u32 view_height) {
-  if (!allocator.startup(MiB(50))) {
-    return false;
-  }
-
-  if (!renderer.startup(&allocator)) {
-    return false;
-  }
+  startup_time = system_time_ns();
 
-  Mesh platform(&allocator);
-  if (!platform.load_from_obj(system_base_dir("assets/platform.obj"))) {
+  if (!allocator.startup(MiB(50), true)) {
     return false;
   }
 
-  Mesh tent(&allocator);
-  if (!tent.load_from_obj(system_base_dir("assets/tent.obj"))) {
+  u32 workers = system_cpu_count() > 1 ? system_cpu_count() - 1 : 1;
+  if (!jobs.startup(&allocator, workers)) {
     return false;
   }
 
-  Mesh skybox(&allocator);
-  if (!skybox.load_from_obj(system_base_dir("assets/cube.obj"))) {
-    return false;
-  }
-
-  Mesh octahedron(&allocator);
-  if (!octahedron.load_from_obj(system_base_dir("assets/octahedron.obj"))) {
+  if (!renderer.startup(&allocator)) {
     return false;
   }
 
   tent_data.init(&allocator, MemoryTag::Mesh);
+  tent_transforms.init(&allocator, MemoryTag::Mesh);
+  balloon_transforms.init(&allocator, MemoryTag::Mesh);
+  visible_ids.init(&allocator, MemoryTag::Mesh);
+  scenery.init(&allocator);
+  rides.init(&allocator);
   if (!load_vec4_file(&tent_data, system_base_dir("assets/tent.map"))) {
     return false;
   }
 
-  if (!build_shader_programs()) {
-    return false;
-  }
-
-  if (!build_texture_objects()) {
+  if (!build_park_instances()) {
     return false;
-
   }
 
-  if (!build_ferris_wheel()) {
+  if (!build_shader_programs()) {
     return false;
   }
 
-  va_skybox = renderer.build_vertex_array(&skybox);
-  va_platform = renderer.build_vertex_array(&platform);
-  va_tent = renderer.build_vertex_array(&tent);
-  va_octahedron = renderer.build_vertex_array(&octahedron);
+  submit_asset_jobs();
 
   camera.startup(vec3{0.0F, 10.0F, 5.0F}, vec3(0.0F, 1.0F, 0.0F), -90, 0);
   renderer.set_clear_color(0.0F, 0.2F, 0.5F);
@@ -115,7 +200,18 @@ bool themepark_startup(u32 view_width, u32 view_height) {
 }
 
 void themepark_run(RunContext* context) {
-  static const vec4 zero(0, 0, 0, 0);
+  if (first_frame) {
+    LOG_INFO("Time to first frame: %0.2f ms", f64(system_time_ns() - startup_time) * 1.0e-6);
+    first_frame = false;
+  }
+
+  jobs.run_finished();
+  if (!ferris_ready && va_base != NOT_LOADED && va_wheel != NOT_LOADED && va_basket != NOT_LOADED) {
+    ferris_ready = build_ferris_wheel();
+  }
+  if (!scenery_ready && va_tent != NOT_LOADED && va_octahedron != NOT_LOADED) {
+    scenery_ready = build_scenery();
+  }
 
   if (context->input->w_key_pressed() && !context->input->w_key_was_pressed()) {
     wireframe = !wireframe;
@@ -131,143 +227,317 @@ void themepark_run(RunContext* context) {
     tess_level = tess_level + tess_step;
   }
 
-  mat4 model = mat4_translate(0, 0, 0);
   memset(&camera_block, 0, sizeof(CameraMatrixBlock));
   camera.update_view_matrices(&camera_block, context->input, context->delta_time);
   mat4 projection = mat4_perspective(45.0F, 0.1F, 1000.0F, f32(context->width) / f32(context->height));
 
-  renderer.begin_frame();
-  glDepthMask(GL_FALSE); //TODO:
-  //glFrontFace(GL_CW);    //TODO:
-  renderer.use_shader_program(skybox_program);
-  renderer.shader_set_uniform(
-      renderer.shader_uniform_location(skybox_program, "view"), camera_block.rotation);
-  renderer.shader_set_uniform(
-      renderer.shader_uniform_location(skybox_program, "projection"), projection);
-  renderer.shader_set_uniform(renderer.shader_uniform_location(skybox_program, "skybox_texture"),
-      renderer.use_texture_cube(skybox_texture));
-
-  renderer.draw_vertex_array(va_skybox);
-  //glFrontFace(GL_CCW);  //TODO:
-  glDepthMask(GL_TRUE); //TODO:
-
-  renderer.use_shader_program(world_program);
-  renderer.shader_set_uniform(renderer.shader_uniform_location(world_program, "instance_data"), &zero, 1);
-
-  model = mat4_scale(0.5F, 1.0F, 0.5F);
-  renderer.shader_set_uniform(
-      renderer.shader_uniform_location(world_program, "model"), model);
-  renderer.shader_set_uniform(
-      renderer.shader_uniform_location(world_program, "view"), camera_block.view);
-  renderer.shader_set_uniform(
-      renderer.shader_uniform_location(world_program, "projection"), projection);
-
-  renderer.shader_set_uniform(renderer.shader_uniform_location(world_program, "first_texture"),
-      renderer.use_texture_2d(platform_texture));
-  renderer.shader_set_uniform(renderer.shader_uniform_location(world_program, "second_texture"),
-      renderer.use_texture_2d(ground_texture));
-  renderer.draw_vertex_array(va_platform);
-
-  wheel_rotation_angle += (10.0F * context->delta_time);
-  ferris_wheel.shader_program = world_program;
-
-  ferris_wheel.hierarchy[1].rotation = mat4_rotate_z(Math::RADIANS(wheel_rotation_angle));
-  const ModelNode& wheel = ferris_wheel.hierarchy[1];
-  for (i8 i = 0; i < wheel.child_count; ++i) {
-    u32 idx = wheel.child_idx[i];
-    ferris_wheel.hierarchy[idx].rotation = mat4_rotate_z(Math::RADIANS(-wheel_rotation_angle));
+  // Camera data is written once per frame and shared by every program
+  // through the FrameBlock binding.
+  FrameBlock frame_block;
+  frame_block.view = camera_block.view;
+  frame_block.projection = projection;
+  frame_block.sky_view = camera_block.rotation;
+  frame_block.view_inverse = mat4_inverse_rigid(camera_block.view);
+
+  Frustum frustum;
+  Camera::frustum(&frustum, camera_block, projection);
+
+  // Counts of the last completed frame
+  stats_log_time += context->delta_time;
+  if (stats_log_time >= STATS_LOG_INTERVAL) {
+    const RenderStats& stats = renderer.frame_stats();
+    LOG_INFO("Frame: %u draws, %u state changes, %u skipped by the cache, %u visible, %u culled, "
+        "scenery %u of %u visible", stats.draws, stats.state_changes, stats.skipped_changes,
+        stats.visible, stats.culled, (u32)visible_ids.size(), scenery.object_count());
+    stats_log_time = 0.0F;
   }
 
-  renderer.shader_set_uniform(renderer.shader_uniform_location(world_program, "first_texture"),
-      renderer.use_texture_2d(ferris_color));
-  renderer.shader_set_uniform(renderer.shader_uniform_location(world_program, "second_texture"),
-      renderer.use_texture_2d(ferris_color));
+  renderer.begin_frame();
+  renderer.set_frame_block(frame_block);
+  renderer.set_cull_frustum(&frustum);
+
+  // Draws are queued in any order, the renderer sorts them by state
+  // before executing them in end_frame.
+  if (va_skybox != NOT_LOADED && skybox_texture != 0) {
+    DrawCommand sky = {};
+    sky.pass = RenderPass::Background;
+    sky.program = skybox_program;
+    sky.vertex_array = va_skybox;
+    sky.textures[0] = skybox_texture;
+    sky.texture_type = TextureType::Cube;
+    renderer.queue_draw(sky, mat4_identity());
+  }
 
-  ferris_wheel.hierarchy[0].rotation = mat4_identity();
-  ferris_wheel.hierarchy[0].translation = mat4_translate(-6, 11.45F, -39);
-  renderer.draw_hierarchical(&ferris_wheel);
+  if (va_platform != NOT_LOADED && platform_texture != 0 && ground_texture != 0) {
+    DrawCommand platform = {};
+    platform.pass = RenderPass::Opaque;
+    platform.program = world_program;
+    platform.vertex_array = va_platform;
+    platform.textures[0] = platform_texture;
+    platform.textures[1] = ground_texture;
+    renderer.queue_draw(platform, mat4_scale(0.5F, 1.0F, 0.5F));
+  }
 
-  ferris_wheel.hierarchy[0].rotation = mat4_rotate_y(Math::RADIANS(90));
-  ferris_wheel.hierarchy[0].translation = mat4_translate(-59.7, 11.45F, 43.9);
-  renderer.draw_hierarchical(&ferris_wheel);
+  wheel_rotation_angle += (10.0F * context->delta_time);
 
-  model = mat4_scale(2.5F, 2.5F, 2.5F);
-  renderer.shader_set_uniform(renderer.shader_uniform_location(world_program, "model"), model);
-  renderer.shader_set_uniform(renderer.shader_uniform_location(world_program, "instance_data"),
-      tent_data.data(), tent_data.size());
-  renderer.shader_set_uniform(renderer.shader_uniform_location(world_program, "first_texture"),
-      renderer.use_texture_2d(tent_texture));
-  renderer.shader_set_uniform(renderer.shader_uniform_location(world_program, "second_texture"),
-      renderer.use_texture_2d(tent_texture));
+  // Tents and the ferris wheel share the material program and texture,
+  // the tents pick their material per instance.
+  DrawCommand material = {};
+  material.pass = RenderPass::Opaque;
+  material.program = material_program;
+  material.textures[0] = park_materials.texture;
+  material.texture_type = TextureType::Array;
+
+  if (ferris_ready && park_materials.count > 0) {
+    // Baskets counter rotate to stay upright, the bases never move and
+    // keep their cached transforms.
+    const mat4 wheel_rotation = mat4_rotate_z(Math::RADIANS(wheel_rotation_angle));
+    const mat4 basket_rotation = mat4_rotate_z(Math::RADIANS(-wheel_rotation_angle));
+
+    DrawCommand ferris = material;
+    ferris.material = MATERIAL_FERRIS;
+
+    // Both wheels are placements of one model and turn together, each
+    // node is a single instanced draw.
+    ferris_wheel.shader_program = material_program;
+    ferris_wheel.set_rotation(FERRIS_WHEEL_NODE, wheel_rotation);
+    for (u32 i = FERRIS_WHEEL_NODE + 1; i < ferris_wheel.node_count(); ++i) {
+      if (ferris_wheel.parents[i] == FERRIS_WHEEL_NODE) {
+        ferris_wheel.set_rotation(i, basket_rotation);
+      }
+    }
+    if (ferris_wheel.update() > 0) {
+      for (u32 p = 0; p < ferris_wheel.placement_count(); ++p) {
+        rides.set_sphere(p, ride_bounds(p));
+      }
+      rides.rebuild_if_degraded();
+    }
 
-  renderer.draw_vertex_array_instanced(va_tent, tent_data.size());
+    visible_ids.reset();
+    rides.query_frustum(frustum, &visible_ids);
+    if (visible_ids.size() > 0) {
+      renderer.queue_hierarchical(&ferris_wheel, ferris);
+    }
+  }
 
-  renderer.use_shader_program(balloon_program);
-  renderer.shader_set_uniform(renderer.shader_uniform_location(balloon_program, "tess_level"), tess_level);
-  renderer.shader_set_uniform(renderer.shader_uniform_location(balloon_program, "view"), camera_block.view);
-  renderer.shader_set_uniform(renderer.shader_uniform_location(balloon_program, "projection"), projection);
-  renderer.shader_set_uniform(renderer.shader_uniform_location(balloon_program, "skybox_texture"),
-      renderer.use_texture_cube(skybox_texture));
+  // Visible scenery is gathered from the grid into per kind instance
+  // lists, those draws skip the renderer's own per instance culling.
+  const u32 tent_count = (u32)tent_transforms.size();
+  visible_ids.reset();
+  if (scenery_ready) {
+    scenery.query_frustum(frustum, &visible_ids);
+  }
 
-  //renderer.draw_vertex_array_triangle_patches_instanced(va_octahedron, tent_data.size()); //TODO: Doesn't work correctly :/
-  f32 wind_x = 0.9F * Math::sin(Math::RADIANS(wheel_rotation_angle));
-  f32 wind_y = 0.5F * Math::cos(Math::RADIANS(wheel_rotation_angle));
-  f32 wind_z = 0.7F * Math::sin(Math::RADIANS(wheel_rotation_angle));
+  if (scenery_ready && park_materials.count > 0) {
+    mat4* staged = nullptr;
+    const u32 staged_count = stage_visible(context->frame_allocator, tent_transforms, 0, &staged);
+    if (staged_count > 0) {
+      DrawCommand tents = material;
+      tents.vertex_array = va_tent;
+      tents.material = MATERIAL_TENT;
+      tents.instances = renderer.push_instances(staged, staged_count);
+      renderer.queue_draw(tents, mat4_scale(TENT_SCALE, TENT_SCALE, TENT_SCALE));
+    }
+  }
 
-  for (u32 i = 0; i < tent_data.size(); ++i) {
-    model = mat4_translate(tent_data[i].x + wind_x, tent_data[i].y + 9.0 + wind_y, tent_data[i].z + wind_z);
-    renderer.shader_set_uniform(renderer.shader_uniform_location(balloon_program, "model"), model);
-    renderer.draw_vertex_array_triangle_patches(va_octahedron);
+  if (scenery_ready && skybox_texture != 0) {
+    renderer.use_shader_program(balloon_program);
+    renderer.shader_set_uniform(renderer.shader_uniform_location(balloon_program, "tess_level"), tess_level);
+
+    // Every balloon drifts with the same wind, which leaves the instance
+    // transforms static and the whole flock a single draw.
+    f32 wind_x = 0.9F * Math::sin(Math::RADIANS(wheel_rotation_angle));
+    f32 wind_y = 0.5F * Math::cos(Math::RADIANS(wheel_rotation_angle));
+    f32 wind_z = 0.7F * Math::sin(Math::RADIANS(wheel_rotation_angle));
+
+    mat4* staged = nullptr;
+    const u32 staged_count = stage_visible(context->frame_allocator, balloon_transforms, tent_count, &staged);
+    if (staged_count > 0) {
+      DrawCommand balloons = {};
+      balloons.pass = RenderPass::Opaque;
+      balloons.primitive = DrawPrimitive::Patches;
+      balloons.program = balloon_program;
+      balloons.vertex_array = va_octahedron;
+      balloons.textures[0] = skybox_texture;
+      balloons.texture_type = TextureType::Cube;
+      balloons.instances = renderer.push_instances(staged, staged_count);
+      renderer.queue_draw(balloons, mat4_translate(wind_x, wind_y, wind_z));
+    }
   }
 
   renderer.end_frame();
 }
 
 void themepark_shutdown() {
+  // Workers are joined first, whatever they decoded but never uploaded
+  // is released here.
+  jobs.shutdown();
+  for (u32 i = 0; i < mesh_asset_count; ++i) {
+    mesh_assets[i].mesh->release();
+  }
+  for (u32 i = 0; i < texture_asset_count; ++i) {
+    if (texture_assets[i].image.data != nullptr) {
+      free_image(&texture_assets[i].image, &allocator);
+    }
+    free_dds_file(&texture_assets[i].compressed);
+  }
+  for (u32 i = 0; i < 6; ++i) {
+    if (skybox_assets[i].image.data != nullptr) {
+      free_image(&skybox_assets[i].image, &allocator);
+    }
+  }
+  for (u32 i = 0; i < MATERIAL_COUNT; ++i) {
+    if (material_assets[i].image.data != nullptr) {
+      free_image(&material_assets[i].image, &allocator);
+    }
+  }
+
   tent_data.clear();
+  tent_transforms.clear();
+  balloon_transforms.clear();
+  visible_ids.clear();
+  scenery.cleanup();
+  rides.cleanup();
+  if (ferris_ready) {
+    ferris_wheel.cleanup();
+  }
   renderer.shutdown();
+  memory_report_stats(&allocator);
   allocator.shutdown();
 }
 
 bool build_ferris_wheel() {
   mat4 rotation = mat4_identity();
-  mat4 translation = mat4_identity();
+  vec3 translation;
+
+  DynArray<vec4> basket_positions;
+  basket_positions.init(&allocator, MemoryTag::Mesh);
+  if (!load_vec4_file(&basket_positions, system_base_dir("assets/basket.map"))) {
+    return false;
+  }
+
+  const mat4 placements[FERRIS_WHEEL_COUNT] = {
+    mat4_translate(-6, 11.45F, -39),
+    mat4_rotate_y(Math::RADIANS(90)) * mat4_translate(-59.7, 11.45F, 43.9),
+  };
 
   ferris_wheel.init(&allocator);
+  ferris_wheel.set_placement_count(FERRIS_WHEEL_COUNT);
+  for (u32 w = 0; w < FERRIS_WHEEL_COUNT; ++w) {
+    ferris_wheel.set_placement(w, placements[w]);
+  }
 
-  Mesh base(&allocator);
-  if (!base.load_from_obj(system_base_dir("assets/base.obj"))) {
-    return false;
+  u32 parent = ferris_wheel.set_root_node(va_base, rotation, translation);
+  parent = ferris_wheel.add_child_node(parent, va_wheel, rotation, translation, nullptr, 0);
+  ASSERT(parent == FERRIS_WHEEL_NODE);
+
+  for (u64 i = 0; i < basket_positions.size(); ++i) {
+    const vec4& p = basket_positions[i];
+    ferris_wheel.add_child_node(parent, va_basket, rotation, vec3(p.x, p.y, p.z), nullptr, 0);
   }
 
-  u32 va = renderer.build_vertex_array(&base);
-  u32 parent = ferris_wheel.set_root_node(va, rotation, translation);
+  ferris_wheel.update();
+  vec4 bounds[FERRIS_WHEEL_COUNT];
+  for (u32 w = 0; w < FERRIS_WHEEL_COUNT; ++w) {
+    bounds[w] = ride_bounds(w);
+  }
+  rides.build(bounds, FERRIS_WHEEL_COUNT);
 
-  Mesh wheel(&allocator);
-  if (!wheel.load_from_obj(system_base_dir("assets/wheel.obj"))) {
-    return false;
+  basket_positions.clear();
+  return true;
+}
+
+// Spheres of the scenery once the tent and balloon meshes are in,
+// balloons are widened by how far the wind can carry them.
+bool build_scenery() {
+  const u32 tent_count = (u32)tent_transforms.size();
+  const u32 count = tent_count + (u32)balloon_transforms.size();
+  DynArray<vec4> spheres;
+  spheres.init(&allocator, MemoryTag::Mesh);
+
+  const vec4 tent_sphere = transform_sphere(tent_mesh.bounding_sphere,
+      mat4_scale(TENT_SCALE, TENT_SCALE, TENT_SCALE));
+  for (u32 i = 0; i < tent_count; ++i) {
+    vec4 sphere = transform_sphere(tent_sphere, tent_transforms[i]);
+    spheres.push_back(sphere);
+  }
+  for (u32 i = tent_count; i < count; ++i) {
+    vec4 sphere = transform_sphere(octahedron_mesh.bounding_sphere, balloon_transforms[i - tent_count]);
+    sphere.w += BALLOON_DRIFT;
+    spheres.push_back(sphere);
   }
 
-  va = renderer.build_vertex_array(&wheel);
-  parent = ferris_wheel.add_child_node(parent, va, rotation, translation, nullptr, 0);
+  scenery.build(spheres.data(), count, SCENERY_CELL_SIZE);
+  spheres.clear();
+  return true;
+}
 
-  Mesh basket(&allocator);
-  if (!basket.load_from_obj(system_base_dir("assets/basket.obj"))) {
-    return false;
+// Bounding sphere of the mesh uploaded as vertex_array.
+vec4 mesh_sphere(u32 vertex_array) {
+  for (u32 i = 0; i < mesh_asset_count; ++i) {
+    if (*mesh_assets[i].vertex_array == vertex_array) {
+      return mesh_assets[i].mesh->bounding_sphere;
+    }
   }
+  return vec4();
+}
 
-  DynArray<vec4> basket_positions;
-  basket_positions.init(&allocator, MemoryTag::Mesh);
-  if (!load_vec4_file(&basket_positions, system_base_dir("assets/basket.map"))) {
-    return false;
+// Sphere around every node of one placement, centred on their box.
+vec4 ride_bounds(u32 placement) {
+  const u32 count = ferris_wheel.node_count();
+  vec3 bounds_min(FLT_MAX, FLT_MAX, FLT_MAX);
+  vec3 bounds_max(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+  for (u32 i = 0; i < count; ++i) {
+    const vec4 s = transform_sphere(mesh_sphere(ferris_wheel.vertex_arrays[i]),
+        ferris_wheel.node_world_transforms(i)[placement]);
+    bounds_min.set(fminf(bounds_min.x, s.x - s.w), fminf(bounds_min.y, s.y - s.w), fminf(bounds_min.z, s.z - s.w));
+    bounds_max.set(fmaxf(bounds_max.x, s.x + s.w), fmaxf(bounds_max.y, s.y + s.w), fmaxf(bounds_max.z, s.z + s.w));
   }
 
-  va = renderer.build_vertex_array(&basket);
-  for (u64 i = 0; i < basket_positions.size(); ++i) {
-    const vec4& p = basket_positions[i];
-    ferris_wheel.add_child_node(parent, va, rotation, mat4_translate(p.x, p.y, p.z), nullptr, 0);
+  const vec3 center = (bounds_min + bounds_max) * 0.5F;
+  f32 radius = 0.0F;
+  for (u32 i = 0; i < count; ++i) {
+    const vec4 s = transform_sphere(mesh_sphere(ferris_wheel.vertex_arrays[i]),
+        ferris_wheel.node_world_transforms(i)[placement]);
+    const vec3 d(s.x - center.x, s.y - center.y, s.z - center.z);
+    radius = fmaxf(radius, sqrtf(dot(d, d)) + s.w);
+  }
+  return vec4(center.x, center.y, center.z, radius);
+}
+
+// Copies the transforms of the visible ids in [first_id, first_id +
+// transforms.size()) into the frame arena, they only have to live until
+// push_instances has copied them into the uniform ring.
+u32 stage_visible(FrameAllocator* frame, const DynArray<mat4>& transforms, u32 first_id, mat4** staged) {
+  *staged = nullptr;
+  if (visible_ids.size() == 0) {
+    return 0;
+  }
+  *staged = (mat4*)frame->allocate(sizeof(mat4) * visible_ids.size());
+  if (*staged == nullptr) {
+    return 0;
+  }
+
+  u32 count = 0;
+  const u64 last_id = first_id + transforms.size();
+  for (u64 i = 0; i < visible_ids.size(); ++i) {
+    if (visible_ids[i] >= first_id && visible_ids[i] < last_id) {
+      (*staged)[count++] = transforms[visible_ids[i] - first_id];
+    }
   }
+  return count;
+}
 
+bool build_park_instances() {
+  // tent.map holds a position and a rotation about y in degrees.
+  for (u64 i = 0; i < tent_data.size(); ++i) {
+    const vec4& t = tent_data[i];
+    mat4 tent = mat4_rotate_y(Math::RADIANS(t.w)) * mat4_translate(t.x, t.y, t.z);
+    instance_set_material(&tent, (u32)(i % 2) * (MATERIAL_TENT_STRIPED - MATERIAL_TENT));
+    mat4 balloon = mat4_translate(t.x, t.y + 9.0F, t.z);
+    tent_transforms.push_back(tent);
+    balloon_transforms.push_back(balloon);
+  }
   return true;
 }
 
@@ -301,6 +571,12 @@ bool build_shader_programs() {
     renderer.program_add_shader(idx, ShaderType::Vertex, &vertex);
     renderer.program_add_shader(idx, ShaderType::Fragment, &fragment);
     world_program = renderer.link_shader_program(idx);
+
+    // Same sources, texturing from park_materials
+    idx = renderer.begin_shader_program();
+    renderer.program_add_shader(idx, ShaderType::Vertex, &vertex, "#define MATERIALS 1\n");
+    renderer.program_add_shader(idx, ShaderType::Fragment, &fragment, "#define MATERIALS 1\n");
+    material_program = renderer.link_shader_program(idx);
   } else {
     return false;
   }
@@ -329,63 +605,168 @@ bool build_shader_programs() {
   return true;
 }
 
-bool build_texture_objects() {
-  Image skybox_images[6];
-  if (!load_skybox_images(skybox_images, &allocator)) {
-    return false;
-  }
-  skybox_texture = renderer.build_texture_cube(skybox_images);
-  free_skybox_images(skybox_images, &allocator);
-  Image tent_color{};
-  if (!load_tga_file(&tent_color, &allocator, system_base_dir("assets/tent_color.tga"))) {
-    return false;
-  }
-  tent_texture = renderer.build_texture_2d(&tent_color);
-  free_image(&tent_color, &allocator);
+void load_mesh_job(void* data) {
+  MeshAsset* asset = (MeshAsset*)data;
+  asset->loaded = asset->mesh->load(system_base_dir(asset->filename));
+}
 
-  Image image{};
-  if (!load_tga_file(&image, &allocator, system_base_dir("assets/platform2.tga"))) {
-    return false;
+// Meshes and textures stream in over the next frames, the asset is
+// published and its source released once the renderer is done with it.
+void mesh_streamed(u32 vertex_array, void* data) {
+  MeshAsset* asset = (MeshAsset*)data;
+  *asset->vertex_array = vertex_array;
+  asset->mesh->release();
+  asset_finished();
+}
+
+void upload_mesh_job(void* data) {
+  MeshAsset* asset = (MeshAsset*)data;
+  if (asset->loaded) {
+    renderer.stream_vertex_array(asset->mesh, mesh_streamed, asset);
+    return;
   }
+  assets_failed++;
+  asset->mesh->release();
+  asset_finished();
+}
 
-  Image image2{};
-  if (!load_tga_file(&image2, &allocator, system_base_dir("assets/ground.tga"))) {
-    return false;
+void load_texture_job(void* data) {
+  TextureAsset* asset = (TextureAsset*)data;
+  asset->loaded = load_tga_file(&asset->image, &allocator, system_base_dir(asset->filename));
+}
+
+// Tries the cooked asset first, see --cook-texture.
+void load_texture_2d_job(void* data) {
+  TextureAsset* asset = (TextureAsset*)data;
+  char dds_filename[MAX_PATH];
+  const u64 length = strlen(asset->filename);
+  if (length > 4 && length < MAX_PATH) {
+    memcpy(dds_filename, asset->filename, length - 4);
+    memcpy(dds_filename + length - 4, ".dds", 5);
+
+    // A .dds older than its .tga is stale and the TGA is loaded instead
+    u64 size = 0;
+    u64 tga_time = 0;
+    u64 dds_time = 0;
+    const bool has_tga = system_file_info(system_base_dir(asset->filename), &size, &tga_time);
+    const char* path = system_base_dir(dds_filename);
+    if (path != nullptr && system_file_info(path, &size, &dds_time)
+        && (!has_tga || dds_time >= tga_time)
+        && load_dds_file(&asset->compressed, path)) {
+      asset->loaded = true;
+      return;
+    }
   }
+  load_texture_job(data);
+}
 
-  platform_texture = renderer.build_texture_2d(&image);
-  ground_texture = renderer.build_texture_2d(&image2);
+void texture_streamed(u32 texture, void* data) {
+  TextureAsset* asset = (TextureAsset*)data;
+  *asset->texture = texture;
+  free_image(&asset->image, &allocator);
+  memset(&asset->image, 0, sizeof(Image));
+  asset_finished();
+}
 
-  Image image3{};
-  if (!load_tga_file(&image3, &allocator, system_base_dir("assets/ferris_color.tga"))) {
-    return false;
+void upload_texture_job(void* data) {
+  TextureAsset* asset = (TextureAsset*)data;
+  if (asset->loaded && asset->compressed.level_count > 0) {
+    *asset->texture = renderer.build_texture_compressed(&asset->compressed);
+    free_dds_file(&asset->compressed);
+  } else if (asset->loaded) {
+    renderer.stream_texture_2d(&asset->image, texture_streamed, asset);
+    return;
+  } else {
+    assets_failed++;
   }
+  memset(&asset->image, 0, sizeof(Image));
+  asset_finished();
+}
 
-  ferris_color = renderer.build_texture_2d(&image3);
+void upload_skybox_face_job(void* data) {
+  static u32 faces_done = 0;
+  faces_done++;
 
-  return true;
+  if (faces_done == 6) {
+    Image images[6];
+    bool complete = true;
+    for (u32 i = 0; i < 6; ++i) {
+      images[i] = skybox_assets[i].image;
+      complete = complete && skybox_assets[i].loaded;
+    }
+
+    if (complete) {
+      skybox_texture = renderer.build_texture_cube(images);
+    } else {
+      assets_failed++;
+    }
+
+    for (u32 i = 0; i < 6; ++i) {
+      if (skybox_assets[i].loaded) {
+        free_image(&skybox_assets[i].image, &allocator);
+      }
+      memset(&skybox_assets[i].image, 0, sizeof(Image));
+    }
+  }
+  asset_finished();
 }
 
-bool load_skybox_images(Image* images, DynamicAllocator* allocator) {
-  if (load_tga_file(&images[0], allocator, system_base_dir("assets/pz.tga"))) {
-    if (load_tga_file(&images[1], allocator, system_base_dir("assets/nz.tga"))) {
-      if (load_tga_file(&images[2], allocator, system_base_dir("assets/px.tga"))) {
-        if (load_tga_file(&images[3], allocator, system_base_dir("assets/nx.tga"))) {
-          if (load_tga_file(&images[4], allocator, system_base_dir("assets/py.tga"))) {
-            if (load_tga_file(&images[5], allocator, system_base_dir("assets/ny.tga"))) {
-              return true;
-            }
-          }
-        }
+void upload_material_job(void* data) {
+  static u32 materials_done = 0;
+  materials_done++;
+
+  if (materials_done == MATERIAL_COUNT) {
+    Image images[MATERIAL_COUNT];
+    bool complete = true;
+    for (u32 i = 0; i < MATERIAL_COUNT; ++i) {
+      images[i] = material_assets[i].image;
+      complete = complete && material_assets[i].loaded;
+    }
+
+    if (complete) {
+      park_materials = renderer.build_material_set(images, MATERIAL_COUNT);
+    }
+    if (park_materials.count == 0) {
+      assets_failed++;
+    }
+
+    for (u32 i = 0; i < MATERIAL_COUNT; ++i) {
+      if (material_assets[i].loaded) {
+        free_image(&material_assets[i].image, &allocator);
       }
+      memset(&material_assets[i].image, 0, sizeof(Image));
     }
   }
-  return false;
+  asset_finished();
+}
+
+void submit_asset_jobs() {
+  assets_pending = mesh_asset_count + texture_asset_count + 6 + MATERIAL_COUNT;
+
+  // Biggest files first so the workers finish at about the same time.
+  jobs.submit(load_texture_2d_job, upload_texture_job, &texture_assets[1]);
+  for (u32 i = 0; i < 6; ++i) {
+    jobs.submit(load_texture_job, upload_skybox_face_job, &skybox_assets[i]);
+  }
+  for (u32 i = 0; i < MATERIAL_COUNT; ++i) {
+    jobs.submit(load_texture_job, upload_material_job, &material_assets[i]);
+  }
+  for (u32 i = 0; i < texture_asset_count; ++i) {
+    if (i != 1) {
+      jobs.submit(load_texture_2d_job, upload_texture_job, &texture_assets[i]);
+    }
+  }
+  for (u32 i = 0; i < mesh_asset_count; ++i) {
+    jobs.submit(load_mesh_job, upload_mesh_job, &mesh_assets[i]);
+  }
 }
 
-void free_skybox_images(Image* images, DynamicAllocator* allocator) {
-  for (i8 i = 0; i < 6; i++) {
-    free_image(&images[i], allocator);
+void asset_finished() {
+  ASSERT(assets_pending > 0);
+  assets_pending--;
+  if (assets_pending == 0) {
+    LOG_INFO("All assets loaded in %0.2f ms (%u failed)",
+        f64(system_time_ns() - startup_time) * 1.0e-6, assets_failed);
   }
 }
 